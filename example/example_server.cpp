@@ -4,6 +4,7 @@
 #include <atomic>
 #include <cassert>
 #include <csignal>
+#include <cstring>
 #include <thread>
 
 #include <fcntl.h>
@@ -54,6 +55,16 @@ mwrs_ret my_stat(mwrs_sv_client * client, const char * id, mwrs_status * stat_ou
   return MWRS_E_SERVERERR;
 }
 
+mwrs_ret my_locate(const char * id, char * path_out, size_t path_size)
+{
+  // Ids are paths
+  if (strlen(id) >= path_size)
+    return MWRS_E_ARGS;
+
+  strcpy(path_out, id);
+  return MWRS_SUCCESS;
+}
+
 } // namespace
 
 
@@ -67,6 +78,7 @@ int main(int argc, char ** argv)
   sv_callbacks.disconnect = my_disconnect;
   sv_callbacks.open       = my_open;
   sv_callbacks.stat       = my_stat;
+  sv_callbacks.locate     = my_locate;
 
   printf("Server init\n");
 
@@ -75,7 +87,7 @@ int main(int argc, char ** argv)
 
   printf("Server init OK\n");
 
-  // TODO Poll and send events
+  // Events for watched files are sent by the server, see my_locate
   while (!stop_flag)
   {
     std::this_thread::sleep_for(std::chrono::seconds(1));
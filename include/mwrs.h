@@ -92,9 +92,23 @@ typedef struct _mwrs_status
   mwrs_size size;
   int mtime;
 
+  /// Sequence number of the last event of the resource, see `mwrs_watch_since`
+  long long version;
+
 } mwrs_status;
 
 
+/**
+ * Byte range of a resource.
+ */
+typedef struct _mwrs_range
+{
+  mwrs_size offset;
+  mwrs_size size;
+
+} mwrs_range;
+
+
 /**
  * Watcher identifier.
  */
@@ -195,6 +209,27 @@ typedef enum _mwrs_open_flags
   MWRS_OPEN_APPEND = 0x00000004,
   MWRS_OPEN_SEEK   = 0x00000008,
 
+  /**
+   * Send small resources inline in the open response, without a file handle.
+   * Only honored for read-only opens of resources under the server threshold,
+   * the flag is cleared from the resource handle otherwise.
+   */
+  MWRS_OPEN_INLINE = 0x00000010,
+
+  /**
+   * Wait for the resource to be available instead of failing with E_NOTFOUND or E_NOTREADY.
+   * The request is held by the server and completed when a READY event is pushed for it,
+   * see `mwrs_open_wait` to set a timeout.
+   * Ignored by `mwrs_open_watch`, the READY event of the watcher tells when it is available.
+   */
+  MWRS_OPEN_WAIT = 0x00000020,
+
+  /**
+   * With `mwrs_open_watch`, READY and UPDATE events of the watcher carry the resource
+   * opened again with the same flags, see `mwrs_event::res`.
+   */
+  MWRS_OPEN_PUSH = 0x00000040,
+
   MWRS_OPEN_USER1 = 0x00010000,
   MWRS_OPEN_USER2 = 0x00020000,
   MWRS_OPEN_USER3 = 0x00040000,
@@ -225,6 +260,12 @@ typedef enum _mwrs_event_type
    */
   MWRS_EVENT_DELETE,
 
+  /**
+   * Events were missed and cannot be replayed, see `mwrs_watch_since`.
+   * Stat the resource again.
+   */
+  MWRS_EVENT_RESYNC,
+
 
   MWRS_EVENT_USER1 = 0x100,
   MWRS_EVENT_USER2,
@@ -10,6 +10,8 @@
 
 #include "mwrs.h"
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,9 +48,35 @@ typedef struct _mwrs_event
   mwrs_watcher_id watcher_id;
   mwrs_event_type type;
 
+  /// Sequence number of the event, the resource has this version after it
+  long long version;
+
+  /// Id of the resource, useful for prefix and glob watchers.
+  /// Valid until the next call to `mwrs_poll_event`, `mwrs_wait_event` or `mwrs_drain_events`.
+  const char * id;
+
+  /// Byte ranges changed by an UPDATE event, sorted and disjoint.
+  /// 0 ranges means the whole resource may have changed.
+  /// Valid as long as `id`.
+  const mwrs_range * ranges;
+  size_t range_count;
+
+  /// Resource opened again by the server, for watchers created with `MWRS_OPEN_PUSH`.
+  /// Check it with `mwrs_res_is_valid`, it must then be closed with `mwrs_close`.
+  mwrs_res res;
+
 } mwrs_event;
 
 
+/**
+ * Descriptor signaled while events are pending.
+ * On Windows, a manual-reset event HANDLE to use with the Wait functions.
+ */
+typedef void * mwrs_event_desc;
+
+#define MWRS_EVENT_DESC_INVALID ((mwrs_event_desc)0)
+
+
 /**
  * Returns 1 if the resource handle is valid, 0 otherwise.
  */
@@ -74,11 +102,36 @@ mwrs_ret MWRS_API mwrs_init(const char * server_name, int argc, const char ** ar
 mwrs_ret MWRS_API mwrs_shutdown();
 
 
+/**
+ * Remember ids the server did not find for `ttl_ms` milliseconds.
+ *
+ * Read-only opens and stats of these ids then fail with E_NOTFOUND without a request.
+ * A READY event received for an id forgets it.
+ * Default is 0, misses are not remembered.
+ */
+mwrs_ret MWRS_API mwrs_set_miss_ttl(int ttl_ms);
+
+
 /**
  * Open a resource.
+ *
+ * With `MWRS_OPEN_INLINE`, small resources are received with the response
+ * and the handle is backed by memory, check `res_out->flags` to know if it was honored.
  */
 mwrs_ret MWRS_API mwrs_open(const char * id, mwrs_open_flags flags, mwrs_res * res_out);
 
+/**
+ * Open a resource, waiting at most `timeout_ms` milliseconds for it to be available.
+ *
+ * The request is held by the server until a READY event is pushed for the resource,
+ * E_NOTFOUND or E_NOTREADY is returned if it is still not available after the timeout.
+ * A negative `timeout_ms` waits forever, 0 does not wait.
+ * `mwrs_open` with `MWRS_OPEN_WAIT` waits forever.
+ * Servers of protocol v1 cannot hold requests, waiting opens return E_NOTSUPPORTED.
+ */
+mwrs_ret MWRS_API mwrs_open_wait(const char * id, mwrs_open_flags flags, int timeout_ms,
+                                 mwrs_res * res_out);
+
 /**
  * Open a resource pointed by a valid watcher.
  */
@@ -117,9 +170,39 @@ mwrs_ret MWRS_API mwrs_stat_watch(const char * id, mwrs_status * stat_out,
  * Open a watcher to a resource.
  *
  * If the resource is available, a READY event will be produced.
+ * Watchers for the same resource share the same id and a single server subscription,
+ * each of them must be closed with `mwrs_close_watcher`.
+ * Servers of protocol v1 have no watcher, every watch function returns E_NOTSUPPORTED.
  */
 mwrs_ret MWRS_API mwrs_watch(const char * id, mwrs_watcher * watcher_out);
 
+/**
+ * Open a watcher to every resource whose id starts with `prefix`.
+ *
+ * Events carry the id of the resource, no READY event is produced on creation.
+ * These watchers cannot be used with `mwrs_watcher_open`.
+ */
+mwrs_ret MWRS_API mwrs_watch_prefix(const char * prefix, mwrs_watcher * watcher_out);
+
+/**
+ * Open a watcher to a resource, and receive the events missed since `version`.
+ *
+ * Use the version of the last event received, or of `mwrs_stat`, before reconnecting.
+ * Missed events are received in order, before newer ones. If the server no longer has them,
+ * a single RESYNC event is received instead.
+ * No READY event is produced on creation.
+ */
+mwrs_ret MWRS_API mwrs_watch_since(const char * id, long long version, mwrs_watcher * watcher_out);
+
+/**
+ * Open a watcher to every resource whose id matches the glob `pattern`.
+ *
+ * `?` matches one character and `*` any run of characters, both stop at '/'.
+ * `**` matches any run of characters, including '/'.
+ * Otherwise the behaviour is the same as `mwrs_watch_prefix`.
+ */
+mwrs_ret MWRS_API mwrs_watch_glob(const char * pattern, mwrs_watcher * watcher_out);
+
 /**
  * Close a watcher.
  *
@@ -156,6 +239,24 @@ mwrs_ret MWRS_API mwrs_poll_event(mwrs_event * event_out);
  */
 mwrs_ret MWRS_API mwrs_wait_event(mwrs_event * event_out);
 
+/**
+ * Get up to `capacity` events at once, non-blocking.
+ *
+ * `count_out` receives the number of events written to `buffer`.
+ * Returns E_AGAIN if no event is available.
+ */
+mwrs_ret MWRS_API mwrs_drain_events(mwrs_event * buffer, size_t capacity, size_t * count_out);
+
+/**
+ * Get a descriptor signaled while events are pending, to integrate with an event loop.
+ *
+ * The descriptor is owned by the library, do not close it.
+ * It stays signaled until pending events are taken with
+ * `mwrs_poll_event`, `mwrs_drain_events` or `mwrs_wait_event`.
+ * Returns MWRS_EVENT_DESC_INVALID if the client is not initialized.
+ */
+mwrs_event_desc MWRS_API mwrs_event_fd();
+
 
 #ifdef __cplusplus
 } // extern "C"
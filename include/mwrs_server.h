@@ -10,11 +10,21 @@
 
 #include "mwrs.h"
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+// Constants
+enum
+{
+  // Size of the path buffer given to the locate callback
+  MWRS_SV_PATH_MAX = 1024,
+};
+
+
 typedef struct _mwrs_sv_client
 {
   int id;
@@ -31,6 +41,10 @@ typedef enum _mwrs_sv_file_type
   /// Only supported on Windows
   MWRS_SV_WIN_HANDLE,
 
+  /// Pack file created by `mwrs_sv_pack_file`, served decompressed from the server cache.
+  /// Only supported for read-only opens.
+  MWRS_SV_PACKED_PATH,
+
 } mwrs_sv_file_type;
 
 typedef struct _mwrs_sv_res_open
@@ -98,6 +112,8 @@ typedef mwrs_ret (*mwrs_sv_callback_stat)(mwrs_sv_client * client, const char *
  * Callbacks can be invoked from any thread.
  *
  * This callback is invoked when the first watcher for `id` is added.
+ * Return anything other than `MWRS_SUCCESS` to refuse the watcher.
+ * Do not push events from this callback.
  */
 typedef mwrs_ret (*mwrs_sv_callback_watch)(const char * id);
 
@@ -107,9 +123,23 @@ typedef mwrs_ret (*mwrs_sv_callback_watch)(const char * id);
  * Callbacks can be invoked from any thread.
  *
  * This callback is invoked when the last watcher for `id` is removed.
+ * Do not push events from this callback.
  */
 typedef mwrs_ret (*mwrs_sv_callback_unwatch)(const char * id);
 
+/**
+ * Callback to locate the file backing a resource, for automatic change detection.
+ *
+ * Callbacks can be invoked from any thread.
+ *
+ * This callback is invoked after `watch`, when the first watcher for `id` is added.
+ * Fill `path_out` with a null-terminated path of at most `path_size` bytes
+ * and return `MWRS_SUCCESS` to have changes to this file pushed as events.
+ * The file does not have to exist yet, its directory does.
+ * Every other code leaves the resource unmonitored, events can still be pushed manually.
+ */
+typedef mwrs_ret (*mwrs_sv_callback_locate)(const char * id, char * path_out, size_t path_size);
+
 
 typedef struct _mwrs_sv_callbacks
 {
@@ -122,19 +152,239 @@ typedef struct _mwrs_sv_callbacks
   mwrs_sv_callback_watch watch;
   mwrs_sv_callback_unwatch unwatch;
 
+  /// Optional
+  mwrs_sv_callback_locate locate;
+
 } mwrs_sv_callbacks;
 
 
+/**
+ * Server options.
+ * Zero initialize and set the fields you need, zero selects the default value.
+ */
+typedef struct _mwrs_sv_options
+{
+  /**
+   * Maximum size, in bytes, of the decompressed pack file cache.
+   * Pack files with identical content only count once.
+   * Default is 256 MiB.
+   */
+  mwrs_size cache_size;
+
+  /**
+   * Default debounce window for events, in milliseconds.
+   * An event is held until no event of the same type has been pushed for the same resource
+   * during this window. Default is 0, events are sent immediately.
+   */
+  int debounce_ms;
+
+  /**
+   * Maximum time an event can be held by debouncing, in milliseconds.
+   * Default is 10 times the debounce window.
+   */
+  int debounce_max_latency_ms;
+
+  /**
+   * Set to 1 to disable event coalescing.
+   * By default, an event is not queued again for a client while the same event
+   * for the same watcher is still waiting to be sent.
+   */
+  int disable_event_coalescing;
+
+  /**
+   * Root directory of the resource files, for automatic change detection.
+   * Files located under it are all monitored by a single recursive watch,
+   * other files get one watch per directory.
+   * Default is NULL, every directory gets its own watch.
+   */
+  const char * monitor_root;
+
+  /**
+   * Maximum number of directory watches for automatic change detection.
+   * Resources located in other directories are not monitored.
+   * Default is 256.
+   */
+  int monitor_max_watches;
+
+  /**
+   * Number of slots of the published status table, see `mwrs_sv_publish_status`.
+   * Rounded up to a power of two, at most 3/4 of the slots can be used.
+   * Default is 0, there is no table.
+   */
+  int status_table_size;
+
+  /**
+   * Largest resource, in bytes, sent inline in open responses, see `MWRS_OPEN_INLINE`.
+   * Default is 4 KiB, a negative value disables inline opens.
+   */
+  mwrs_size inline_max_size;
+
+  /**
+   * Size, in bytes, of the shared arena of hot resources.
+   * Resources opened inline often are copied into shared memory mapped by every client,
+   * later opens are answered with their location instead of their content.
+   * Contents are only reused for the same source file, with the same size and modification time.
+   * Default is 0, there is no arena.
+   */
+  mwrs_size arena_size;
+
+  /**
+   * Number of recent inline opens after which a resource is added to the arena.
+   * Default is 8.
+   */
+  int arena_hot_threshold;
+
+  /**
+   * Number of ids remembered as not found, see `mwrs_sv_set_known_ids`.
+   * Read-only opens and stats of these ids fail with E_NOTFOUND without invoking callbacks,
+   * until a READY event is pushed for them.
+   * Only enable it if a READY event is pushed for every created resource, watched or not,
+   * and if the callbacks answer the same for every client.
+   * Default is 0, there is no cache.
+   */
+  int miss_cache_size;
+
+  /**
+   * Number of past events kept for clients catching up, see `mwrs_watch_since`.
+   * Default is 4096, a negative value disables the journal, clients then always resync.
+   */
+  int journal_size;
+
+} mwrs_sv_options;
+
+
+/**
+ * Server statistics.
+ */
+typedef struct _mwrs_sv_stats
+{
+  /// Pack files in the cache
+  mwrs_size cache_entries;
+
+  /// Distinct contents backing them, identical contents are stored once
+  mwrs_size cache_contents;
+
+  /// Decompressed size of all cached pack files
+  mwrs_size cache_logical_size;
+
+  /// Memory actually used by the cache
+  mwrs_size cache_unique_size;
+
+  /// `cache_logical_size / cache_unique_size`
+  double cache_dedup_ratio;
+
+  /// Directory watches used by automatic change detection
+  mwrs_size monitor_watches;
+
+  /// Resources monitored by automatic change detection
+  mwrs_size monitor_resources;
+
+  /// Resources in the shared arena
+  mwrs_size arena_entries;
+
+  /// Bytes used by live resources in the shared arena
+  mwrs_size arena_used_size;
+
+  /// Ids remembered as not found
+  mwrs_size miss_cache_entries;
+
+  /// Opens and stats answered as not found without invoking callbacks
+  mwrs_size miss_cache_hits;
+
+  /// Opens held until their resource is ready, see `MWRS_OPEN_WAIT`
+  mwrs_size waiting_opens;
+
+  /// Events kept for clients catching up
+  mwrs_size journal_entries;
+
+  /// Messages allocated from the heap instead of a pool, since the process started
+  mwrs_size message_heap_allocations;
+
+} mwrs_sv_stats;
+
+
 mwrs_ret MWRS_API mwrs_sv_init(const char * server_name, mwrs_sv_callbacks * callbacks);
 
+/**
+ * Same as `mwrs_sv_init`, `options` can be NULL.
+ */
+mwrs_ret MWRS_API mwrs_sv_init_ex(const char * server_name, mwrs_sv_callbacks * callbacks,
+                                  const mwrs_sv_options * options);
+
 mwrs_ret MWRS_API mwrs_sv_shutdown();
 
 
 /**
  * Push an event to all connected clients listening to a resource.
+ *
+ * Events may be debounced, see `mwrs_sv_set_debounce`.
  */
 mwrs_ret MWRS_API mwrs_sv_push_event(const char * id, mwrs_event_type type);
 
+/**
+ * Push an UPDATE event listing the byte ranges that changed.
+ *
+ * Ranges of updates merged by debouncing are merged too, clients receive them with the event.
+ * Past 256 disjoint ranges, they are replaced by the range covering all of them.
+ * Updates pushed without ranges cover the whole resource.
+ */
+mwrs_ret MWRS_API mwrs_sv_push_update_ranges(const char * id, const mwrs_range * ranges,
+                                             size_t count);
+
+/**
+ * Set the debounce window and maximum latency of events for a resource, in milliseconds.
+ *
+ * Pushing an event of another type sends the held one first, so ordering is preserved.
+ * A negative `window_ms` restores the defaults from `mwrs_sv_options`,
+ * 0 disables debouncing for this resource.
+ */
+mwrs_ret MWRS_API mwrs_sv_set_debounce(const char * id, int window_ms, int max_latency_ms);
+
+
+/**
+ * Publish the status of a resource in shared memory.
+ *
+ * Clients read published statuses directly, `mwrs_stat` does not reach the server
+ * and the stat callback is not invoked for them.
+ * Publish again whenever the status changes.
+ * Returns E_UNAVAIL if the status table is disabled or full,
+ * E_ARGS if the id is longer than 207 bytes.
+ */
+mwrs_ret MWRS_API mwrs_sv_publish_status(const char * id, const mwrs_status * status);
+
+/**
+ * Remove a status published with `mwrs_sv_publish_status`.
+ * `mwrs_stat` invokes the stat callback again for this resource.
+ */
+mwrs_ret MWRS_API mwrs_sv_unpublish_status(const char * id);
+
+
+/**
+ * Declare every resource id the server provides.
+ *
+ * Read-only opens and stats of other ids fail with E_NOTFOUND without invoking callbacks,
+ * ids are kept in a compact filter so a few undeclared ids still reach them.
+ * Ids created later are declared by pushing a READY event for them.
+ * Call with a `count` of 0 to remove the declared set.
+ */
+mwrs_ret MWRS_API mwrs_sv_set_known_ids(const char * const * ids, size_t count);
+
+
+/**
+ * Get server statistics.
+ */
+mwrs_ret MWRS_API mwrs_sv_get_stats(mwrs_sv_stats * stats_out);
+
+
+/**
+ * Compress the file at `src_path` into a pack file at `dst_path`.
+ *
+ * Pack files are split in blocks compressed independently,
+ * large files are decompressed in parallel the first time they are opened.
+ * Does not require a running server.
+ */
+mwrs_ret MWRS_API mwrs_sv_pack_file(const char * src_path, const char * dst_path);
+
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,53 @@
+/**
+ * @file    mwrs_arena.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_ARENA__HEADER_GUARD
+#define MWRS_ARENA__HEADER_GUARD
+
+#include <mwrs.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+// Content arena segment published by the server in shared memory
+//
+//   mwrs_arena_header
+//   contents, appended one after the other
+//
+// A segment is never modified once content has been appended,
+// it is replaced by a new generation when compacted.
+// Open responses give the generation, offset and size of the content.
+
+extern "C" {
+
+struct mwrs_arena_header
+{
+  uint32_t magic;
+  uint32_t generation;
+  uint64_t size; // Whole segment, header included
+};
+
+} // extern "C"
+
+
+namespace mwrs_arena
+{
+
+const uint32_t magic = 0x4152574d; // "MWRA"
+
+// Enough for the prefix, the server name and the generation
+const size_t name_max = 64 + MWRS_SERVER_NAME_MAX;
+
+inline void segment_name(char * name_out, const char * server_name, uint32_t generation)
+{
+  snprintf(name_out, name_max, "Local\\mwrs_%s_arena_%u", server_name, generation);
+}
+
+} // namespace mwrs_arena
+
+#endif // MWRS_ARENA__HEADER_GUARD
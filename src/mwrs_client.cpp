@@ -4,15 +4,27 @@
  * @license BSD 3-Clause
  */
 
+#include "mwrs_arena.hpp"
+#include "mwrs_framing.hpp"
 #include "mwrs_messages.hpp"
+#include "mwrs_protocol.hpp"
+#include "mwrs_status_table.hpp"
 #include <mwrs_client.h>
 
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
+#include <cstdio>
 #include <cstring>
+#include <deque>
+#include <iterator>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #ifdef _WIN32
 #  define VC_EXTRALEAN
@@ -37,16 +49,117 @@ struct mwrs_data;
 
 struct mwrs_plat
 {
+  mwrs_plat()
+      : event(CreateEvent(NULL, TRUE, FALSE, NULL)), io_event(CreateEvent(NULL, TRUE, FALSE, NULL))
+  {
+  }
+
+  ~mwrs_plat()
+  {
+    CloseHandle(event);
+    CloseHandle(io_event);
+  }
+
   std::mutex mutex;
   HANDLE pipe = INVALID_HANDLE_VALUE;
 
+  // Signaled when events are pending, see mwrs_event_fd
+  // Also signaled by the completion of the pending read
+  HANDLE event;
+
+  // Used for blocking I/O
+  HANDLE io_event;
+
+  // A read is kept pending so `event` is signaled when a message arrives
+  // It brings as many messages as available, they are decoded from the reader
+  OVERLAPPED read_overlapped{};
+  mwrs_framing::FrameReader<mwrs_sv_message> reader;
+  bool reading = false;
+
+  // Compact responses are expanded here, it only grows for larger inline contents
+  std::vector<char> expanded;
+
   bool disconnected = false;
+
+  // Capabilities negotiated at handshake, see mwrs_protocol
+  uint32_t caps = 0;
+
+  // Status table published by the server, read-only, null if there is none
+  HANDLE status_mapping = NULL;
+  const mwrs_status_table_header * status_table = nullptr;
+
+  // Arena segments in use, by generation
+  // The latest one stays mapped, older ones are released with their last resource
+  struct arena_view
+  {
+    const char * view;
+    uint64_t size;
+    int refs;
+  };
+  std::string server_name;
+  std::unordered_map<uint32_t, arena_view> arena_views;
+  uint32_t arena_latest = 0;
 };
 
 #endif // _WIN32
 
+// Resource sent inline by the server, or found in the arena, see MWRS_OPEN_INLINE
+struct memory_res
+{
+  const char * data = nullptr;
+  mwrs_size size     = 0;
+  mwrs_size position = 0;
+
+  // Inline content
+  std::string storage;
+
+  // Arena segment holding the content, 0 if inline
+  uint32_t generation = 0;
+};
+
+struct pending_event
+{
+  mwrs_event event;
+  std::string id;
+  std::vector<mwrs_range> ranges;
+};
+
+// Server watcher shared by every handle watching the same resource or pattern
+struct shared_watch
+{
+  std::string key;
+
+  // Handles using it, and references the server holds for this client
+  int refs        = 0;
+  int server_refs = 0;
+
+  // Set once a request with MWRS_OPEN_PUSH reached the server
+  bool push = false;
+
+  // Last known availability of the resource, from the events received
+  bool ready        = false;
+  long long version = 0;
+};
+
 struct mwrs_data
 {
+  // Events received, not yet polled
+  std::deque<pending_event> events;
+
+  // Watchers by id, and their ids by key, see watch_key
+  std::unordered_map<mwrs_watcher_id, shared_watch> watches;
+  std::unordered_map<std::string, mwrs_watcher_id> watch_keys;
+
+  // Events last taken, they hold mwrs_event::id and mwrs_event::ranges
+  std::deque<pending_event> taken;
+
+  // Ids not found by the server, with their expiration time, see mwrs_set_miss_ttl
+  int miss_ttl_ms = 0;
+  std::unordered_map<std::string, std::chrono::steady_clock::time_point> misses;
+
+  // Negotiated at handshake, see mwrs_protocol
+  uint32_t protocol = mwrs_protocol::v1;
+
   mwrs_plat plat;
 };
 
@@ -57,10 +170,41 @@ mwrs_ret plat_start(mwrs_data * client, const char * server_name, int argc, cons
 
 void plat_stop(mwrs_data * client);
 
-mwrs_ret plat_send_message(mwrs_data * client, mwrs_cl_message * message);
+/**
+ * Shut the connection down after a protocol error.
+ * Following requests fail with E_BROKEN, resources already opened stay valid.
+ */
+void plat_disconnect(mwrs_data * client);
+
+/**
+ * Send `head` followed by `data`, which both stay owned by the caller.
+ */
+mwrs_ret plat_send_message(mwrs_data * client, const void * head, std::size_t head_size,
+                           const void * data = nullptr, std::size_t data_size = 0);
 
+/**
+ * Received messages are borrowed from the connection.
+ * They stay valid until the next message is received, or `plat_update_event` is called.
+ */
 mwrs_ret plat_receive_message(mwrs_data * client, mwrs_sv_message ** message_out);
 
+// Returns E_AGAIN if no message is available
+mwrs_ret plat_poll_message(mwrs_data * client, mwrs_sv_message ** message_out);
+
+// Signal the event descriptor if events are pending, reset it otherwise
+void plat_update_event(mwrs_data * client);
+
+void * plat_event_fd(mwrs_data * client);
+
+// Null if the server does not publish statuses
+const mwrs_status_table_header * plat_status_table(mwrs_data * client);
+
+// Returns a pointer to `size` bytes at `offset` in arena segment `generation`, null on error
+const char * plat_arena_acquire(mwrs_data * client, uint32_t generation, uint64_t offset,
+                                uint64_t size);
+
+void plat_arena_release(mwrs_data * client, uint32_t generation);
+
 bool plat_res_is_valid(const mwrs_res * res);
 
 mwrs_ret plat_read(mwrs_res * res, void * buffer, mwrs_size * read_len);
@@ -80,30 +224,300 @@ void * message_alloc(size_t size) { return new char[size]{}; }
 void message_free(void * message) { delete[] message; }
 
 
+mwrs_ret common_response_get_res(mwrs_data * client, const mwrs_sv_msg_common_response * response,
+                                 mwrs_res * res_out);
+
+// Decode an event, returns false if it is malformed
+bool decode_event(const mwrs_sv_msg_event * message, pending_event * event)
+{
+  if (message->length <= offsetof(mwrs_sv_msg_event, resource_id))
+    return false;
+
+  event->event.watcher_id = message->watcher_id;
+  event->event.type       = message->event;
+  event->event.version    = (long long)message->version;
+
+  std::size_t id_max = message->length - offsetof(mwrs_sv_msg_event, resource_id);
+  std::size_t id_len = strnlen(&message->resource_id, id_max);
+  if (id_len == id_max)
+    return false;
+  event->id.assign(&message->resource_id, id_len);
+
+  // Ranges follow the null terminator
+  std::size_t ranges_max = id_max - id_len - 1;
+  if (message->range_count > ranges_max / sizeof(mwrs_range))
+    return false;
+
+  if (message->range_count > 0)
+  {
+    event->ranges.resize(message->range_count);
+    std::memcpy(event->ranges.data(), &message->resource_id + id_len + 1,
+                event->ranges.size() * sizeof(mwrs_range));
+  }
+  return true;
+}
+
+// Decode an event with a resource, returns false if it is malformed
+bool decode_event_open(mwrs_data * client, const mwrs_sv_msg_event_open * message,
+                       pending_event * event)
+{
+  const mwrs_sv_msg_common_response * response = &message->response;
+
+  const std::size_t response_offset = offsetof(mwrs_sv_msg_event_open, response);
+
+  if (message->length < sizeof(mwrs_sv_msg_event_open) ||
+      response->length < sizeof(mwrs_sv_msg_common_response) ||
+      response->length > message->length - response_offset)
+    return false;
+
+  event->event.watcher_id = message->watcher_id;
+  event->event.type       = message->event;
+  event->event.version    = (long long)message->version;
+
+  const char * id    = (const char *)response + response->length;
+  std::size_t id_max = std::min<std::size_t>(message->length - response_offset - response->length,
+                                             message->resource_id_size);
+  std::size_t id_len = strnlen(id, id_max);
+  if (id_len == id_max)
+    return false;
+  event->id.assign(id, id_len);
+
+  // Decoded last, nothing has to be closed when the event is dropped
+  if (response->status == MWRS_SUCCESS &&
+      common_response_get_res(client, response, &event->event.res) != MWRS_SUCCESS)
+    return false;
+  return true;
+}
+
+// Stores the message if it is an event, `*event_out` tells if it was one
+// Malformed events shut the connection down and return E_PROTOCOL
+mwrs_ret handle_event(mwrs_data * client, const mwrs_sv_message * message, bool * event_out)
+{
+  pending_event event{};
+
+  *event_out = message->type == MWRS_MSG_SV_EVENT || message->type == MWRS_MSG_SV_EVENT_OPEN;
+  if (!*event_out)
+    return MWRS_SUCCESS;
+
+  bool valid = message->type == MWRS_MSG_SV_EVENT
+                   ? decode_event((const mwrs_sv_msg_event *)message, &event)
+                   : decode_event_open(client, (const mwrs_sv_msg_event_open *)message, &event);
+  if (!valid)
+  {
+    plat_disconnect(client);
+    return MWRS_E_PROTOCOL;
+  }
+
+  if (event.event.type == MWRS_EVENT_READY)
+    client->misses.erase(event.id);
+
+  auto watch = client->watches.find(event.event.watcher_id);
+  if (watch != client->watches.end())
+  {
+    shared_watch & w = watch->second;
+    if (event.event.type == MWRS_EVENT_READY || event.event.type == MWRS_EVENT_UPDATE)
+      w.ready = true;
+    else if (event.event.type == MWRS_EVENT_MOVE || event.event.type == MWRS_EVENT_DELETE ||
+             event.event.type == MWRS_EVENT_RESYNC)
+      w.ready = false;
+    w.version = std::max(w.version, event.event.version);
+  }
+
+  client->events.push_back(std::move(event));
+  return MWRS_SUCCESS;
+}
+
+// The response is borrowed, the caller calls `plat_update_event` once it is decoded
 mwrs_ret receive_response(mwrs_data * client, mwrs_sv_message ** message_out)
 {
-  return plat_receive_message(client, message_out); // TODO
+  // Events can arrive before the response
+  for (;;)
+  {
+    mwrs_ret ret = plat_receive_message(client, message_out);
+    if (ret != MWRS_SUCCESS)
+      return ret;
+
+    bool event;
+    ret = handle_event(client, *message_out, &event);
+    if (ret != MWRS_SUCCESS || !event)
+      return ret;
+  }
+}
+
+// Receive all available events, if `wait` is set block until there is at least one
+// Returns E_AGAIN if no event is available
+mwrs_ret receive_events(mwrs_data * client, bool wait)
+{
+  for (;;)
+  {
+    mwrs_sv_message * message;
+    mwrs_ret ret = (wait && client->events.empty()) ? plat_receive_message(client, &message)
+                                                    : plat_poll_message(client, &message);
+    if (ret == MWRS_E_AGAIN)
+      break;
+
+    if (ret != MWRS_SUCCESS)
+    {
+      // Errors are reported once pending events are consumed
+      if (!client->events.empty())
+        break;
+      return ret;
+    }
+
+    bool event;
+    ret = handle_event(client, message, &event);
+    if (ret != MWRS_SUCCESS)
+      return ret;
+
+    // No request pending
+    if (!event)
+    {
+      plat_disconnect(client);
+      return MWRS_E_PROTOCOL;
+    }
+  }
+
+  plat_update_event(client);
+  return client->events.empty() ? MWRS_E_AGAIN : MWRS_SUCCESS;
+}
+
+// Ids and ranges stay valid until the next call taking events
+void take_event(mwrs_data * client, mwrs_event * event_out)
+{
+  client->taken.push_back(std::move(client->events.front()));
+  client->events.pop_front();
+
+  pending_event & event  = client->taken.back();
+  *event_out             = event.event;
+  event_out->id          = event.id.c_str();
+  event_out->ranges      = event.ranges.empty() ? nullptr : event.ranges.data();
+  event_out->range_count = event.ranges.size();
 }
 
+
+// Remembered misses, only used if a TTL is set
+
+const std::size_t missCacheMax = 1024;
+
+bool miss_cached(mwrs_data * client, const char * id)
+{
+  if (client->misses.empty())
+    return false;
+
+  auto it = client->misses.find(id);
+  if (it == client->misses.end())
+    return false;
+
+  if (std::chrono::steady_clock::now() < it->second)
+    return true;
+
+  client->misses.erase(it);
+  return false;
+}
+
+void miss_record(mwrs_data * client, const char * id)
+{
+  if (client->miss_ttl_ms <= 0)
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+
+  if (client->misses.size() >= missCacheMax)
+  {
+    for (auto it = client->misses.begin(); it != client->misses.end();)
+      it = now < it->second ? std::next(it) : client->misses.erase(it);
+
+    if (client->misses.size() >= missCacheMax)
+      client->misses.clear();
+  }
+
+  client->misses[id] = now + std::chrono::milliseconds(client->miss_ttl_ms);
+}
+
+// `res_id_len` does not count the null terminator
 mwrs_ret send_res_request(mwrs_data * client, mwrs_cl_msg_type type, const char * res_id,
-                          mwrs_open_flags flags = (mwrs_open_flags)0)
+                          std::size_t res_id_len, mwrs_open_flags flags = (mwrs_open_flags)0,
+                          int wait_ms = 0, uint64_t since = 0)
 {
-  std::size_t res_id_len = std::strlen(res_id);
+  if (client->protocol == mwrs_protocol::v1)
+  {
+    // v1 servers have no watcher and answer at once
+    if (!mwrs_protocol::v1_request(type) || (flags & MWRS_OPEN_WAIT))
+      return MWRS_E_NOTSUPPORTED;
+
+    mwrs_cl_msg_resource_request_v1 resource_request{};
+    resource_request.type   = type;
+    resource_request.length = (uint32_t)(sizeof(mwrs_cl_msg_resource_request_v1) + res_id_len);
+    resource_request.flags  = flags & ~mwrs_protocol::v2OpenFlags;
+
+    return plat_send_message(client, &resource_request,
+                             offsetof(mwrs_cl_msg_resource_request_v1, resource_id), res_id,
+                             res_id_len + 1);
+  }
 
-  mwrs_cl_msg_resource_request * resource_request =
-      (mwrs_cl_msg_resource_request *)message_alloc(sizeof(mwrs_cl_msg_resource_request) + res_id_len);
-  resource_request->type = type;
-  resource_request->length = (unsigned int)(sizeof(mwrs_cl_msg_resource_request) + res_id_len);
+  mwrs_cl_msg_resource_request resource_request{};
+  resource_request.type    = type;
+  resource_request.length  = (uint32_t)(sizeof(mwrs_cl_msg_resource_request) + res_id_len);
+  resource_request.flags   = flags;
+  resource_request.wait_ms = wait_ms;
+  resource_request.since   = since;
+
+  // The id is sent from the caller's string, with its null terminator in place of resource_id
+  return plat_send_message(client, &resource_request,
+                           offsetof(mwrs_cl_msg_resource_request, resource_id), res_id,
+                           res_id_len + 1);
+}
 
-  // resource_id must have null terminator
-  // We only copy data but message type contains 1 extra byte
-  std::memcpy(&resource_request->resource_id, res_id, res_id_len);
-  resource_request->flags = flags;
-  return plat_send_message(client, (mwrs_cl_message *)resource_request);
+mwrs_ret send_watcher_request(mwrs_data * client, mwrs_cl_msg_type type,
+                              mwrs_watcher_id watcher_id,
+                              mwrs_open_flags flags = (mwrs_open_flags)0)
+{
+  mwrs_cl_msg_watcher_request watcher_request{};
+  watcher_request.type       = type;
+  watcher_request.length     = sizeof(mwrs_cl_msg_watcher_request);
+  watcher_request.watcher_id = watcher_id;
+  watcher_request.flags      = flags;
+  return plat_send_message(client, &watcher_request, sizeof(watcher_request));
 }
 
-mwrs_ret common_response_get_res(const mwrs_sv_msg_common_response * response, mwrs_res * res_out)
+mwrs_ret common_response_get_res(mwrs_data * client, const mwrs_sv_msg_common_response * response,
+                                 mwrs_res * res_out)
 {
+  if (response->open_flags & MWRS_OPEN_INLINE)
+  {
+    if (response->length < sizeof(mwrs_sv_msg_common_response))
+      return MWRS_E_PROTOCOL;
+
+    memory_res * res = new memory_res;
+    res->size        = response->inline_size;
+
+    if (response->arena_generation != 0)
+    {
+      res->data = plat_arena_acquire(client, response->arena_generation, response->arena_offset,
+                                     response->inline_size);
+      if (!res->data)
+      {
+        delete res;
+        return MWRS_E_PROTOCOL;
+      }
+      res->generation = response->arena_generation;
+    }
+    else
+    {
+      if (response->inline_size > response->length - sizeof(mwrs_sv_msg_common_response))
+      {
+        delete res;
+        return MWRS_E_PROTOCOL;
+      }
+      res->storage.assign(&response->inline_data, response->inline_size);
+      res->data = res->storage.data();
+    }
+
+    res_out->flags  = response->open_flags;
+    res_out->opaque = res;
+    return MWRS_SUCCESS;
+  }
+
   res_out->flags  = response->open_flags;
   res_out->opaque = (void *)response->win_handle; // TODO platform dependant, fixme
   return MWRS_SUCCESS;
@@ -120,7 +534,206 @@ mwrs_ret common_response_get_status(const mwrs_sv_msg_common_response * response
                                     mwrs_status * stat_out)
 {
   *stat_out = response->stat;
-  return MWRS_E_SYSTEM; // TODO
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret common_response_decode(mwrs_data * client, const mwrs_sv_message * message,
+                                mwrs_res * res_out, mwrs_status * stat_out,
+                                mwrs_watcher * watcher_out)
+{
+  if (message->type != MWRS_MSG_SV_COMMON_RESPONSE ||
+      message->length < sizeof(mwrs_sv_msg_common_response))
+  {
+    plat_disconnect(client);
+    return MWRS_E_PROTOCOL;
+  }
+
+  const mwrs_sv_msg_common_response * response = (const mwrs_sv_msg_common_response *)message;
+  if (response->status == MWRS_SUCCESS)
+  {
+    if (res_out && common_response_get_res(client, response, res_out) != MWRS_SUCCESS)
+    {
+      plat_disconnect(client);
+      return MWRS_E_PROTOCOL;
+    }
+
+    if (stat_out)
+      common_response_get_status(response, stat_out);
+  }
+
+  // Watchers can come with an error, the resource is watched until it appears
+  if (watcher_out)
+    common_response_get_watcher(response, watcher_out);
+
+  return response->status;
+}
+
+// Shared by every request answered with a common response
+// Decodes the fields that are asked for, null outputs are skipped, and returns the status
+mwrs_ret receive_common_response(mwrs_data * client, mwrs_res * res_out, mwrs_status * stat_out,
+                                 mwrs_watcher * watcher_out)
+{
+  mwrs_sv_message * message;
+  mwrs_ret ret = receive_response(client, &message);
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  ret = common_response_decode(client, message, res_out, stat_out, watcher_out);
+
+  // Done with the message, its room can be read to
+  plat_update_event(client);
+  return ret;
+}
+
+// Memory resources
+
+mwrs_ret memory_read(mwrs_res * res, void * buffer, mwrs_size * read_len)
+{
+  memory_res * mem = (memory_res *)res->opaque;
+
+  mwrs_size available = mem->size - mem->position;
+  mwrs_size len       = std::max<mwrs_size>(0, std::min(*read_len, available));
+
+  if (len > 0)
+    std::memcpy(buffer, mem->data + mem->position, (std::size_t)len);
+
+  mem->position += len;
+  *read_len = len;
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret memory_seek(mwrs_res * res, mwrs_size offset, mwrs_seek_origin origin,
+                     mwrs_size * position_out)
+{
+  memory_res * mem = (memory_res *)res->opaque;
+
+  mwrs_size base = 0;
+  switch (origin)
+  {
+  case MWRS_SEEK_SET: base = 0; break;
+  case MWRS_SEEK_CUR: base = mem->position; break;
+  case MWRS_SEEK_END: base = mem->size; break;
+  default: return MWRS_E_ARGS;
+  }
+
+  // Seeking past the end is allowed, like files
+  if (base + offset < 0)
+    return MWRS_E_ARGS;
+
+  mem->position = base + offset;
+  if (position_out)
+    *position_out = mem->position;
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret memory_close(mwrs_data * client, mwrs_res * res)
+{
+  memory_res * mem = (memory_res *)res->opaque;
+
+  // Views are already unmapped if the client was shut down
+  if (mem->generation != 0 && client)
+    plat_arena_release(client, mem->generation);
+
+  delete mem;
+
+  res->flags  = (mwrs_open_flags)0;
+  res->opaque = nullptr;
+  return MWRS_SUCCESS;
+}
+
+
+// Watchers are shared by key, every handle watching the same id or pattern gets the same one
+
+std::string watch_key(mwrs_cl_msg_type type, const char * id)
+{
+  switch (type)
+  {
+  case MWRS_MSG_CL_WATCH_PREFIX: return std::string("<") + id;
+  case MWRS_MSG_CL_WATCH_GLOB: return std::string("*") + id;
+  default: return std::string("=") + id;
+  }
+}
+
+// Returns null if there is no watcher for `key` yet
+shared_watch * watch_find(mwrs_data * client, const std::string & key, mwrs_watcher_id * id_out)
+{
+  auto it = client->watch_keys.find(key);
+  if (it == client->watch_keys.end())
+    return nullptr;
+
+  *id_out = it->second;
+  return &client->watches[it->second];
+}
+
+// A server request added a reference to `watcher_id`
+shared_watch * watch_add(mwrs_data * client, const std::string & key, mwrs_watcher_id watcher_id)
+{
+  shared_watch & w = client->watches[watcher_id];
+  if (w.refs == 0)
+  {
+    w.key                   = key;
+    client->watch_keys[key] = watcher_id;
+  }
+
+  ++w.refs;
+  ++w.server_refs;
+  return &w;
+}
+
+// Same READY event the server produces for a new watcher
+void watch_queue_ready(mwrs_data * client, mwrs_watcher_id watcher_id, const shared_watch * w,
+                       const char * id)
+{
+  if (!w->ready)
+    return;
+
+  pending_event event{};
+  event.event.watcher_id = watcher_id;
+  event.event.type       = MWRS_EVENT_READY;
+  event.event.version    = w->version;
+  event.id               = id;
+  client->events.push_back(std::move(event));
+
+  plat_update_event(client);
+}
+
+
+// Shared by every watch function
+mwrs_ret watch_request(mwrs_data * client, mwrs_cl_msg_type type, const char * id,
+                       mwrs_watcher * watcher_out, uint64_t since = 0)
+{
+  std::string key = watch_key(type, id);
+
+  // Catching up needs its own replay
+  mwrs_watcher_id shared_id;
+  shared_watch * shared =
+      type != MWRS_MSG_CL_WATCH_SINCE ? watch_find(client, key, &shared_id) : nullptr;
+  if (shared)
+  {
+    ++shared->refs;
+    watcher_out->id = shared_id;
+
+    if (type == MWRS_MSG_CL_WATCH)
+      watch_queue_ready(client, shared_id, shared, id);
+    return MWRS_SUCCESS;
+  }
+
+  mwrs_ret ret;
+
+  ret = send_res_request(client, type, id, key.size() - 1, (mwrs_open_flags)0, 0, since);
+
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  mwrs_watcher watcher{};
+  ret = receive_common_response(client, nullptr, nullptr, &watcher);
+
+  if (ret == MWRS_SUCCESS)
+  {
+    *watcher_out = watcher;
+    watch_add(client, key, watcher_out->id);
+  }
+  return ret;
 }
 
 
@@ -131,203 +744,507 @@ mwrs_ret common_response_get_status(const mwrs_sv_msg_common_response * response
 
 #ifdef _WIN32
 
+// Requests up to this size are sent with a single write
+const std::size_t sendStackSize = 512;
+
 HANDLE to_win_handle(mwrs_win_handle_data mwrs_handle)
 {
   static_assert(sizeof(mwrs_win_handle_data) == 4, "mwrs_win_handle_data must be 4 bytes");
   return reinterpret_cast<HANDLE>((unsigned long long)mwrs_handle);
 }
 
+// Failures are ignored, stat then always goes through the server
+void plat_map_status_table(mwrs_data * client, const char * server_name)
+{
+  char name[64 + MWRS_SERVER_NAME_MAX];
+  std::snprintf(name, sizeof(name), "Local\\mwrs_%s_status", server_name);
+
+  HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+  if (!mapping)
+    return;
+
+  const mwrs_status_table_header * table =
+      (const mwrs_status_table_header *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+  MEMORY_BASIC_INFORMATION info{};
+  if (!table || !VirtualQuery(table, &info, sizeof(info)) ||
+      info.RegionSize < sizeof(mwrs_status_table_header) ||
+      table->magic != mwrs_status_table::magic || table->version != mwrs_status_table::version ||
+      table->slot_count == 0 || (table->slot_count & (table->slot_count - 1)) != 0 ||
+      info.RegionSize < mwrs_status_table::table_size(table->slot_count))
+  {
+    if (table)
+      UnmapViewOfFile(table);
+    CloseHandle(mapping);
+    return;
+  }
+
+  client->plat.status_mapping = mapping;
+  client->plat.status_table   = table;
+}
+// plat_map_status_table
+
+// Send a handshake in `protocol`, returns the status answered by the server
+mwrs_ret plat_handshake(mwrs_data * client, uint32_t protocol, int argc, const char ** argv)
+{
+  // Compute argv length
+  std::size_t argvlen = 0;
+  for (int i = 0; i < argc; ++i)
+    argvlen += std::strlen(argv[i]) + 1;
+
+  std::size_t head = protocol == mwrs_protocol::v2 ? offsetof(mwrs_cl_win_handshake_v2, argv)
+                                                   : offsetof(mwrs_cl_win_handshake, argv);
+
+  mwrs_cl_message * handshake = (mwrs_cl_message *)message_alloc(head + argvlen);
+  handshake->type             = MWRS_MSG_CL_WIN_HANDSHAKE;
+  handshake->length           = (uint32_t)(head + argvlen);
+
+  char * argv_dest;
+  if (protocol == mwrs_protocol::v2)
+  {
+    mwrs_cl_win_handshake_v2 * v2 = (mwrs_cl_win_handshake_v2 *)handshake;
+    v2->protocol                  = mwrs_protocol::v2;
+    v2->process_id                = GetCurrentProcessId();
+    v2->caps                      = mwrs_protocol::supportedCaps;
+    v2->argc                      = argc;
+    argv_dest                     = &v2->argv;
+  }
+  else
+  {
+    mwrs_cl_win_handshake * v1 = (mwrs_cl_win_handshake *)handshake;
+    v1->mwrs_version           = mwrs_protocol::v1;
+    v1->process_id             = GetCurrentProcessId();
+    v1->argc                   = argc;
+    argv_dest                  = &v1->argv;
+  }
+
+  for (int i = 0; i < argc; ++i)
+  {
+    std::size_t len = std::strlen(argv[i]) + 1;
+    std::memcpy(argv_dest, argv[i], len);
+    argv_dest += len;
+  }
+
+  mwrs_ret sent = plat_send_message(client, handshake, handshake->length);
+  message_free(handshake);
+  if (sent != MWRS_SUCCESS)
+    return MWRS_E_SERVERERR;
+
+  // Receive ack
+  mwrs_sv_message * ack;
+  mwrs_ret ret = plat_receive_message(client, &ack);
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  if (ack->type != MWRS_MSG_SV_WIN_HANDSHAKE_ACK || ack->length < sizeof(mwrs_sv_win_handshake_ack))
+    return MWRS_E_SERVERERR;
+
+  ret = ((mwrs_sv_win_handshake_ack *)ack)->status;
+
+  // v1 servers do not send the capabilities
+  client->protocol  = ret == MWRS_SUCCESS ? protocol : mwrs_protocol::v1;
+  client->plat.caps = 0;
+  if (ret == MWRS_SUCCESS && ack->length >= sizeof(mwrs_sv_win_handshake_ack_v2))
+    client->plat.caps = ((mwrs_sv_win_handshake_ack_v2 *)ack)->caps & mwrs_protocol::supportedCaps;
+
+  return ret;
+}
+// plat_handshake
+
 mwrs_ret plat_start(mwrs_data * client, const char * server_name, int argc, const char ** argv)
 {
   // Enough to hold "\\.\pipe\mwrs_" + server name + terminating null character
   TCHAR pipename[64 + MWRS_SERVER_NAME_MAX];
   _stprintf_s(pipename, 64 + MWRS_SERVER_NAME_MAX, TEXT("\\\\.\\pipe\\mwrs_%s"), server_name);
 
-  client->plat.pipe =
-      CreateFile(pipename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+  client->plat.pipe = CreateFile(pipename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                                 FILE_FLAG_OVERLAPPED, NULL);
 
   if (client->plat.pipe == INVALID_HANDLE_VALUE)
   {
     if (GetLastError() != ERROR_PIPE_BUSY)
       return MWRS_E_UNAVAIL; // TODO Check GetLastError for MWRS_E_SYSTEM
 
-    // Wait 2s for pipe if busy
-    if (!WaitNamedPipe(pipename, 2000))
-      return MWRS_E_SYSTEM;
+    // Wait 2s for pipe if busy
+    if (!WaitNamedPipe(pipename, 2000))
+      return MWRS_E_SYSTEM;
+
+    // Retry
+    client->plat.pipe = CreateFile(pipename, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                   OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+
+    if (client->plat.pipe == INVALID_HANDLE_VALUE)
+      return MWRS_E_UNAVAIL;
+  }
+
+  {
+    DWORD mode = PIPE_READMODE_BYTE;
+    if (!SetNamedPipeHandleState(client->plat.pipe, &mode, NULL, NULL))
+    {
+      // TODO error
+      CloseHandle(client->plat.pipe); // TODO in destructor instead
+      assert(0 && "SetNamedPipeHandleState failed");
+      return MWRS_E_SYSTEM;
+    }
+  }
+
+  {
+    // Servers only knowing v1 reject v2, the connection can still be used
+    mwrs_ret ret = plat_handshake(client, mwrs_protocol::v2, argc, argv);
+    if (ret == MWRS_E_NOTSUPPORTED)
+      ret = plat_handshake(client, mwrs_protocol::v1, argc, argv);
+
+    if (ret != MWRS_SUCCESS)
+    {
+      plat_disconnect(client);
+      return ret;
+    }
+  }
+
+  plat_map_status_table(client, server_name);
+  client->plat.server_name = server_name;
+
+  return MWRS_SUCCESS;
+}
+// plat_start
+
+void plat_stop(mwrs_data * client)
+{
+  plat_disconnect(client);
+
+  if (client->plat.status_table)
+  {
+    UnmapViewOfFile(client->plat.status_table);
+    CloseHandle(client->plat.status_mapping);
+    client->plat.status_table = nullptr;
+  }
+
+  // Remaining memory resources are invalidated
+  for (auto & view : client->plat.arena_views)
+    UnmapViewOfFile(view.second.view);
+  client->plat.arena_views.clear();
+}
+// plat_stop
+
+void plat_disconnect(mwrs_data * client)
+{
+  if (client->plat.pipe == INVALID_HANDLE_VALUE)
+    return;
+
+  if (client->plat.reading)
+  {
+    // The overlapped structure must outlive the read
+    DWORD unused;
+    CancelIo(client->plat.pipe);
+    GetOverlappedResult(client->plat.pipe, &client->plat.read_overlapped, &unused, TRUE);
+    client->plat.reading = false;
+  }
+
+  CloseHandle(client->plat.pipe);
+  client->plat.pipe         = INVALID_HANDLE_VALUE;
+  client->plat.disconnected = true;
+
+  // Wakes up the event loops, they see the disconnection
+  SetEvent(client->plat.event);
+}
+// plat_disconnect
+
+// Blocking write on the overlapped pipe
+mwrs_ret plat_write(mwrs_data * client, const void * buffer, DWORD len)
+{
+  const char * ptr = (const char *)buffer;
+  while (len > 0)
+  {
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = client->plat.io_event;
+
+    DWORD done = 0;
+    BOOL ok    = WriteFile(client->plat.pipe, ptr, len, NULL, &overlapped);
+
+    if (!ok && GetLastError() != ERROR_IO_PENDING)
+      ok = FALSE;
+    else
+      ok = GetOverlappedResult(client->plat.pipe, &overlapped, &done, TRUE);
+
+    if (!ok)
+    {
+      DWORD err = GetLastError();
+      if (err == ERROR_BROKEN_PIPE || err == ERROR_NO_DATA)
+      {
+        client->plat.disconnected = true;
+        return MWRS_E_BROKEN;
+      }
+
+      // TODO error
+      return MWRS_E_SYSTEM;
+    }
+
+    ptr += done;
+    len -= done;
+  }
+  return MWRS_SUCCESS;
+}
+// plat_write
+
+mwrs_ret plat_send_message(mwrs_data * client, const void * head, std::size_t head_size,
+                           const void * data, std::size_t data_size)
+{
+  if (client->plat.disconnected)
+    return MWRS_E_BROKEN;
+
+  // Pipes have no gather write, small messages are joined on the stack to keep a single write
+  if (head_size + data_size <= sendStackSize)
+  {
+    char buffer[sendStackSize];
+    std::memcpy(buffer, head, head_size);
+    if (data_size != 0)
+      std::memcpy(buffer + head_size, data, data_size);
+    return plat_write(client, buffer, (DWORD)(head_size + data_size));
+  }
+
+  // The server reads a stream, the message can arrive in two writes
+  mwrs_ret ret = plat_write(client, head, (DWORD)head_size);
+  if (ret == MWRS_SUCCESS && data_size != 0)
+    ret = plat_write(client, data, (DWORD)data_size);
+  return ret;
+}
+// plat_send_message
+
+void plat_start_read(mwrs_data * client)
+{
+  if (client->plat.reading || client->plat.disconnected)
+    return;
+
+  ZeroMemory(&client->plat.read_overlapped, sizeof(client->plat.read_overlapped));
+  client->plat.read_overlapped.hEvent = client->plat.event;
 
-    // Retry
-    client->plat.pipe =
-        CreateFile(pipename, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+  std::size_t size;
+  char * buffer = client->plat.reader.prepare(&size);
 
-    if (client->plat.pipe == INVALID_HANDLE_VALUE)
-      return MWRS_E_UNAVAIL;
+  // Corrupt stream, reported by the next receive
+  if (!buffer)
+  {
+    SetEvent(client->plat.event);
+    return;
   }
 
+  // Resets the event, which is signaled again on completion
+  if (!ReadFile(client->plat.pipe, buffer, (DWORD)size, NULL, &client->plat.read_overlapped) &&
+      GetLastError() != ERROR_IO_PENDING)
   {
-    DWORD mode = PIPE_READMODE_BYTE;
-    if (!SetNamedPipeHandleState(client->plat.pipe, &mode, NULL, NULL))
-    {
-      // TODO error
-      CloseHandle(client->plat.pipe); // TODO in destructor instead
-      assert(0 && "SetNamedPipeHandleState failed");
-      return MWRS_E_SYSTEM;
-    }
+    // Reported by the next receive
+    client->plat.disconnected = true;
+    SetEvent(client->plat.event);
+    return;
   }
 
-  {
-    // Compute argv length
-    std::size_t argvlen = 0;
-    for (int i = 0; i < argc; ++i)
-      argvlen += std::strlen(argv[i]) + 1;
+  client->plat.reading = true;
+}
+// plat_start_read
 
-    // Send handshake
-    mwrs_cl_win_handshake * handshake =
-        (mwrs_cl_win_handshake *)message_alloc(offsetof(mwrs_cl_win_handshake, argv) + argvlen);
-    handshake->type         = MWRS_MSG_CL_WIN_HANDSHAKE;
-    handshake->length       = offsetof(mwrs_cl_win_handshake, argv) + argvlen;
-    handshake->mwrs_version = MWRS_VERSION;
-    handshake->process_id   = GetCurrentProcessId();
-    handshake->argc         = argc;
+// Decode the next buffered message, completing the pending read until there is one
+mwrs_ret plat_finish_message(mwrs_data * client, bool wait, mwrs_sv_message ** message_out)
+{
+  // Shut down, buffered messages are not decoded anymore
+  if (client->plat.pipe == INVALID_HANDLE_VALUE)
+    return MWRS_E_BROKEN;
 
-    char * argv_dest  = &handshake->argv;
-    for (int i = 0; i < argc; ++i)
+  for (;;)
+  {
+    mwrs_sv_message * message = client->plat.reader.next();
+    if (message && message->type == MWRS_MSG_SV_COMPACT_RESPONSE)
     {
-      std::size_t len = std::strlen(argv[i]) + 1;
-      std::memcpy(argv_dest, argv[i], len);
-      argv_dest += len;
+      // Callers only handle common responses
+      const mwrs_sv_msg_compact_response * compact = (const mwrs_sv_msg_compact_response *)message;
+
+      std::size_t size = mwrs_protocol::expanded_size(compact);
+      if (size == 0)
+      {
+        plat_disconnect(client);
+        return MWRS_E_PROTOCOL;
+      }
+
+      std::vector<char> & expanded = client->plat.expanded;
+      if (expanded.size() < size)
+        expanded.resize(size);
+      std::memset(expanded.data(), 0, size);
+
+      *message_out = (mwrs_sv_message *)expanded.data();
+      mwrs_protocol::expand(compact, (mwrs_sv_msg_common_response *)*message_out);
+      return MWRS_SUCCESS;
+    }
+    else if (message && message->type == MWRS_MSG_SV_COMMON_RESPONSE &&
+             client->protocol == mwrs_protocol::v1)
+    {
+      // Callers only handle the common responses of v2
+      if (message->length < sizeof(mwrs_sv_msg_common_response_v1))
+      {
+        plat_disconnect(client);
+        return MWRS_E_PROTOCOL;
+      }
+
+      std::vector<char> & expanded = client->plat.expanded;
+      if (expanded.size() < sizeof(mwrs_sv_msg_common_response))
+        expanded.resize(sizeof(mwrs_sv_msg_common_response));
+      std::memset(expanded.data(), 0, sizeof(mwrs_sv_msg_common_response));
+
+      *message_out = (mwrs_sv_message *)expanded.data();
+      mwrs_protocol::v1_expand((const mwrs_sv_msg_common_response_v1 *)message,
+                               (mwrs_sv_msg_common_response *)*message_out);
+      return MWRS_SUCCESS;
+    }
+    else if (message)
+    {
+      // Decoded in place, the reader keeps it until the next read is prepared
+      *message_out = message;
+      return MWRS_SUCCESS;
     }
 
-    mwrs_ret ret = plat_send_message(client, (mwrs_cl_message *)handshake);
-
-    if (ret != MWRS_SUCCESS)
+    if (client->plat.reader.corrupt())
     {
-      CloseHandle(client->plat.pipe); // TODO in destructor instead
-      return MWRS_E_SERVERERR;
+      plat_disconnect(client);
+      return MWRS_E_PROTOCOL;
     }
-  }
 
-  {
-    // Receive ack
-    mwrs_sv_win_handshake_ack * win_handshake_ack;
-    mwrs_ret ret = plat_receive_message(client, (mwrs_sv_message **)&win_handshake_ack);
+    plat_start_read(client);
+
+    if (client->plat.disconnected)
+      return MWRS_E_BROKEN;
 
-    if (ret != MWRS_SUCCESS || win_handshake_ack->type != MWRS_MSG_SV_WIN_HANDSHAKE_ACK ||
-        win_handshake_ack->status != MWRS_SUCCESS)
+    DWORD read = 0;
+    if (!GetOverlappedResult(client->plat.pipe, &client->plat.read_overlapped, &read, wait))
     {
-      CloseHandle(client->plat.pipe); // TODO in destructor instead
+      DWORD err = GetLastError();
+      if (err == ERROR_IO_INCOMPLETE)
+        return MWRS_E_AGAIN;
+
+      client->plat.reading = false;
 
-      if (ret == MWRS_SUCCESS && win_handshake_ack->type == MWRS_MSG_SV_WIN_HANDSHAKE_ACK)
-        return win_handshake_ack->status;
-      else if (ret != MWRS_SUCCESS)
-        return ret;
-      else
-        return MWRS_E_SERVERERR;
+      if (err == ERROR_BROKEN_PIPE)
+      {
+        client->plat.disconnected = true;
+        return MWRS_E_BROKEN;
+      }
+
+      // TODO error
+      return MWRS_E_SYSTEM;
     }
+
+    client->plat.reading = false;
+    client->plat.reader.commit(read);
   }
+}
+// plat_finish_message
 
-  return MWRS_SUCCESS;
+mwrs_ret plat_receive_message(mwrs_data * client, mwrs_sv_message ** message_out)
+{
+  return plat_finish_message(client, true, message_out);
 }
-// plat_start
 
-void plat_stop(mwrs_data * client)
+mwrs_ret plat_poll_message(mwrs_data * client, mwrs_sv_message ** message_out)
 {
-  CloseHandle(client->plat.pipe); // TODO in destructor instead
+  return plat_finish_message(client, false, message_out);
 }
-// plat_stop
 
-mwrs_ret plat_send_message(mwrs_data * client, mwrs_cl_message * message)
+
+void plat_update_event(mwrs_data * client)
 {
-  if (client->plat.disconnected)
+  if (!client->events.empty() || client->plat.disconnected || client->plat.reader.has_frame())
   {
-    message_free(message);
-    return MWRS_E_BROKEN;
+    SetEvent(client->plat.event);
+    return;
   }
 
-  DWORD written;
-  if (!WriteFile(client->plat.pipe, (const void *)message, message->length, &written, NULL))
+  if (!client->plat.reading)
   {
-    DWORD err = GetLastError();
-    if (err == ERROR_BROKEN_PIPE || err == ERROR_NO_DATA)
-    {
-      client->plat.disconnected = true;
-      message_free(message);
-      return MWRS_E_BROKEN;
-    }
-
-    // TODO error
-    message_free(message);
-    return MWRS_E_SYSTEM;
+    plat_start_read(client);
+    return;
   }
 
-  if (written != message->length)
-  {
-    // TODO error
-    assert(0 && "Invalid write size");
-    message_free(message);
-    return MWRS_E_SYSTEM;
-  }
+  // Read still pending, it signals the event on completion
+  ResetEvent(client->plat.event);
 
-  message_free(message);
-  return MWRS_SUCCESS;
+  DWORD unused;
+  if (GetOverlappedResult(client->plat.pipe, &client->plat.read_overlapped, &unused, FALSE) ||
+      GetLastError() != ERROR_IO_INCOMPLETE)
+    SetEvent(client->plat.event);
 }
-// plat_send_message
+// plat_update_event
 
-mwrs_ret plat_receive_message(mwrs_data * client, mwrs_sv_message ** message_out)
-{
-  if (client->plat.disconnected)
-    return MWRS_E_BROKEN;
+void * plat_event_fd(mwrs_data * client) { return client->plat.event; }
 
-  mwrs_sv_message message_base;
+const mwrs_status_table_header * plat_status_table(mwrs_data * client)
+{
+  return client->plat.status_table;
+}
 
-  DWORD read;
-  if (!ReadFile(client->plat.pipe, (void *)&message_base, sizeof(message_base), &read, NULL))
+const char * plat_arena_acquire(mwrs_data * client, uint32_t generation, uint64_t offset,
+                                uint64_t size)
+{
+  auto it = client->plat.arena_views.find(generation);
+  if (it == client->plat.arena_views.end())
   {
-    if (GetLastError() == ERROR_BROKEN_PIPE)
+    char name[mwrs_arena::name_max];
+    mwrs_arena::segment_name(name, client->plat.server_name.c_str(), generation);
+
+    // The view keeps the segment alive, the mapping handle is not needed
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (!mapping)
+      return nullptr;
+
+    const char * view = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+      return nullptr;
+
+    const mwrs_arena_header * header = (const mwrs_arena_header *)view;
+    MEMORY_BASIC_INFORMATION info{};
+    if (!VirtualQuery(view, &info, sizeof(info)) || info.RegionSize < sizeof(mwrs_arena_header) ||
+        header->magic != mwrs_arena::magic || header->generation != generation ||
+        info.RegionSize < header->size)
     {
-      client->plat.disconnected = true;
-      return MWRS_E_BROKEN;
+      UnmapViewOfFile(view);
+      return nullptr;
     }
 
-    // TODO error
-    return MWRS_E_SYSTEM;
-  }
+    it = client->plat.arena_views.emplace(generation, mwrs_plat::arena_view{view, header->size, 0})
+             .first;
 
-  if (read != sizeof(mwrs_sv_message))
-  {
-    // TODO error
-    assert(0 && "Invalid read size");
-    return MWRS_E_SYSTEM;
+    // Previous latest segment is released with its last resource
+    if (generation > client->plat.arena_latest)
+    {
+      uint32_t previous          = client->plat.arena_latest;
+      client->plat.arena_latest  = generation;
+      auto previous_it           = client->plat.arena_views.find(previous);
+      if (previous_it != client->plat.arena_views.end() && previous_it->second.refs == 0)
+      {
+        UnmapViewOfFile(previous_it->second.view);
+        client->plat.arena_views.erase(previous_it);
+      }
+    }
   }
 
-  *message_out = (mwrs_sv_message *)message_alloc(message_base.length);
-  std::memcpy(*message_out, &message_base, sizeof(message_base));
+  if (offset > it->second.size || size > it->second.size - offset)
+    return nullptr;
 
-  if (!ReadFile(client->plat.pipe, (void*)((char *)*message_out + sizeof(message_base)),
-                message_base.length - sizeof(message_base),
-                &read, NULL))
-  {
-    if (GetLastError() == ERROR_BROKEN_PIPE)
-    {
-      client->plat.disconnected = true;
-      message_free(*message_out);
-      return MWRS_E_BROKEN;
-    }
+  ++it->second.refs;
+  return it->second.view + offset;
+}
+// plat_arena_acquire
 
-    // TODO error
-    message_free(*message_out);
-    return MWRS_E_SYSTEM;
-  }
+void plat_arena_release(mwrs_data * client, uint32_t generation)
+{
+  auto it = client->plat.arena_views.find(generation);
+  if (it == client->plat.arena_views.end())
+    return;
 
-  if (read != message_base.length - sizeof(message_base))
+  if (--it->second.refs == 0 && generation != client->plat.arena_latest)
   {
-    // TODO error
-    assert(0 && "Invalid read size");
-    message_free(*message_out);
-    return MWRS_E_SYSTEM;
+    UnmapViewOfFile(it->second.view);
+    client->plat.arena_views.erase(it);
   }
-
-  return MWRS_SUCCESS;
 }
+// plat_arena_release
 
 
 bool plat_res_is_valid(const mwrs_res * res)
@@ -406,13 +1323,27 @@ std::unique_ptr<mwrs_data> instance;
 
 // API implementation
 
-int mwrs_res_is_valid(const mwrs_res * res) { return plat_res_is_valid(res); }
+int mwrs_res_is_valid(const mwrs_res * res)
+{
+  if (res->flags & MWRS_OPEN_INLINE)
+    return res->opaque != nullptr;
+
+  return plat_res_is_valid(res);
+}
 
 int mwrs_watcher_is_valid(const mwrs_watcher * watcher)
 {
   return watcher->id != 0; // TODO
 }
 
+mwrs_event_desc mwrs_event_fd()
+{
+  if (!::instance)
+    return MWRS_EVENT_DESC_INVALID;
+
+  return (mwrs_event_desc)plat_event_fd(::instance.get());
+}
+
 
 mwrs_ret mwrs_init(const char * server_name, int argc, const char ** argv)
 {
@@ -437,6 +1368,11 @@ mwrs_ret mwrs_shutdown()
   if (!::instance)
     return MWRS_E_UNAVAIL;
 
+  // Resources pushed with events that were not taken
+  for (pending_event & event : ::instance->events)
+    if (mwrs_res_is_valid(&event.event.res))
+      mwrs_close(&event.event.res);
+
   plat_stop(::instance.get());
   ::instance.reset();
 
@@ -444,7 +1380,28 @@ mwrs_ret mwrs_shutdown()
 }
 
 
+mwrs_ret mwrs_set_miss_ttl(int ttl_ms)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (ttl_ms < 0)
+    return MWRS_E_ARGS;
+
+  ::instance->miss_ttl_ms = ttl_ms;
+  if (ttl_ms == 0)
+    ::instance->misses.clear();
+
+  return MWRS_SUCCESS;
+}
+
+
 mwrs_ret mwrs_open(const char * id, mwrs_open_flags flags, mwrs_res * res_out)
+{
+  return mwrs_open_wait(id, flags, (flags & MWRS_OPEN_WAIT) ? -1 : 0, res_out);
+}
+
+mwrs_ret mwrs_open_wait(const char * id, mwrs_open_flags flags, int timeout_ms, mwrs_res * res_out)
 {
   if (!::instance)
     return MWRS_E_UNAVAIL;
@@ -452,43 +1409,48 @@ mwrs_ret mwrs_open(const char * id, mwrs_open_flags flags, mwrs_res * res_out)
   if (mwrs_res_is_valid(res_out))
     return MWRS_E_ARGS;
 
-  mwrs_ret ret;
+  if (timeout_ms != 0)
+    flags = (mwrs_open_flags)(flags | MWRS_OPEN_WAIT);
+  else
+    flags = (mwrs_open_flags)(flags & ~MWRS_OPEN_WAIT);
 
-  ret = send_res_request(::instance.get(), MWRS_MSG_CL_OPEN, id, flags);
+  bool read_only = !(flags & (MWRS_OPEN_WRITE | MWRS_OPEN_APPEND));
+  if (read_only && timeout_ms == 0 && id && miss_cached(::instance.get(), id))
+    return MWRS_E_NOTFOUND;
 
-  if (ret != MWRS_SUCCESS)
-    return ret;
+  mwrs_ret ret;
 
-  mwrs_sv_message * response;
-  ret = receive_response(::instance.get(), &response);
+  ret = send_res_request(::instance.get(), MWRS_MSG_CL_OPEN, id, std::strlen(id), flags,
+                         timeout_ms);
 
   if (ret != MWRS_SUCCESS)
     return ret;
 
-  if (response->type != MWRS_MSG_SV_COMMON_RESPONSE)
-  {
-    message_free(response);
-    return MWRS_E_PROTOCOL; // TODO kill client
-  }
-
-  mwrs_sv_msg_common_response * common_response = (mwrs_sv_msg_common_response *)response;
-  if (common_response->status == MWRS_SUCCESS)
-  {
-    ret = common_response_get_res(common_response, res_out);
+  ret = receive_common_response(::instance.get(), res_out, nullptr, nullptr);
 
-    if (ret != MWRS_SUCCESS)
-    {
-      message_free(response);
-      return MWRS_E_PROTOCOL; // TODO kill client
-    }
-  }
+  if (ret == MWRS_E_NOTFOUND && read_only)
+    miss_record(::instance.get(), id);
 
-  ret = common_response->status;
-  message_free(response);
   return ret;
 }
 
-mwrs_ret mwrs_watcher_open(const mwrs_watcher * watcher, mwrs_open_flags flags, mwrs_res * res_out);
+mwrs_ret mwrs_watcher_open(const mwrs_watcher * watcher, mwrs_open_flags flags, mwrs_res * res_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!mwrs_watcher_is_valid(watcher) || mwrs_res_is_valid(res_out))
+    return MWRS_E_ARGS;
+
+  mwrs_ret ret;
+
+  ret = send_watcher_request(::instance.get(), MWRS_MSG_CL_WATCHER_OPEN, watcher->id, flags);
+
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  return receive_common_response(::instance.get(), res_out, nullptr, nullptr);
+}
 
 mwrs_ret mwrs_open_watch(const char * id, mwrs_open_flags flags, mwrs_res * res_out,
                          mwrs_watcher * watcher_out)
@@ -504,40 +1466,38 @@ mwrs_ret mwrs_open_watch(const char * id, mwrs_open_flags flags, mwrs_res * res_
 
   mwrs_ret ret;
 
-  ret = send_res_request(::instance.get(), MWRS_MSG_CL_OPEN_WATCH, id, flags);
+  // Pushed opens must be enabled by the server
+  std::string key = watch_key(MWRS_MSG_CL_OPEN_WATCH, id);
+  mwrs_watcher_id shared_id;
+  shared_watch * shared = watch_find(::instance.get(), key, &shared_id);
+  if (shared && (shared->push || !(flags & MWRS_OPEN_PUSH)))
+  {
+    // Opens with a watcher are never held by the server, see MWRS_MSG_CL_OPEN_WATCH
+    ret = mwrs_open(id, (mwrs_open_flags)(flags & ~(MWRS_OPEN_PUSH | MWRS_OPEN_WAIT)), res_out);
+
+    ++shared->refs;
+    watcher_out->id = shared_id;
 
-  if (ret != MWRS_SUCCESS)
+    if (ret == MWRS_SUCCESS)
+      shared->ready = true;
+    else
+      watch_queue_ready(::instance.get(), shared_id, shared, id);
     return ret;
+  }
 
-  mwrs_sv_message * response;
-  ret = receive_response(::instance.get(), &response);
+  ret = send_res_request(::instance.get(), MWRS_MSG_CL_OPEN_WATCH, id, key.size() - 1, flags);
 
   if (ret != MWRS_SUCCESS)
     return ret;
 
-  if (response->type != MWRS_MSG_SV_COMMON_RESPONSE)
-  {
-    message_free(response);
-    return MWRS_E_PROTOCOL; // TODO kill client
-  }
+  ret = receive_common_response(::instance.get(), res_out, nullptr, watcher_out);
 
-  mwrs_sv_msg_common_response * common_response = (mwrs_sv_msg_common_response *)response;
-  if (common_response->status == MWRS_SUCCESS)
+  if (mwrs_watcher_is_valid(watcher_out))
   {
-    ret = common_response_get_res(common_response, res_out);
-
-    if (ret != MWRS_SUCCESS)
-    {
-      message_free(response);
-      return MWRS_E_PROTOCOL; // TODO kill client
-    }
+    shared_watch * w = watch_add(::instance.get(), key, watcher_out->id);
+    w->push          = w->push || (flags & MWRS_OPEN_PUSH);
+    w->ready         = w->ready || ret == MWRS_SUCCESS;
   }
-
-  // Ignore errors
-  common_response_get_watcher(common_response, watcher_out);
-
-  ret = common_response->status;
-  message_free(response);
   return ret;
 }
 
@@ -547,39 +1507,26 @@ mwrs_ret mwrs_stat(const char * id, mwrs_status * stat_out)
   if (!::instance)
     return MWRS_E_UNAVAIL;
 
-  mwrs_ret ret;
+  // Published statuses do not need a request
+  const mwrs_status_table_header * table = plat_status_table(::instance.get());
+  if (table && id && stat_out && mwrs_status_table::lookup(table, id, stat_out))
+    return MWRS_SUCCESS;
 
-  ret = send_res_request(::instance.get(), MWRS_MSG_CL_STAT, id);
+  if (id && miss_cached(::instance.get(), id))
+    return MWRS_E_NOTFOUND;
 
-  if (ret != MWRS_SUCCESS)
-    return ret;
+  mwrs_ret ret;
 
-  mwrs_sv_message * response;
-  ret = receive_response(::instance.get(), &response);
+  ret = send_res_request(::instance.get(), MWRS_MSG_CL_STAT, id, std::strlen(id));
 
   if (ret != MWRS_SUCCESS)
     return ret;
 
-  if (response->type != MWRS_MSG_SV_COMMON_RESPONSE)
-  {
-    message_free(response);
-    return MWRS_E_PROTOCOL; // TODO kill client
-  }
-
-  mwrs_sv_msg_common_response * common_response = (mwrs_sv_msg_common_response *)response;
-  if (common_response->status == MWRS_SUCCESS)
-  {
-    ret = common_response_get_status(common_response, stat_out);
+  ret = receive_common_response(::instance.get(), nullptr, stat_out, nullptr);
 
-    if (ret != MWRS_SUCCESS)
-    {
-      message_free(response);
-      return MWRS_E_PROTOCOL; // TODO kill client
-    }
-  }
+  if (ret == MWRS_E_NOTFOUND)
+    miss_record(::instance.get(), id);
 
-  ret = common_response->status;
-  message_free(response);
   return ret;
 }
 
@@ -593,40 +1540,33 @@ mwrs_ret mwrs_stat_watch(const char * id, mwrs_status * stat_out, mwrs_watcher *
 
   mwrs_ret ret;
 
-  ret = send_res_request(::instance.get(), MWRS_MSG_CL_STAT_WATCH, id);
+  std::string key = watch_key(MWRS_MSG_CL_STAT_WATCH, id);
+  mwrs_watcher_id shared_id;
+  shared_watch * shared = watch_find(::instance.get(), key, &shared_id);
+  if (shared)
+  {
+    ret = mwrs_stat(id, stat_out);
+
+    ++shared->refs;
+    watcher_out->id = shared_id;
 
-  if (ret != MWRS_SUCCESS)
+    if (ret != MWRS_SUCCESS)
+      watch_queue_ready(::instance.get(), shared_id, shared, id);
     return ret;
+  }
 
-  mwrs_sv_message * response;
-  ret = receive_response(::instance.get(), &response);
+  ret = send_res_request(::instance.get(), MWRS_MSG_CL_STAT_WATCH, id, key.size() - 1);
 
   if (ret != MWRS_SUCCESS)
     return ret;
 
-  if (response->type != MWRS_MSG_SV_COMMON_RESPONSE)
-  {
-    message_free(response);
-    return MWRS_E_PROTOCOL; // TODO kill client
-  }
+  ret = receive_common_response(::instance.get(), nullptr, stat_out, watcher_out);
 
-  mwrs_sv_msg_common_response * common_response = (mwrs_sv_msg_common_response *)response;
-  if (common_response->status == MWRS_SUCCESS)
+  if (mwrs_watcher_is_valid(watcher_out))
   {
-    ret = common_response_get_status(common_response, stat_out);
-
-    if (ret != MWRS_SUCCESS)
-    {
-      message_free(response);
-      return MWRS_E_PROTOCOL; // TODO kill client
-    }
+    shared_watch * w = watch_add(::instance.get(), key, watcher_out->id);
+    w->ready = w->ready || (ret == MWRS_SUCCESS && stat_out->state == MWRS_STATE_READY);
   }
-
-  // Ignore errors
-  common_response_get_watcher(common_response, watcher_out);
-
-  ret = common_response->status;
-  message_free(response);
   return ret;
 }
 
@@ -639,44 +1579,102 @@ mwrs_ret mwrs_watch(const char * id, mwrs_watcher * watcher_out)
   if (mwrs_watcher_is_valid(watcher_out))
     return MWRS_E_ARGS;
 
-  mwrs_ret ret;
+  return watch_request(::instance.get(), MWRS_MSG_CL_WATCH, id, watcher_out);
+}
+
+mwrs_ret mwrs_watch_prefix(const char * prefix, mwrs_watcher * watcher_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
 
-  ret = send_res_request(::instance.get(), MWRS_MSG_CL_WATCH, id);
+  if (!prefix || mwrs_watcher_is_valid(watcher_out))
+    return MWRS_E_ARGS;
 
-  if (ret != MWRS_SUCCESS)
-    return ret;
+  return watch_request(::instance.get(), MWRS_MSG_CL_WATCH_PREFIX, prefix, watcher_out);
+}
+
+mwrs_ret mwrs_watch_since(const char * id, long long version, mwrs_watcher * watcher_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
 
-  mwrs_sv_message * response;
-  ret = receive_response(::instance.get(), &response);
+  if (!id || version < 0 || mwrs_watcher_is_valid(watcher_out))
+    return MWRS_E_ARGS;
 
-  if (ret != MWRS_SUCCESS)
-    return ret;
+  return watch_request(::instance.get(), MWRS_MSG_CL_WATCH_SINCE, id, watcher_out,
+                       (uint64_t)version);
+}
+
+mwrs_ret mwrs_watch_glob(const char * pattern, mwrs_watcher * watcher_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!pattern || mwrs_watcher_is_valid(watcher_out))
+    return MWRS_E_ARGS;
+
+  return watch_request(::instance.get(), MWRS_MSG_CL_WATCH_GLOB, pattern, watcher_out);
+}
+
+mwrs_ret mwrs_close_watcher(mwrs_watcher * watcher)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!mwrs_watcher_is_valid(watcher))
+    return MWRS_E_ARGS;
 
-  if (response->type != MWRS_MSG_SV_COMMON_RESPONSE)
+  // Other handles still use it
+  auto shared = ::instance->watches.find(watcher->id);
+  if (shared != ::instance->watches.end() && shared->second.refs > 1)
   {
-    message_free(response);
-    return MWRS_E_PROTOCOL; // TODO kill client
+    --shared->second.refs;
+    watcher->id = 0;
+    return MWRS_SUCCESS;
   }
 
-  mwrs_sv_msg_common_response * common_response = (mwrs_sv_msg_common_response *)response;
-  if (common_response->status == MWRS_SUCCESS)
+  int server_refs = shared != ::instance->watches.end() ? shared->second.server_refs : 1;
+
+  mwrs_ret ret = MWRS_SUCCESS;
+
+  for (int i = 0; i < server_refs && ret == MWRS_SUCCESS; ++i)
   {
-    ret = common_response_get_watcher(common_response, watcher_out);
+    ret = send_watcher_request(::instance.get(), MWRS_MSG_CL_CLOSE_WATCHER, watcher->id);
 
     if (ret != MWRS_SUCCESS)
+      return ret;
+
+    ret = receive_common_response(::instance.get(), nullptr, nullptr, nullptr);
+
+    if (ret == MWRS_SUCCESS && shared != ::instance->watches.end())
+      --shared->second.server_refs;
+  }
+
+  if (ret == MWRS_SUCCESS)
+  {
+    if (shared != ::instance->watches.end())
     {
-      message_free(response);
-      return MWRS_E_PROTOCOL; // TODO kill client
+      ::instance->watch_keys.erase(shared->second.key);
+      ::instance->watches.erase(shared);
     }
+
+    // Drop pending events, with the resources they pushed
+    std::deque<pending_event> & events = ::instance->events;
+    mwrs_watcher_id id                 = watcher->id;
+    for (pending_event & e : events)
+      if (e.event.watcher_id == id && mwrs_res_is_valid(&e.event.res))
+        mwrs_close(&e.event.res);
+    events.erase(std::remove_if(events.begin(), events.end(),
+                                [id](const pending_event & e) { return e.event.watcher_id == id; }),
+                 events.end());
+    plat_update_event(::instance.get());
+
+    watcher->id = 0;
   }
 
-  ret = common_response->status;
-  message_free(response);
   return ret;
 }
 
-mwrs_ret mwrs_close_watcher(mwrs_watcher * watcher);
-
 
 mwrs_ret mwrs_read(mwrs_res * res, void * buffer, mwrs_size * read_len)
 {
@@ -686,6 +1684,9 @@ mwrs_ret mwrs_read(mwrs_res * res, void * buffer, mwrs_size * read_len)
   if ((res->flags & MWRS_OPEN_READ) == 0)
     return MWRS_E_PERM;
 
+  if (res->flags & MWRS_OPEN_INLINE)
+    return memory_read(res, buffer, read_len);
+
   return plat_read(res, buffer, read_len);
 }
 
@@ -709,6 +1710,9 @@ mwrs_ret mwrs_seek(mwrs_res * res, mwrs_size offset, mwrs_seek_origin origin,
   if ((res->flags & MWRS_OPEN_SEEK) == 0)
     return MWRS_E_PERM;
 
+  if (res->flags & MWRS_OPEN_INLINE)
+    return memory_seek(res, offset, origin, position_out);
+
   return plat_seek(res, offset, origin, position_out);
 }
 
@@ -717,10 +1721,73 @@ mwrs_ret mwrs_close(mwrs_res * res)
   if (!mwrs_res_is_valid(res))
     return MWRS_E_NOTOPEN;
 
+  if (res->flags & MWRS_OPEN_INLINE)
+    return memory_close(::instance.get(), res);
+
   return plat_close(res);
 }
 
 
-// mwrs_ret mwrs_poll_event(mwrs_event * event_out);
+mwrs_ret mwrs_poll_event(mwrs_event * event_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!event_out)
+    return MWRS_E_ARGS;
+
+  ::instance->taken.clear();
+
+  mwrs_ret ret = receive_events(::instance.get(), false);
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  take_event(::instance.get(), event_out);
+
+  plat_update_event(::instance.get());
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret mwrs_drain_events(mwrs_event * buffer, size_t capacity, size_t * count_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!buffer || !count_out)
+    return MWRS_E_ARGS;
+
+  *count_out = 0;
+  ::instance->taken.clear();
+
+  mwrs_ret ret = receive_events(::instance.get(), false);
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  size_t count = std::min(capacity, ::instance->events.size());
+  for (size_t i = 0; i < count; ++i)
+    take_event(::instance.get(), &buffer[i]);
+  *count_out = count;
+
+  plat_update_event(::instance.get());
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret mwrs_wait_event(mwrs_event * event_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!event_out)
+    return MWRS_E_ARGS;
+
+  ::instance->taken.clear();
+
+  mwrs_ret ret = receive_events(::instance.get(), true);
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  take_event(::instance.get(), event_out);
 
-// mwrs_ret mwrs_wait_event(mwrs_event * event_out);
+  plat_update_event(::instance.get());
+  return MWRS_SUCCESS;
+}
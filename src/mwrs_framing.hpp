@@ -0,0 +1,150 @@
+/**
+ * @file    mwrs_framing.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_FRAMING__HEADER_GUARD
+#define MWRS_FRAMING__HEADER_GUARD
+
+#include <stddef.h>
+
+#include <cstring>
+#include <vector>
+
+
+// Messages are sent back to back on the pipe, each starting with its type and total length.
+// The reader buffers the stream, so one read can bring many messages,
+// and decodes them in place.
+
+namespace mwrs_framing
+{
+
+const size_t defaultCapacity = 4096;
+
+// Larger lengths can only come from a corrupted stream
+const size_t maxFrameLength = 1 << 28;
+
+
+/**
+ * Buffered reader of the messages starting with `Head`, which has a `length` field.
+ *
+ * Bytes are read after the buffered ones, see `prepare` and `commit`.
+ * A partial message is moved to the front of the buffer when more room is needed,
+ * the buffer only grows for messages larger than it.
+ */
+template <typename Head>
+class FrameReader
+{
+ public:
+  explicit FrameReader(size_t capacity = defaultCapacity) : capacity(capacity), buffer(capacity)
+  {
+  }
+
+  /**
+   * Returns the next complete message and consumes it, or null if there is none.
+   * The message is decoded in place and stays valid until the next call to `prepare`.
+   */
+  Head * next()
+  {
+    if (!has_frame())
+      return nullptr;
+
+    Head * frame = (Head *)(buffer.data() + begin);
+    begin += frame_length();
+    return frame;
+  }
+
+  bool has_frame() const
+  {
+    size_t length = frame_length();
+    return length != 0 && end - begin >= length;
+  }
+
+  /**
+   * The buffered message has an invalid length, the stream cannot be decoded anymore.
+   */
+  bool corrupt() const
+  {
+    if (end - begin < sizeof(Head))
+      return false;
+
+    Head head;
+    std::memcpy(&head, buffer.data() + begin, sizeof(Head));
+    return head.length < sizeof(Head) || head.length > maxFrameLength;
+  }
+
+  /**
+   * Room to read to, at least enough to complete the message in progress.
+   * Complete messages must have been consumed with `next`.
+   * Returns null with no room if the stream is corrupt, nothing more can be decoded.
+   */
+  char * prepare(size_t * size_out)
+  {
+    if (corrupt())
+    {
+      *size_out = 0;
+      return nullptr;
+    }
+
+    if (begin == end)
+    {
+      begin = end = 0;
+
+      // Do not keep a large buffer for a single message
+      if (buffer.size() > capacity)
+        std::vector<char>(capacity).swap(buffer);
+    }
+
+    size_t needed   = frame_length() ? frame_length() : sizeof(Head);
+    size_t buffered = end - begin;
+    size_t missing  = needed > buffered ? needed - buffered : 0;
+
+    if (buffer.size() - end < missing || buffer.size() - end < capacity / 4)
+    {
+      std::memmove(buffer.data(), buffer.data() + begin, buffered);
+      begin = 0;
+      end   = buffered;
+
+      if (buffer.size() < needed)
+        buffer.resize(needed);
+    }
+
+    *size_out = buffer.size() - end;
+    return buffer.data() + end;
+  }
+  // FrameReader::prepare
+
+  /**
+   * `size` bytes were read to the room given by `prepare`.
+   */
+  void commit(size_t size) { end += size; }
+
+
+ private:
+  // 0 if the head is not buffered yet or invalid
+  size_t frame_length() const
+  {
+    if (end - begin < sizeof(Head))
+      return 0;
+
+    Head head;
+    std::memcpy(&head, buffer.data() + begin, sizeof(Head));
+    if (head.length < sizeof(Head) || head.length > maxFrameLength)
+      return 0;
+    return head.length;
+  }
+
+
+  const size_t capacity;
+
+  std::vector<char> buffer;
+  size_t begin = 0;
+  size_t end   = 0;
+};
+// FrameReader
+
+} // namespace mwrs_framing
+
+#endif // MWRS_FRAMING__HEADER_GUARD
@@ -0,0 +1,242 @@
+/**
+ * @file    mwrs_hash.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_hash.hpp"
+
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define MWRS_HASH_SSE2
+#  include <emmintrin.h>
+#endif
+
+
+namespace mwrs_sv
+{
+
+namespace
+{
+
+const uint64_t prime32_1 = 0x9E3779B1ULL;
+const uint64_t prime32_2 = 0x85EBCA77ULL;
+const uint64_t prime32_3 = 0xC2B2AE3DULL;
+const uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t prime64_3 = 0x165667B19E3779F9ULL;
+const uint64_t prime64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t prime64_5 = 0x27D4EB2F165667C5ULL;
+
+// Scramble accumulators every 16 stripes (1 KiB)
+const size_t stripes_per_block = 16;
+
+alignas(16) const uint64_t stripe_key[8] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL,
+    0x1F67B3B7A4A44072ULL, 0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL,
+    0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL,
+};
+
+alignas(16) const uint64_t scramble_key[8] = {
+    0xCB00C391BB52283CULL, 0xA32E531B8B65D088ULL, 0x4EF90DA297486471ULL,
+    0xD8ACDEA946EF1938ULL, 0x3F349CE33F76FAA8ULL, 0x1D4F0BC7C7BBDCF9ULL,
+    0x3159B4CD4BE0518AULL, 0x647378D9C97E9FC8ULL,
+};
+
+
+uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+  const uint64_t mask = 0xFFFFFFFFULL;
+
+  uint64_t lo_lo = (a & mask) * (b & mask);
+  uint64_t hi_lo = (a >> 32) * (b & mask);
+  uint64_t lo_hi = (a & mask) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & mask) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & mask);
+
+  return lower ^ upper;
+}
+
+uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= prime64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+
+#ifdef MWRS_HASH_SSE2
+
+void accumulate(uint64_t * acc, const unsigned char * data, size_t count, size_t * stripe_count)
+{
+  __m128i a[4];
+  __m128i key[4];
+  __m128i scramble[4];
+  for (int i = 0; i < 4; ++i)
+  {
+    a[i]        = _mm_loadu_si128((const __m128i *)(acc + i * 2));
+    key[i]      = _mm_load_si128((const __m128i *)(stripe_key + i * 2));
+    scramble[i] = _mm_load_si128((const __m128i *)(scramble_key + i * 2));
+  }
+
+  const __m128i prime = _mm_set1_epi32((int)prime32_1);
+
+  for (size_t s = 0; s < count; ++s, data += 64)
+  {
+    for (int i = 0; i < 4; ++i)
+    {
+      __m128i d  = _mm_loadu_si128((const __m128i *)(data + i * 16));
+      __m128i dk = _mm_xor_si128(d, key[i]);
+
+      // lo32(dk) * hi32(dk) for both lanes
+      __m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+      // Swap lanes, acc[i ^ 1] += data
+      __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+
+      a[i] = _mm_add_epi64(a[i], _mm_add_epi64(swapped, product));
+    }
+
+    if (++*stripe_count % stripes_per_block == 0)
+    {
+      for (int i = 0; i < 4; ++i)
+      {
+        __m128i v  = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+        v          = _mm_xor_si128(v, scramble[i]);
+        __m128i lo = _mm_mul_epu32(v, prime);
+        __m128i hi = _mm_mul_epu32(_mm_srli_epi64(v, 32), prime);
+        a[i]       = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+      }
+    }
+  }
+
+  for (int i = 0; i < 4; ++i)
+    _mm_storeu_si128((__m128i *)(acc + i * 2), a[i]);
+}
+
+#else
+
+uint64_t read64(const unsigned char * p)
+{
+  // Hosts are little-endian
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void accumulate(uint64_t * acc, const unsigned char * data, size_t count, size_t * stripe_count)
+{
+  for (size_t s = 0; s < count; ++s, data += 64)
+  {
+    for (int i = 0; i < 8; ++i)
+    {
+      uint64_t d  = read64(data + i * 8);
+      uint64_t dk = d ^ stripe_key[i];
+
+      acc[i ^ 1] += d;
+      acc[i] += (dk & 0xFFFFFFFFULL) * (dk >> 32);
+    }
+
+    if (++*stripe_count % stripes_per_block == 0)
+    {
+      for (int i = 0; i < 8; ++i)
+      {
+        uint64_t v = acc[i] ^ (acc[i] >> 47) ^ scramble_key[i];
+        acc[i]     = v * prime32_1;
+      }
+    }
+  }
+}
+
+#endif // MWRS_HASH_SSE2
+
+} // namespace
+
+
+ContentHasher::ContentHasher()
+    : acc{prime32_3, prime64_1, prime64_2, prime64_3, prime64_4, prime32_2, prime64_5, prime32_1}
+{
+}
+
+
+void ContentHasher::update(const void * data, size_t len)
+{
+  const unsigned char * ptr = (const unsigned char *)data;
+  total_len += len;
+
+  if (buffer_len > 0)
+  {
+    size_t fill = sizeof(buffer) - buffer_len;
+    if (fill > len)
+      fill = len;
+
+    std::memcpy(buffer + buffer_len, ptr, fill);
+    buffer_len += fill;
+    ptr += fill;
+    len -= fill;
+
+    if (buffer_len < sizeof(buffer))
+      return;
+
+    consume_stripes(buffer, 1);
+    buffer_len = 0;
+  }
+
+  size_t stripes = len / 64;
+  consume_stripes(ptr, stripes);
+  ptr += stripes * 64;
+  len -= stripes * 64;
+
+  std::memcpy(buffer, ptr, len);
+  buffer_len = len;
+}
+
+
+content_hash ContentHasher::finish()
+{
+  if (buffer_len > 0)
+  {
+    // Zero padding, length is mixed in below
+    std::memset(buffer + buffer_len, 0, sizeof(buffer) - buffer_len);
+    consume_stripes(buffer, 1);
+    buffer_len = 0;
+  }
+
+  uint64_t lo = total_len * prime64_1;
+  uint64_t hi = ~total_len * prime64_2;
+  for (int i = 0; i < 4; ++i)
+  {
+    lo += mul128_fold64(acc[i * 2] ^ stripe_key[i * 2], acc[i * 2 + 1] ^ stripe_key[i * 2 + 1]);
+    hi += mul128_fold64(acc[i * 2] ^ scramble_key[7 - i * 2],
+                        acc[i * 2 + 1] ^ scramble_key[6 - i * 2]);
+  }
+
+  content_hash hash{avalanche(lo), avalanche(hi ^ lo)};
+
+  // Zero is reserved for "unknown"
+  if (hash.empty())
+    hash.lo = 1;
+
+  return hash;
+}
+
+
+void ContentHasher::consume_stripes(const unsigned char * data, size_t count)
+{
+  accumulate(acc, data, count, &stripe_count);
+}
+
+
+content_hash hash_content(const void * data, size_t len)
+{
+  ContentHasher hasher;
+  hasher.update(data, len);
+  return hasher.finish();
+}
+
+} // namespace mwrs_sv
@@ -0,0 +1,74 @@
+/**
+ * @file    mwrs_hash.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_HASH__HEADER_GUARD
+#define MWRS_HASH__HEADER_GUARD
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * 128 bits content hash.
+ * Zero means "unknown".
+ */
+struct content_hash
+{
+  uint64_t lo;
+  uint64_t hi;
+
+  bool empty() const { return lo == 0 && hi == 0; }
+
+  bool operator==(const content_hash & other) const { return lo == other.lo && hi == other.hi; }
+  bool operator!=(const content_hash & other) const { return !(*this == other); }
+};
+
+struct content_hash_hasher
+{
+  size_t operator()(const content_hash & hash) const { return (size_t)(hash.lo ^ hash.hi); }
+};
+
+
+/**
+ * Streaming content hasher.
+ *
+ * Data is consumed in 64 bytes stripes, accumulated in 8 independent lanes
+ * (two per SSE2 register when available).
+ * The SSE2 and scalar paths produce the same result, so hashes stored in pack files
+ * are valid on every host.
+ */
+class ContentHasher
+{
+ public:
+  ContentHasher();
+
+  void update(const void * data, size_t len);
+
+  content_hash finish();
+
+
+ private:
+  void consume_stripes(const unsigned char * data, size_t count);
+
+  uint64_t acc[8];
+  uint64_t total_len = 0;
+  size_t stripe_count = 0;
+
+  unsigned char buffer[64];
+  size_t buffer_len = 0;
+};
+// ContentHasher
+
+
+content_hash hash_content(const void * data, size_t len);
+
+} // namespace mwrs_sv
+
+#endif // MWRS_HASH__HEADER_GUARD
@@ -18,24 +18,48 @@
 #  include <windows.h>
 #endif
 
+// Every message starts with its type and total length, as 32 bits integers.
+//
+// Protocol v1 is frozen, its message numbers and the *_v1 structs must not change.
+// It also uses the watcher request and the handshake structs, which v2 shares.
+// Its bodies are laid out as by MSVC, enums are 32 bits.
+//
+// Protocol v2 is negotiated at handshake, see mwrs_protocol.hpp.
+// It adds the message types numbered after the v1 ones, and extends requests and responses.
+// It sends the responses as mwrs_sv_msg_compact_response if the client supports it.
+
+// mwrs_status of protocol v1, it is not packed
+struct mwrs_status_v1
+{
+  uint32_t state; // mwrs_res_state
+  int64_t size;
+  int32_t mtime;
+};
+
 #pragma pack(push, 1)
 extern "C" {
 
 
 enum mwrs_sv_msg_type
 {
-  MWRS_MSG_SV_COMMON_RESPONSE,
+  // Protocol v1
+  MWRS_MSG_SV_COMMON_RESPONSE = 0,
 
 #ifdef _WIN32
-  MWRS_MSG_SV_WIN_HANDSHAKE_ACK,
+  MWRS_MSG_SV_WIN_HANDSHAKE_ACK = 1,
 #endif
+
+  // Protocol v2, same numbers on every platform
+  MWRS_MSG_SV_EVENT            = 2,
+  MWRS_MSG_SV_EVENT_OPEN       = 3,
+  MWRS_MSG_SV_COMPACT_RESPONSE = 0x100,
 };
 
 
 struct mwrs_sv_message
 {
-  mwrs_sv_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
 
   // data
 };
@@ -44,8 +68,8 @@ struct mwrs_sv_message
 
 struct mwrs_sv_msg_common_response
 {
-  mwrs_sv_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
 
 
   mwrs_ret status;
@@ -63,17 +87,134 @@ struct mwrs_sv_msg_common_response
 
   // Watcher
   mwrs_watcher_id watcher_id;
+
+  // Content, if open_flags has MWRS_OPEN_INLINE
+  // Found in the arena segment if arena_generation is not 0, in inline_data otherwise
+  uint32_t arena_generation;
+  uint64_t arena_offset;
+  unsigned int inline_size;
+  char inline_data; // extend message
+};
+
+struct mwrs_sv_msg_common_response_v1
+{
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
+
+
+  int32_t status;
+
+  uint32_t open_flags;
+  uint32_t handle; // mwrs_win_handle_data or mwrs_fd
+
+  mwrs_status_v1 stat;
+
+  int64_t watcher_id;
+};
+
+// Response of protocol v2, only carries the fields the request produced
+// The fields in `fields` follow the head, in the order of mwrs_response_field
+struct mwrs_sv_msg_compact_response
+{
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
+
+
+  int32_t status;
+  uint32_t fields;
+
+  // data
+};
+
+enum mwrs_response_field
+{
+  MWRS_FIELD_RES     = 0x1, // mwrs_response_res
+  MWRS_FIELD_STAT    = 0x2, // mwrs_response_stat
+  MWRS_FIELD_WATCHER = 0x4, // mwrs_response_watcher
+  MWRS_FIELD_CONTENT = 0x8, // mwrs_response_content, then the inline data if not in the arena
+};
+
+struct mwrs_response_res
+{
+  uint32_t open_flags;
+  uint32_t handle; // mwrs_win_handle_data or mwrs_fd
+};
+
+struct mwrs_response_stat
+{
+  uint32_t state;
+  int64_t size;
+  int32_t mtime;
+  int64_t version;
+};
+
+struct mwrs_response_watcher
+{
+  int64_t watcher_id;
+};
+
+struct mwrs_response_content
+{
+  uint32_t arena_generation;
+  uint64_t arena_offset;
+  uint32_t inline_size;
+};
+
+// Events are encoded once and shared by every recipient,
+// so they only carry data common to all of them
+struct mwrs_sv_msg_event
+{
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
+
+
+  mwrs_watcher_id watcher_id;
+  mwrs_event_type event;
+  uint64_t version;
+
+  // Changed byte ranges of an UPDATE, as mwrs_range, following the null-terminated id
+  unsigned int range_count;
+
+  char resource_id; // extend message
+};
+
+// Event sent to a single client, with the resource opened again, see MWRS_OPEN_PUSH
+// The null-terminated resource id follows `response`, which can be extended
+struct mwrs_sv_msg_event_open
+{
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
+
+
+  mwrs_watcher_id watcher_id;
+  mwrs_event_type event;
+  uint64_t version;
+  unsigned int resource_id_size;
+
+  mwrs_sv_msg_common_response response; // extend message
 };
 
 #ifdef _WIN32
 struct mwrs_sv_win_handshake_ack
 {
-  mwrs_sv_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
 
 
   mwrs_ret status;
 };
+
+// Answer to a protocol v2 handshake, the server protocol and the capabilities both support
+struct mwrs_sv_win_handshake_ack_v2
+{
+  uint32_t type; // mwrs_sv_msg_type
+  uint32_t length;
+
+
+  int32_t status;
+  uint32_t protocol;
+  uint32_t caps;
+};
 #endif
 
 
@@ -82,25 +223,31 @@ struct mwrs_sv_win_handshake_ack
 
 enum mwrs_cl_msg_type
 {
-  MWRS_MSG_CL_OPEN,
-  MWRS_MSG_CL_WATCH,
-  MWRS_MSG_CL_OPEN_WATCH,
-  MWRS_MSG_CL_STAT,
-  MWRS_MSG_CL_STAT_WATCH,
+  // Protocol v1
+  MWRS_MSG_CL_OPEN       = 0,
+  MWRS_MSG_CL_WATCH      = 1,
+  MWRS_MSG_CL_OPEN_WATCH = 2,
+  MWRS_MSG_CL_STAT       = 3,
+  MWRS_MSG_CL_STAT_WATCH = 4,
 
-  MWRS_MSG_CL_WATCHER_OPEN,
-  MWRS_MSG_CL_CLOSE_WATCHER,
+  MWRS_MSG_CL_WATCHER_OPEN  = 5,
+  MWRS_MSG_CL_CLOSE_WATCHER = 6,
 
 #ifdef _WIN32
-  MWRS_MSG_CL_WIN_HANDSHAKE,
+  MWRS_MSG_CL_WIN_HANDSHAKE = 7,
 #endif
+
+  // Protocol v2, same numbers on every platform
+  MWRS_MSG_CL_WATCH_PREFIX = 8,
+  MWRS_MSG_CL_WATCH_GLOB   = 9,
+  MWRS_MSG_CL_WATCH_SINCE  = 10,
 };
 
 
 struct mwrs_cl_message
 {
-  mwrs_cl_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_cl_msg_type
+  uint32_t length;
 
   // data
 };
@@ -108,19 +255,32 @@ struct mwrs_cl_message
 
 struct mwrs_cl_msg_resource_request
 {
-  mwrs_cl_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_cl_msg_type
+  uint32_t length;
 
 
   mwrs_open_flags flags; // used for open and open_watch
+  int wait_ms;           // used for open with MWRS_OPEN_WAIT, negative waits forever
+  uint64_t since;        // used for watch_since
+
+  char resource_id; // extend message
+};
+
+struct mwrs_cl_msg_resource_request_v1
+{
+  uint32_t type; // mwrs_cl_msg_type
+  uint32_t length;
+
+
+  uint32_t flags; // mwrs_open_flags, without the ones added by v2
 
   char resource_id; // extend message
 };
 
 struct mwrs_cl_msg_watcher_request
 {
-  mwrs_cl_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_cl_msg_type
+  uint32_t length;
 
 
   mwrs_watcher_id watcher_id;
@@ -131,8 +291,8 @@ struct mwrs_cl_msg_watcher_request
 #ifdef _WIN32
 struct mwrs_cl_win_handshake
 {
-  mwrs_cl_msg_type type;
-  unsigned int length;
+  uint32_t type; // mwrs_cl_msg_type
+  uint32_t length;
 
 
   int mwrs_version;
@@ -141,10 +301,37 @@ struct mwrs_cl_win_handshake
   int argc;
   char argv; // extend message
 };
+
+// `protocol` is where v1 has `mwrs_version`, servers only knowing v1 reject it
+// The client can then send a v1 handshake on the same connection
+struct mwrs_cl_win_handshake_v2
+{
+  uint32_t type; // mwrs_cl_msg_type
+  uint32_t length;
+
+
+  uint32_t protocol;
+  uint32_t process_id;
+  uint32_t caps;
+
+  uint32_t argc;
+  char argv; // extend message
+};
 #endif
 
 
 } // extern "C"
 #pragma pack(pop)
 
+// Protocol v1 relies on these sizes
+static_assert(sizeof(mwrs_sv_message) == 8 && sizeof(mwrs_cl_message) == 8,
+              "Message heads must be 8 bytes");
+static_assert(sizeof(mwrs_status_v1) == 24 && sizeof(mwrs_sv_msg_common_response_v1) == 52 &&
+                  sizeof(mwrs_cl_msg_resource_request_v1) == 13 &&
+                  sizeof(mwrs_cl_msg_watcher_request) == 20,
+              "Protocol v1 layouts must not change");
+static_assert(sizeof(mwrs_ret) == 4 && sizeof(mwrs_open_flags) == 4 &&
+                  sizeof(mwrs_event_type) == 4 && sizeof(mwrs_res_state) == 4,
+              "Enums must be 32 bits");
+
 #endif // MWRS_MESSAGES__HEADER_GUARD
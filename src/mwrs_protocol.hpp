@@ -0,0 +1,315 @@
+/**
+ * @file    mwrs_protocol.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_PROTOCOL__HEADER_GUARD
+#define MWRS_PROTOCOL__HEADER_GUARD
+
+#include "mwrs_messages.hpp"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+
+
+// Protocol versions and capabilities, negotiated at handshake
+//
+// A v1 client sends its `mwrs_version` and the server answers in v1.
+// A v2 client sends its protocol and capabilities, the server answers with the ones both support.
+// Servers only knowing v1 reject it, the client then sends a v1 handshake.
+//
+// v1 peers only exchange v1 messages, in their v1 layout.
+// They have no watcher, v1 servers answer watches without one and never send events.
+
+namespace mwrs_protocol
+{
+
+const uint32_t v1 = 0x00010000;
+const uint32_t v2 = 0x00020000;
+
+// Responses are sent as mwrs_sv_msg_compact_response
+const uint32_t capCompactResponses = 0x1;
+
+// Capabilities of this version of the library
+const uint32_t supportedCaps = capCompactResponses;
+
+// Open flags added by v2, they are not sent to v1 peers
+const uint32_t v2OpenFlags = MWRS_OPEN_INLINE | MWRS_OPEN_WAIT | MWRS_OPEN_PUSH;
+
+
+// Requests clients send to v1 servers, the other ones need a watcher
+inline bool v1_request(uint32_t type)
+{
+  return type == MWRS_MSG_CL_OPEN || type == MWRS_MSG_CL_STAT;
+}
+
+/**
+ * Encode `response` to the v1 layout, it has no field added by v2.
+ */
+inline void v1_encode(const mwrs_sv_msg_common_response * response,
+                      mwrs_sv_msg_common_response_v1 * out)
+{
+  out->type       = MWRS_MSG_SV_COMMON_RESPONSE;
+  out->length     = sizeof(mwrs_sv_msg_common_response_v1);
+  out->status     = response->status;
+  out->open_flags = response->open_flags & ~v2OpenFlags;
+#ifdef _WIN32
+  out->handle = response->win_handle;
+#else
+  out->handle = (uint32_t)response->fd;
+#endif
+  out->stat.state = response->stat.state;
+  out->stat.size  = response->stat.size;
+  out->stat.mtime = response->stat.mtime;
+  out->watcher_id = response->watcher_id;
+}
+
+/**
+ * Decode the v1 response `v1` to `out`, which is zeroed.
+ */
+inline void v1_expand(const mwrs_sv_msg_common_response_v1 * v1,
+                      mwrs_sv_msg_common_response * out)
+{
+  out->type       = MWRS_MSG_SV_COMMON_RESPONSE;
+  out->length     = sizeof(mwrs_sv_msg_common_response);
+  out->status     = (mwrs_ret)v1->status;
+  out->open_flags = (mwrs_open_flags)(v1->open_flags & ~v2OpenFlags);
+#ifdef _WIN32
+  out->win_handle = v1->handle;
+#else
+  out->fd = (mwrs_fd)v1->handle;
+#endif
+  out->stat.state = (mwrs_res_state)v1->stat.state;
+  out->stat.size  = v1->stat.size;
+  out->stat.mtime = v1->stat.mtime;
+  out->watcher_id = v1->watcher_id;
+}
+
+
+// Fields of `response` sent in compact form, absent ones are zero
+inline uint32_t compact_fields(const mwrs_sv_msg_common_response * response)
+{
+  uint32_t fields = 0;
+  if (response->status == MWRS_SUCCESS && response->open_flags != 0)
+  {
+    fields |= MWRS_FIELD_RES;
+    if (response->open_flags & MWRS_OPEN_INLINE)
+      fields |= MWRS_FIELD_CONTENT;
+  }
+  if (response->stat.state != 0)
+    fields |= MWRS_FIELD_STAT;
+  if (response->watcher_id != 0)
+    fields |= MWRS_FIELD_WATCHER;
+  return fields;
+}
+
+inline size_t compact_size(const mwrs_sv_msg_common_response * response)
+{
+  uint32_t fields = compact_fields(response);
+
+  size_t size = sizeof(mwrs_sv_msg_compact_response);
+  if (fields & MWRS_FIELD_RES)
+    size += sizeof(mwrs_response_res);
+  if (fields & MWRS_FIELD_STAT)
+    size += sizeof(mwrs_response_stat);
+  if (fields & MWRS_FIELD_WATCHER)
+    size += sizeof(mwrs_response_watcher);
+  if (fields & MWRS_FIELD_CONTENT)
+  {
+    size += sizeof(mwrs_response_content);
+    if (response->arena_generation == 0)
+      size += response->inline_size;
+  }
+  return size;
+}
+
+
+/**
+ * Encode `response` to `out`, which has room for `compact_size(response)` bytes.
+ */
+inline void compact_encode(const mwrs_sv_msg_common_response * response,
+                           mwrs_sv_msg_compact_response * out)
+{
+  out->type   = MWRS_MSG_SV_COMPACT_RESPONSE;
+  out->length = (uint32_t)compact_size(response);
+  out->status = response->status;
+  out->fields = compact_fields(response);
+
+  char * data = (char *)(out + 1);
+
+  if (out->fields & MWRS_FIELD_RES)
+  {
+    mwrs_response_res res;
+    res.open_flags = response->open_flags;
+#ifdef _WIN32
+    res.handle = response->win_handle;
+#else
+    res.handle = (uint32_t)response->fd;
+#endif
+    std::memcpy(data, &res, sizeof(res));
+    data += sizeof(res);
+  }
+
+  if (out->fields & MWRS_FIELD_STAT)
+  {
+    mwrs_response_stat stat;
+    stat.state   = response->stat.state;
+    stat.size    = response->stat.size;
+    stat.mtime   = response->stat.mtime;
+    stat.version = response->stat.version;
+    std::memcpy(data, &stat, sizeof(stat));
+    data += sizeof(stat);
+  }
+
+  if (out->fields & MWRS_FIELD_WATCHER)
+  {
+    mwrs_response_watcher watcher;
+    watcher.watcher_id = response->watcher_id;
+    std::memcpy(data, &watcher, sizeof(watcher));
+    data += sizeof(watcher);
+  }
+
+  if (out->fields & MWRS_FIELD_CONTENT)
+  {
+    mwrs_response_content content;
+    content.arena_generation = response->arena_generation;
+    content.arena_offset     = response->arena_offset;
+    content.inline_size      = response->inline_size;
+    std::memcpy(data, &content, sizeof(content));
+    data += sizeof(content);
+
+    if (content.arena_generation == 0)
+      std::memcpy(data, &response->inline_data, content.inline_size);
+  }
+}
+// compact_encode
+
+
+/**
+ * Content fields of `compact`, which was encoded by `compact_encode`.
+ * Returns false if it has none.
+ */
+inline bool compact_content(const mwrs_sv_msg_compact_response * compact,
+                            mwrs_response_content * content_out)
+{
+  if (!(compact->fields & MWRS_FIELD_CONTENT))
+    return false;
+
+  size_t offset = 0;
+  if (compact->fields & MWRS_FIELD_RES)
+    offset += sizeof(mwrs_response_res);
+  if (compact->fields & MWRS_FIELD_STAT)
+    offset += sizeof(mwrs_response_stat);
+  if (compact->fields & MWRS_FIELD_WATCHER)
+    offset += sizeof(mwrs_response_watcher);
+
+  std::memcpy(content_out, (const char *)(compact + 1) + offset, sizeof(mwrs_response_content));
+  return true;
+}
+
+
+/**
+ * Size of the common response `compact` decodes to, 0 if it is malformed.
+ */
+inline size_t expanded_size(const mwrs_sv_msg_compact_response * compact)
+{
+  if (compact->length < sizeof(mwrs_sv_msg_compact_response))
+    return 0;
+
+  size_t left   = compact->length - sizeof(mwrs_sv_msg_compact_response);
+  size_t needed = 0;
+  if (compact->fields & MWRS_FIELD_RES)
+    needed += sizeof(mwrs_response_res);
+  if (compact->fields & MWRS_FIELD_STAT)
+    needed += sizeof(mwrs_response_stat);
+  if (compact->fields & MWRS_FIELD_WATCHER)
+    needed += sizeof(mwrs_response_watcher);
+
+  if (!(compact->fields & MWRS_FIELD_CONTENT))
+    return needed == left ? sizeof(mwrs_sv_msg_common_response) : 0;
+
+  needed += sizeof(mwrs_response_content);
+  if (left < needed)
+    return 0;
+
+  mwrs_response_content content;
+  std::memcpy(&content, (const char *)(compact + 1) + needed - sizeof(content), sizeof(content));
+
+  size_t inline_size = content.arena_generation == 0 ? content.inline_size : 0;
+  if (left - needed != inline_size)
+    return 0;
+  return sizeof(mwrs_sv_msg_common_response) + inline_size;
+}
+// expanded_size
+
+
+/**
+ * Decode `compact` to `out`, which is zeroed and has room for `expanded_size(compact)` bytes.
+ */
+inline void expand(const mwrs_sv_msg_compact_response * compact,
+                   mwrs_sv_msg_common_response * out)
+{
+  out->type   = MWRS_MSG_SV_COMMON_RESPONSE;
+  out->length = (uint32_t)expanded_size(compact);
+  out->status = (mwrs_ret)compact->status;
+
+  const char * data = (const char *)(compact + 1);
+
+  if (compact->fields & MWRS_FIELD_RES)
+  {
+    mwrs_response_res res;
+    std::memcpy(&res, data, sizeof(res));
+    data += sizeof(res);
+
+    out->open_flags = (mwrs_open_flags)res.open_flags;
+#ifdef _WIN32
+    out->win_handle = res.handle;
+#else
+    out->fd = (mwrs_fd)res.handle;
+#endif
+  }
+
+  if (compact->fields & MWRS_FIELD_STAT)
+  {
+    mwrs_response_stat stat;
+    std::memcpy(&stat, data, sizeof(stat));
+    data += sizeof(stat);
+
+    out->stat.state   = (mwrs_res_state)stat.state;
+    out->stat.size    = stat.size;
+    out->stat.mtime   = stat.mtime;
+    out->stat.version = stat.version;
+  }
+
+  if (compact->fields & MWRS_FIELD_WATCHER)
+  {
+    mwrs_response_watcher watcher;
+    std::memcpy(&watcher, data, sizeof(watcher));
+    data += sizeof(watcher);
+
+    out->watcher_id = watcher.watcher_id;
+  }
+
+  if (compact->fields & MWRS_FIELD_CONTENT)
+  {
+    mwrs_response_content content;
+    std::memcpy(&content, data, sizeof(content));
+    data += sizeof(content);
+
+    out->arena_generation = content.arena_generation;
+    out->arena_offset     = content.arena_offset;
+    out->inline_size      = content.inline_size;
+
+    if (content.arena_generation == 0)
+      std::memcpy(&out->inline_data, data, content.inline_size);
+  }
+}
+// expand
+
+} // namespace mwrs_protocol
+
+#endif // MWRS_PROTOCOL__HEADER_GUARD
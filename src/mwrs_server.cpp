@@ -5,7 +5,20 @@
  */
 
 #define MWRS_INCLUDE_SERVER
+#include "mwrs_framing.hpp"
 #include "mwrs_messages.hpp"
+#include "mwrs_protocol.hpp"
+#include "mwrs_server_arena.hpp"
+#include "mwrs_server_epoch.hpp"
+#include "mwrs_server_journal.hpp"
+#include "mwrs_server_match.hpp"
+#include "mwrs_server_miss.hpp"
+#include "mwrs_server_monitor.hpp"
+#include "mwrs_server_mpsc.hpp"
+#include "mwrs_server_pool.hpp"
+#include "mwrs_server_slots.hpp"
+#include "mwrs_server_status.hpp"
+#include "mwrs_server_store.hpp"
 #include <mwrs_server.h>
 
 
@@ -13,12 +26,17 @@
 #include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
 #include <cstring>
 #include <iterator>
 #include <list>
 #include <memory>
 #include <mutex>
-#include <set>
+#include <new>
+#include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
@@ -37,6 +55,23 @@ namespace
 
 const DWORD pipeBufferSize = 4096;
 
+const mwrs_size defaultCacheSize = 256 << 20;
+
+const mwrs_size defaultInlineMaxSize = 4 << 10;
+
+const std::size_t maxEventRanges = 256;
+
+const std::size_t watchShardCount = 16;
+
+// Event types that can be coalesced, see event_slot
+const int eventSlotCount = 12;
+
+// Messages queued to a client by other threads before they overflow to a locked list
+const std::size_t inboxCapacity = 1024;
+
+// Queued messages are gathered in a single write up to this size
+const std::size_t writeBudget = 64 << 10;
+
 static_assert(pipeBufferSize >= sizeof(mwrs_cl_message), "");
 static_assert(pipeBufferSize >= sizeof(mwrs_sv_message), "");
 
@@ -45,6 +80,120 @@ static_assert(pipeBufferSize >= sizeof(mwrs_sv_message), "");
 
 struct mwrs_server_data;
 struct mwrs_client_data;
+struct watched_resource;
+
+
+// Ring buffer of messages waiting to be written to a client
+// Storage is only allocated when the queue grows
+class MessageQueue
+{
+ public:
+  bool empty() const { return count == 0; }
+
+  std::size_t size() const { return count; }
+
+  mwrs_sv_message * front() const { return ring[head]; }
+
+  mwrs_sv_message * at(std::size_t index) const { return ring[(head + index) % ring.size()]; }
+
+  void replace(std::size_t index, mwrs_sv_message * message)
+  {
+    ring[(head + index) % ring.size()] = message;
+  }
+
+  void push_back(mwrs_sv_message * message)
+  {
+    if (count == ring.size())
+    {
+      std::vector<mwrs_sv_message *> larger(ring.empty() ? 16 : ring.size() * 2);
+      for (std::size_t i = 0; i < count; ++i)
+        larger[i] = ring[(head + i) % ring.size()];
+      ring.swap(larger);
+      head = 0;
+    }
+    ring[(head + count) % ring.size()] = message;
+    ++count;
+  }
+
+  void pop_front()
+  {
+    head = (head + 1) % ring.size();
+    --count;
+  }
+
+
+ private:
+  std::vector<mwrs_sv_message *> ring;
+  std::size_t head  = 0;
+  std::size_t count = 0;
+};
+
+
+// A client watching a resource
+struct watcher_subscription
+{
+  watcher_subscription(mwrs_client_data * client, watched_resource * resource, std::size_t index)
+      : client(client), resource(resource), index(index)
+  {
+  }
+
+  // Only valid in an epoch section of server->epochs
+  mwrs_client_data * client;
+  watched_resource * resource;
+
+  // Position in resource->watchers
+  std::size_t index;
+
+  // Number of times the client watched the resource
+  int count = 1;
+
+  // Flags to open the resource again with READY and UPDATE events, see MWRS_OPEN_PUSH
+  std::atomic<mwrs_open_flags> push_flags{(mwrs_open_flags)0};
+
+  // Event types waiting in the client write queue, see event_bit
+  std::atomic<unsigned> queued_events{0};
+
+  // Newest version of the events of each slot, the queued event is sent with it
+  // if later ones were merged into it, see client_on_message_sending
+  std::atomic<uint64_t> merged_versions[eventSlotCount]{};
+};
+
+typedef std::vector<std::shared_ptr<watcher_subscription>> subscription_list;
+
+enum watch_kind
+{
+  watch_exact,
+  watch_prefix,
+  watch_glob,
+};
+
+// A watched id, prefix or glob pattern
+struct watched_resource
+{
+  watch_kind kind = watch_exact;
+  std::string id;
+  mwrs_watcher_id watcher_id;
+
+  std::unique_ptr<mwrs_sv::GlobPattern> glob;
+
+  // Copied on write, events are dispatched to a snapshot without any lock
+  std::shared_ptr<const subscription_list> watchers = std::make_shared<subscription_list>();
+};
+
+// Exact ids, split by hash
+struct watch_shard
+{
+  std::mutex mutex;
+  std::unordered_map<std::string, std::shared_ptr<watched_resource>> watched;
+};
+
+// Prefix and glob watchers, rebuilt when one is added or removed
+// The trie holds prefixes, and the literal prefix of globs
+struct pattern_snapshot
+{
+  mwrs_sv::PrefixTrie<watched_resource *> index;
+  std::vector<std::shared_ptr<watched_resource>> resources;
+};
 
 
 // Platform-specific data
@@ -72,6 +221,7 @@ class WinClientThread
     ClientHandle(WinClientThread * parent, HANDLE pipe);
     ~ClientHandle();
 
+    // Can be called from any thread
     void queue_message(mwrs_sv_message * message);
 
     void tick();
@@ -91,19 +241,43 @@ class WinClientThread
    private:
     void on_read(mwrs_size readlen);
 
+    void on_message(mwrs_cl_message * message);
+
+    // Move queued messages to write_queue
+    void drain_inbox();
+
+    // Start writing the messages at the front of write_queue, returns the number of bytes
+    DWORD gather_writes(const void ** data_out);
+
+    void pop_written();
+
 
     WinClientThread * parent;
 
     mwrs_client_data * client = nullptr;
 
     HANDLE pipe = INVALID_HANDLE_VALUE;
-    std::mutex mutex;
 
-    mwrs_cl_message read_message_head{};
-    mwrs_cl_message * read_message = nullptr;
-    std::size_t read_offset;
+    // Messages queued by any thread, then moved to write_queue by the I/O thread
+    // Once a message overflowed, the next ones follow it until the list is drained
+    mwrs_sv::MpscRing<mwrs_sv_message *> inbox{inboxCapacity};
+    std::mutex overflow_mutex;
+    std::vector<mwrs_sv_message *> overflow;
+    std::atomic_bool overflowing{false};
+
+    // Messages queued and not drained yet, counted before they are visible
+    // The thread is only woken for the first one, and keeps draining until it reaches 0
+    std::atomic<int> pending{0};
+
+    // Reads bring as many messages as available, they are handled in place
+    mwrs_framing::FrameReader<mwrs_cl_message> reader;
+
+    // Only used by the I/O thread
+    MessageQueue write_queue;
 
-    std::list<mwrs_sv_message *> write_queue;
+    // Messages of write_queue in the current write, copied to write_buffer if there are several
+    std::vector<char> write_buffer;
+    std::size_t write_count = 0;
 
     OVERLAPPED read_overlapped{};
     OVERLAPPED write_overlapped{};
@@ -163,43 +337,223 @@ class WinAcceptThread
 // WinAcceptThread
 
 
-mwrs_ret fill_win_handle_from_res_open(const mwrs_client_data * client,
+// If `inline_out` is set and the resource is small enough, its content is read there
+// instead of giving a handle, or found in the arena.
+// MWRS_OPEN_INLINE is cleared from the response otherwise
+mwrs_ret fill_win_handle_from_res_open(const mwrs_client_data * client, const char * id,
                                        const mwrs_sv_res_open * res_open,
-                                       mwrs_sv_msg_common_response * response_out);
+                                       mwrs_sv_msg_common_response * response_out,
+                                       std::string * inline_out);
 
 
 struct mwrs_server_plat
 {
   std::unique_ptr<WinAcceptThread> thread;
+
+  std::unique_ptr<mwrs_sv::PackCache> pack_cache;
+
+  std::unique_ptr<mwrs_sv::ChangeMonitor> monitor;
+
+  // Only created if enabled in options
+  std::unique_ptr<mwrs_sv::StatusTable> status_table;
+  std::unique_ptr<mwrs_sv::ContentArena> arena;
 };
 
 struct mwrs_client_plat
 {
+  ~mwrs_client_plat();
+
   WinClientThread::ClientHandle * handle = nullptr;
+
+  // Arena generations referenced by the messages queued, they must stay mappable until read
+  // Messages up to the last response have been read once the client sends its next request
+  mwrs_sv::ContentArena * arena = nullptr;
+  std::mutex arena_mutex;
+  std::vector<uint32_t> arena_unread;
+  std::vector<uint32_t> arena_read;
 };
 
 #endif // _WIN32
 
 
-// Data structs
+// Changed byte ranges of an UPDATE event, empty if the whole resource changed
+typedef std::vector<mwrs_range> range_list;
 
-struct mwrs_server_data
+
+// Holds events pushed in bursts, see mwrs_sv_set_debounce
+
+class EventDebouncer
 {
-  char name[MWRS_SERVER_NAME_MAX]{0};
-  mwrs_sv_callbacks callbacks;
+ public:
+  EventDebouncer(mwrs_server_data * server);
+  ~EventDebouncer();
+
+  void stop();
+
+  void set_debounce(const char * id, int window_ms, int max_latency_ms);
+
+  /**
+   * Returns false if the event is not debounced and must be sent now.
+   */
+  bool push(const char * id, mwrs_event_type type, const range_list * ranges);
+
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  struct settings
+  {
+    int window_ms;
+    int max_latency_ms;
+  };
+
+  struct pending_event
+  {
+    mwrs_event_type type;
+    clock::time_point first;
+    clock::time_point deadline;
+
+    // Merged ranges of held UPDATE events, unused once one of them covered everything
+    bool whole = true;
+    range_list ranges;
+  };
+
+  void run();
+
+
+  mwrs_server_data * server;
 
   std::mutex mutex;
-  std::set<std::unique_ptr<mwrs_client_data>> clients;
-  int next_client_id = 1;
+  std::condition_variable wake;
+  bool stop_flag = false;
+  std::thread thread;
+
+  std::unordered_map<std::string, settings> resource_settings;
+  std::unordered_map<std::string, pending_event> pending;
+};
+// EventDebouncer
 
-  mwrs_watcher_id next_watcher_id = 1;
 
-  struct watcher_instance
+// Holds opens of resources that are not available yet, see MWRS_OPEN_WAIT
+// Also opens resources pushed with events, see MWRS_OPEN_PUSH
+
+class OpenWaiter
+{
+ public:
+  OpenWaiter() = default;
+  ~OpenWaiter();
+
+  void stop();
+
+  /**
+   * Value to give to `park`, taken before trying to open.
+   */
+  uint64_t epoch();
+
+  /**
+   * Hold the open until `id` is ready, the response is sent when it completes or times out.
+   * If `id` became ready since `epoch`, the open is tried again immediately.
+   */
+  void park(mwrs_client_data * client, const char * id, mwrs_open_flags flags, int wait_ms,
+            uint64_t epoch);
+
+  void on_ready(const char * id);
+
+  /**
+   * Send an event to `client`, with the resource opened again for READY and UPDATE events.
+   * Events are sent in order.
+   * If `coalesce` is set, an event of the same type still queued last for the watcher
+   * takes the version of this one instead, the resource is only opened once.
+   */
+  void push_event(mwrs_client_data * client, mwrs_watcher_id watcher_id, const char * id,
+                  mwrs_event_type type, uint64_t version, mwrs_open_flags flags, bool coalesce);
+
+  /**
+   * Drop the opens held for `client`, it is disconnecting.
+   */
+  void drop_client(mwrs_client_data * client);
+
+  mwrs_size size();
+
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  struct parked
   {
     mwrs_client_data * client;
-    mwrs_watcher_id id;
+    std::string id;
+    mwrs_open_flags flags;
+    clock::time_point deadline;
+
+    // Pushed events only
+    mwrs_watcher_id watcher_id;
+    mwrs_event_type type;
+    uint64_t version;
   };
-  std::unordered_map<std::string, std::set<watcher_instance>> watcher_data;
+
+  void start_locked();
+
+  void run();
+
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  bool stop_flag = false;
+  std::thread thread;
+
+  // Incremented by every READY event
+  uint64_t ready_epoch = 0;
+
+  // Waiting opens by id, in arrival order
+  std::unordered_map<std::string, std::list<parked>> waiting;
+  mwrs_size waiting_count = 0;
+
+  // Opens to try again
+  std::list<parked> ready;
+
+  // Events to send, in order
+  std::list<parked> pushed;
+
+  // Client of the open being tried outside the lock
+  mwrs_client_data * current = nullptr;
+
+  // The current client was dropped meanwhile, its open must not be parked again
+  bool current_dropped = false;
+};
+// OpenWaiter
+
+
+// Data structs
+
+struct mwrs_server_data
+{
+  char name[MWRS_SERVER_NAME_MAX]{0};
+  mwrs_sv_callbacks callbacks;
+  mwrs_sv_options options;
+
+  // Connected clients, callbacks are never invoked with a lock of the table held
+  mwrs_sv::SlotTable<mwrs_client_data> clients;
+  std::atomic<int> next_client_id{1};
+
+  // Watched resources, clients watching the same resource share its watcher id
+  // Events are dispatched in an epoch section, a client is deleted once no section can reach it
+  watch_shard watch_shards[watchShardCount];
+  mwrs_sv::EpochDomain epochs;
+
+  // Prefix and glob watchers, indexed by kind and pattern
+  std::mutex pattern_mutex;
+  std::unordered_map<std::string, std::shared_ptr<watched_resource>> patterns;
+  std::shared_ptr<const pattern_snapshot> pattern_index;
+
+  std::atomic<mwrs_watcher_id> next_watcher_id{1};
+
+  std::unique_ptr<EventDebouncer> debouncer;
+  std::unique_ptr<OpenWaiter> waiter;
+
+  std::unique_ptr<mwrs_sv::MissCache> misses;
+  std::unique_ptr<mwrs_sv::EventJournal> journal;
 
   mwrs_server_plat plat;
 };
@@ -209,6 +563,16 @@ struct mwrs_client_data
   mwrs_sv_client client{};
   mwrs_server_data * server = nullptr;
 
+  // Handle in server->clients
+  mwrs_sv::SlotTable<mwrs_client_data>::handle slot = 0;
+
+  // Negotiated at handshake, see mwrs_protocol
+  uint32_t protocol = mwrs_protocol::v1;
+  uint32_t caps     = 0;
+
+  // Resources watched by this client, only used from its own I/O thread
+  std::unordered_map<mwrs_watcher_id, std::shared_ptr<watcher_subscription>> watchers;
+
   mwrs_client_plat plat;
 };
 
@@ -221,12 +585,60 @@ void plat_server_stop(mwrs_server_data * server);
 
 void plat_client_queue_message(mwrs_client_data * client, mwrs_sv_message * message);
 
+void plat_server_get_stats(mwrs_server_data * server, mwrs_sv_stats * stats_out);
+
+mwrs_ret plat_monitor_add(mwrs_server_data * server, const char * id, const char * path);
+
+void plat_monitor_remove(mwrs_server_data * server, const char * id);
+
+mwrs_ret plat_publish_status(mwrs_server_data * server, const char * id,
+                             const mwrs_status * status);
+
+mwrs_ret plat_unpublish_status(mwrs_server_data * server, const char * id);
+
+// The content of the resource changed
+void plat_invalidate_content(mwrs_server_data * server, const char * id);
+
 
 // Functions
 
-void * message_alloc(size_t size) { return new char[size]{}; }
+// Messages are reference counted so events can be shared between clients
+// Blocks come from the pools of the thread, see mwrs_sv::pool
+
+struct message_header
+{
+  std::atomic<int> refs;
+  int size_class;
+};
+
+static_assert(sizeof(message_header) == 8, "message_header must be 8 bytes");
+
+void * message_alloc(size_t size)
+{
+  int size_class;
+  char * block = (char *)mwrs_sv::pool::alloc(sizeof(message_header) + size, &size_class);
+  new (block) message_header{{1}, size_class};
+
+  std::memset(block + sizeof(message_header), 0, size);
+  return block + sizeof(message_header);
+}
+
+void message_ref(void * message, int count)
+{
+  message_header * header = (message_header *)((char *)message - sizeof(message_header));
+  header->refs += count;
+}
 
-void message_free(void* message) { delete[] message; }
+void message_free(void * message)
+{
+  message_header * header = (message_header *)((char *)message - sizeof(message_header));
+  if (--header->refs == 0)
+  {
+    int size_class = header->size_class;
+    header->~message_header();
+    mwrs_sv::pool::free(header, size_class);
+  }
+}
 
 
 mwrs_ret server_on_client_connect(mwrs_server_data * server, int argc, const char ** argv,
@@ -237,154 +649,1378 @@ mwrs_ret server_on_client_connect(mwrs_server_data * server, int argc, const cha
 
   std::unique_ptr<mwrs_client_data> client(new mwrs_client_data);
   client->server          = server;
+  client->client.id       = server->next_client_id++;
   client->client.userdata = nullptr;
 
+  // Not published yet, nothing else can reach it
+  if (server->callbacks.connect)
   {
-    std::unique_lock<std::mutex> lock(server->mutex);
-    client->client.id = server->next_client_id++;
-
-    if (server->callbacks.connect)
-    {
-      mwrs_ret ret;
-      if ((ret = server->callbacks.connect(&client->client, argc, argv)) != MWRS_SUCCESS)
-        return ret;
-    }
-
-    auto client_ptr = client.get();
-    server->clients.emplace(std::move(client));
-    *client_out = client_ptr;
+    mwrs_ret ret;
+    if ((ret = server->callbacks.connect(&client->client, argc, argv)) != MWRS_SUCCESS)
+      return ret;
   }
+
+  mwrs_client_data * client_ptr = client.get();
+  client_ptr->slot              = server->clients.insert(std::move(client));
+  *client_out                   = client_ptr;
   return MWRS_SUCCESS;
 }
 // server_on_client_connect
 
-void server_on_client_disconnect(mwrs_server_data * server, mwrs_client_data * client)
+std::string pattern_key(watch_kind kind, const char * pattern)
 {
-  if (!server || !client)
-    return;
+  return (kind == watch_prefix ? "p:" : "g:") + std::string(pattern);
+}
 
-  std::unique_lock<std::mutex> lock(server->mutex);
+watch_shard & server_shard(mwrs_server_data * server, const char * id)
+{
+  return server->watch_shards[std::hash<std::string>()(id) % watchShardCount];
+}
 
-  auto it = std::find_if(
-      server->clients.begin(), server->clients.end(),
-      [client](const std::unique_ptr<mwrs_client_data> & v) { return v.get() == client; });
+// Called with server->pattern_mutex held
+void server_publish_patterns_locked(mwrs_server_data * server)
+{
+  std::shared_ptr<pattern_snapshot> snapshot;
 
-  if (it == server->clients.end())
+  if (!server->patterns.empty())
   {
-    // TODO unlock & error
-    assert(0 && "Client not found in server");
+    snapshot = std::make_shared<pattern_snapshot>();
+    for (auto & entry : server->patterns)
+    {
+      watched_resource * res = entry.second.get();
+      snapshot->index.insert(res->glob ? res->glob->literal_prefix() : res->id, res);
+      snapshot->resources.push_back(entry.second);
+    }
   }
-  else
-  {
-    // TODO Clear all watchers
-
-    if (server->callbacks.disconnect)
-      server->callbacks.disconnect(&client->client);
 
-    server->clients.erase(it);
-  }
+  std::atomic_store(&server->pattern_index, std::shared_ptr<const pattern_snapshot>(snapshot));
 }
-// server_on_client_disconnect
+// server_publish_patterns_locked
 
-mwrs_ret server_on_event(mwrs_server_data * server, const char * id, mwrs_event_type type)
+// Called with the lock of the shard or of the patterns held
+// Returns true if it was the last subscription
+bool server_unlink_subscription_locked(watcher_subscription * sub)
 {
-  return MWRS_E_SERVERERR; // TODO
+  watched_resource * res = sub->resource;
+
+  // Swap with last, O(1) apart from the copy
+  std::shared_ptr<subscription_list> watchers = std::make_shared<subscription_list>(*res->watchers);
+  std::shared_ptr<watcher_subscription> last  = watchers->back();
+  (*watchers)[sub->index]                     = last;
+  last->index                                 = sub->index;
+  watchers->pop_back();
+
+  bool empty = watchers->empty();
+  std::atomic_store(&res->watchers, std::shared_ptr<const subscription_list>(std::move(watchers)));
+  return empty;
 }
-// server_on_event
+// server_unlink_subscription_locked
 
-void client_on_receive_message(mwrs_client_data * client, const mwrs_cl_message * message)
+void server_remove_subscription(mwrs_server_data * server, watcher_subscription * sub)
 {
-  mwrs_sv_message * response = nullptr;
-  switch (message->type)
-  {
-  case MWRS_MSG_CL_OPEN:
-  case MWRS_MSG_CL_WATCH:
-  case MWRS_MSG_CL_OPEN_WATCH:
-  case MWRS_MSG_CL_STAT:
-  case MWRS_MSG_CL_STAT_WATCH:
+  watched_resource * res = sub->resource;
+
+  if (res->kind != watch_exact)
   {
-    mwrs_cl_msg_resource_request * resource_request = (mwrs_cl_msg_resource_request *)message;
-    mwrs_sv_msg_common_response * common_response =
-        (mwrs_sv_msg_common_response *)message_alloc(sizeof(mwrs_sv_msg_common_response));
-    common_response->type = MWRS_MSG_SV_COMMON_RESPONSE;
-    common_response->length = sizeof(mwrs_sv_msg_common_response);
-    response                = (mwrs_sv_message *)common_response;
-    // Watch first
-    switch (message->type)
-    {
-    case MWRS_MSG_CL_WATCH:
-    case MWRS_MSG_CL_OPEN_WATCH:
-    case MWRS_MSG_CL_STAT_WATCH:
-      // TODO watch
-      break;
-    default: break;
-    }
-    // Open
-    switch (message->type)
-    {
-    case MWRS_MSG_CL_OPEN:
-    case MWRS_MSG_CL_OPEN_WATCH:
-    {
-      mwrs_sv_res_open res_open{};
-      common_response->status =
-          client->server->callbacks.open(&client->client, &resource_request->resource_id, resource_request->flags, &res_open);
+    std::unique_lock<std::mutex> lock(server->pattern_mutex);
 
-      if (common_response->status == MWRS_SUCCESS)
-      {
-        common_response->open_flags = resource_request->flags;
-        // TODO platform dependant, fixme
-        // Fill file descriptor after open_flags (can be used by res open) TODO use argument?
-        common_response->status = fill_win_handle_from_res_open(client, &res_open, common_response);
-      }
-    }
-    default: break;
-    }
-    // Stat
-    switch (message->type)
-    {
-    case MWRS_MSG_CL_STAT:
-    case MWRS_MSG_CL_STAT_WATCH:
+    if (server_unlink_subscription_locked(sub))
     {
-      mwrs_status res_stat{};
-      common_response->status = client->server->callbacks.stat(
-          &client->client, &resource_request->resource_id, &res_stat);
-      break;
+      // Snapshots still being visited keep their own reference
+      server->patterns.erase(pattern_key(res->kind, res->id.c_str()));
+      server_publish_patterns_locked(server);
     }
-    default: break;
-    }
-    break;
+    return;
   }
-  case MWRS_MSG_CL_WATCHER_OPEN:
-  case MWRS_MSG_CL_CLOSE_WATCHER: break;
 
-  default:
-    // TODO error
-    assert(0 && "Invalid message type");
-  }
+  std::string id = res->id;
 
-  if (response)
-    plat_client_queue_message(client, response);
-  else
-    assert(0 && "No response to client message");
-}
-// client_on_receive_message
+  watch_shard & shard = server_shard(server, id.c_str());
+  std::unique_lock<std::mutex> lock(shard.mutex);
 
+  if (server_unlink_subscription_locked(sub))
+  {
+    plat_monitor_remove(server, id.c_str());
 
-//
+    if (server->callbacks.unwatch)
+      server->callbacks.unwatch(id.c_str());
 
+    shard.watched.erase(id);
+  }
+}
+// server_remove_subscription
 
-// Platform-specific implementation
+void server_clear_watchers(mwrs_server_data * server, mwrs_client_data * client)
+{
+  for (auto & sub : client->watchers)
+    server_remove_subscription(server, sub.second.get());
 
-#ifdef _WIN32
+  client->watchers.clear();
 
-mwrs_win_handle_data to_mwrs_handle(HANDLE win_handle)
-{
-  static_assert(sizeof(mwrs_win_handle_data) == 4, "mwrs_win_handle_data must be 4 bytes");
-  return reinterpret_cast<mwrs_win_handle_data>(win_handle);
+  // Events being dispatched might still reach the client
+  server->epochs.synchronize();
 }
+// server_clear_watchers
 
-WinClientThread::ClientHandle::ClientHandle(WinClientThread * parent, HANDLE pipe)
-    : parent(parent), pipe(pipe)
+void server_on_client_disconnect(mwrs_server_data * server, mwrs_client_data * client)
+{
+  if (!server || !client)
+    return;
+
+  std::unique_ptr<mwrs_client_data> owned = server->clients.remove(client->slot);
+
+  if (!owned)
+  {
+    // TODO error
+    assert(0 && "Client not found in server");
+    return;
+  }
+
+  server_clear_watchers(server, client);
+
+  // Held opens would be answered to a deleted client
+  // Only done now, events dispatched until server_clear_watchers returned could still push some
+  server->waiter->drop_client(client);
+
+  if (server->callbacks.disconnect)
+    server->callbacks.disconnect(&client->client);
+}
+// server_on_client_disconnect
+
+// Failures are not reported, unmonitored resources only get events pushed manually
+void server_monitor_add(mwrs_server_data * server, const char * id)
+{
+  if (!server->callbacks.locate)
+    return;
+
+  char path[MWRS_SV_PATH_MAX]{0};
+  if (server->callbacks.locate(id, path, sizeof(path)) != MWRS_SUCCESS)
+    return;
+
+  path[sizeof(path) - 1] = 0;
+  plat_monitor_add(server, id, path);
+}
+// server_monitor_add
+
+// Watch and unwatch callbacks, and automatic change detection, only apply to exact ids
+mwrs_ret server_add_watcher(mwrs_server_data * server, mwrs_client_data * client, const char * id,
+                            mwrs_watcher_id * watcher_id_out, watch_kind kind = watch_exact,
+                            mwrs_open_flags push_flags = (mwrs_open_flags)0,
+                            std::unique_lock<std::mutex> * lock_out = nullptr)
+{
+  std::unique_lock<std::mutex> lock;
+
+  watched_resource * res;
+
+  if (kind != watch_exact)
+  {
+    lock = std::unique_lock<std::mutex>(server->pattern_mutex);
+
+    std::string key = pattern_key(kind, id);
+
+    auto it = server->patterns.find(key);
+    if (it == server->patterns.end())
+    {
+      res             = new watched_resource;
+      res->kind       = kind;
+      res->id         = id;
+      res->watcher_id = server->next_watcher_id++;
+      if (kind == watch_glob)
+        res->glob.reset(new mwrs_sv::GlobPattern(res->id));
+
+      server->patterns.emplace(key, std::shared_ptr<watched_resource>(res));
+      server_publish_patterns_locked(server);
+    }
+    else
+    {
+      res = it->second.get();
+    }
+  }
+  else
+  {
+    watch_shard & shard = server_shard(server, id);
+    lock                = std::unique_lock<std::mutex>(shard.mutex);
+
+    auto it = shard.watched.find(id);
+    if (it == shard.watched.end())
+    {
+      // First watcher
+      if (server->callbacks.watch)
+      {
+        mwrs_ret ret = server->callbacks.watch(id);
+        if (ret != MWRS_SUCCESS)
+          return ret;
+      }
+
+      res             = new watched_resource;
+      res->id         = id;
+      res->watcher_id = server->next_watcher_id++;
+      shard.watched.emplace(res->id, std::shared_ptr<watched_resource>(res));
+
+      server_monitor_add(server, id);
+    }
+    else
+    {
+      res = it->second.get();
+    }
+  }
+
+  watcher_subscription * sub;
+
+  auto sub_it = client->watchers.find(res->watcher_id);
+  if (sub_it != client->watchers.end())
+  {
+    sub = sub_it->second.get();
+    ++sub->count;
+
+    if (push_flags)
+      sub->push_flags = push_flags;
+  }
+  else
+  {
+    std::shared_ptr<watcher_subscription> added =
+        std::make_shared<watcher_subscription>(client, res, res->watchers->size());
+    added->push_flags = push_flags;
+    sub               = added.get();
+    client->watchers.emplace(res->watcher_id, added);
+
+    std::shared_ptr<subscription_list> watchers =
+        std::make_shared<subscription_list>(*res->watchers);
+    watchers->push_back(std::move(added));
+    std::atomic_store(&res->watchers, std::shared_ptr<const subscription_list>(std::move(watchers)));
+  }
+
+  *watcher_id_out = res->watcher_id;
+
+  // No event can be queued for the watcher until the caller is done
+  if (lock_out)
+    *lock_out = std::move(lock);
+  return MWRS_SUCCESS;
+}
+// server_add_watcher
+
+mwrs_ret server_remove_watcher(mwrs_server_data * server, mwrs_client_data * client,
+                               mwrs_watcher_id watcher_id)
+{
+  auto it = client->watchers.find(watcher_id);
+  if (it == client->watchers.end())
+    return MWRS_E_ARGS;
+
+  // The subscription lives on in the snapshots still being dispatched to
+  if (--it->second->count == 0)
+  {
+    server_remove_subscription(server, it->second.get());
+    client->watchers.erase(it);
+  }
+
+  return MWRS_SUCCESS;
+}
+// server_remove_watcher
+
+bool server_get_watched_id(mwrs_server_data * server, mwrs_client_data * client,
+                           mwrs_watcher_id watcher_id, std::string * id_out)
+{
+  auto it = client->watchers.find(watcher_id);
+  if (it == client->watchers.end() || it->second->resource->kind != watch_exact)
+    return false;
+
+  *id_out = it->second->resource->id;
+  return true;
+}
+// server_get_watched_id
+
+// Slot used to coalesce queued events of this type, -1 if they are never merged
+int event_slot(mwrs_event_type type)
+{
+  if (type >= MWRS_EVENT_READY && type <= MWRS_EVENT_DELETE)
+    return type;
+  if (type >= MWRS_EVENT_USER1 && type <= MWRS_EVENT_USER4)
+    return 8 + type - MWRS_EVENT_USER1;
+  return -1;
+}
+
+static_assert(8 + MWRS_EVENT_USER4 - MWRS_EVENT_USER1 < eventSlotCount, "");
+
+// Bit of the slot in watcher_subscription::queued_events, 0 if they are never merged
+unsigned event_bit(mwrs_event_type type)
+{
+  int slot = event_slot(type);
+  return slot < 0 ? 0 : 1u << slot;
+}
+
+void store_max(std::atomic<uint64_t> & value, uint64_t candidate)
+{
+  uint64_t current = value.load();
+  while (current < candidate && !value.compare_exchange_weak(current, candidate))
+  {
+  }
+}
+
+// Sort and merge overlapping or adjacent ranges
+// Past maxEventRanges, they are replaced by the range covering all of them
+void merge_ranges(range_list & ranges)
+{
+  std::sort(ranges.begin(), ranges.end(), [](const mwrs_range & a, const mwrs_range & b) {
+    return a.offset < b.offset;
+  });
+
+  std::size_t out = 0;
+  for (std::size_t i = 1; i < ranges.size(); ++i)
+  {
+    mwrs_range & last = ranges[out];
+    if (ranges[i].offset <= last.offset + last.size)
+      last.size = std::max(last.size, ranges[i].offset + ranges[i].size - last.offset);
+    else
+      ranges[++out] = ranges[i];
+  }
+  if (!ranges.empty())
+    ranges.resize(out + 1);
+
+  if (ranges.size() > maxEventRanges)
+  {
+    mwrs_range all{ranges.front().offset,
+                   ranges.back().offset + ranges.back().size - ranges.front().offset};
+    ranges.assign(1, all);
+  }
+}
+// merge_ranges
+
+mwrs_sv_message * event_alloc(mwrs_watcher_id watcher_id, const char * id, mwrs_event_type type,
+                              uint64_t version, const range_list * ranges = nullptr)
+{
+  std::size_t id_len      = std::strlen(id);
+  std::size_t range_count = ranges ? ranges->size() : 0;
+  std::size_t length = sizeof(mwrs_sv_msg_event) + id_len + range_count * sizeof(mwrs_range);
+
+  mwrs_sv_msg_event * event = (mwrs_sv_msg_event *)message_alloc(length);
+  event->type               = MWRS_MSG_SV_EVENT;
+  event->length             = (unsigned int)length;
+  event->watcher_id         = watcher_id;
+  event->event              = type;
+  event->version            = version;
+  event->range_count        = (unsigned int)range_count;
+
+  // resource_id must have null terminator, message type contains 1 extra byte
+  std::memcpy(&event->resource_id, id, id_len);
+
+  if (range_count)
+    std::memcpy(&event->resource_id + id_len + 1, ranges->data(),
+                range_count * sizeof(mwrs_range));
+  return (mwrs_sv_message *)event;
+}
+
+// Called in an epoch section, `watchers` is a snapshot of res->watchers
+void server_queue_event(mwrs_server_data * server, const watched_resource * res,
+                        const subscription_list & watchers, const char * id, mwrs_event_type type,
+                        uint64_t version, const range_list * ranges)
+{
+  // Pattern watchers get events for many ids, they must not be merged
+  int slot = (server->options.disable_event_coalescing || res->kind != watch_exact)
+                 ? -1
+                 : event_slot(type);
+  unsigned bit = slot < 0 ? 0 : 1u << slot;
+
+  // Encode once, every client gets a reference
+  mwrs_sv_message * event = event_alloc(res->watcher_id, id, type, version, ranges);
+
+  // Partial updates are covered by a queued update of the whole resource
+  // They are never merged with each other, their ranges would be lost
+  bool partial = ranges && !ranges->empty();
+
+  for (const std::shared_ptr<watcher_subscription> & sub : watchers)
+  {
+    // Opened by the waiter, which also sends the other events to keep them in order
+    mwrs_open_flags push_flags = sub->push_flags;
+    if (push_flags)
+    {
+      server->waiter->push_event(sub->client, res->watcher_id, id, type, version, push_flags,
+                                 bit != 0);
+      continue;
+    }
+
+    // Stored before the bit is tested, the queued event is sent with this version if this one
+    // is merged into it, so clients never get an older version than the journal
+    if (bit)
+      store_max(sub->merged_versions[slot], version);
+
+    // Same event still waiting in the client write queue
+    if (partial)
+    {
+      if (bit && (sub->queued_events.load() & bit))
+        continue;
+    }
+    else if (bit && (sub->queued_events.fetch_or(bit) & bit))
+    {
+      continue;
+    }
+
+    message_ref(event, 1);
+    plat_client_queue_message(sub->client, event);
+  }
+
+  message_free(event);
+}
+// server_queue_event
+
+mwrs_ret server_on_event(mwrs_server_data * server, const char * id, mwrs_event_type type,
+                         const range_list * ranges = nullptr)
+{
+  if (type == MWRS_EVENT_UPDATE || type == MWRS_EVENT_MOVE || type == MWRS_EVENT_DELETE)
+    plat_invalidate_content(server, id);
+  else if (type == MWRS_EVENT_READY)
+  {
+    server->misses->on_ready(id);
+    server->waiter->on_ready(id);
+  }
+
+  // Clients reached from the snapshots are not deleted before the end of the section
+  mwrs_sv::EpochDomain::guard section(server->epochs);
+
+  uint64_t version;
+  std::shared_ptr<watched_resource> res;
+  std::shared_ptr<const subscription_list> watchers;
+
+  {
+    watch_shard & shard = server_shard(server, id);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    // Journaled under the lock of the shard, see server_watch_since
+    version = server->journal->record(id, type);
+
+    auto it = shard.watched.find(id);
+    if (it != shard.watched.end())
+    {
+      res      = it->second;
+      watchers = std::atomic_load(&res->watchers);
+    }
+  }
+
+  if (watchers)
+    server_queue_event(server, res.get(), *watchers, id, type, version, ranges);
+
+  // Only visits the patterns along the id
+  std::shared_ptr<const pattern_snapshot> patterns = std::atomic_load(&server->pattern_index);
+  if (patterns)
+  {
+    patterns->index.visit_prefixes(id, [server, id, type, version, ranges](watched_resource * res) {
+      if (!res->glob || res->glob->match(id))
+        server_queue_event(server, res, *std::atomic_load(&res->watchers), id, type, version,
+                           ranges);
+    });
+  }
+
+  return MWRS_SUCCESS;
+}
+// server_on_event
+
+// Returns the message to write, a copy if it must carry the version of events merged into it
+mwrs_sv_message * client_on_message_sending(mwrs_client_data * client, mwrs_sv_message * message)
+{
+  if (message->type != MWRS_MSG_SV_EVENT)
+    return message;
+
+  const mwrs_sv_msg_event * event = (const mwrs_sv_msg_event *)message;
+
+  // Partial updates do not set the bit, see server_queue_event
+  int slot = event_slot(event->event);
+  if (event->range_count || slot < 0)
+    return message;
+
+  // Subscriptions of a client are only modified from its own I/O thread
+  auto it = client->watchers.find(event->watcher_id);
+  if (it == client->watchers.end())
+    return message;
+
+  // Cleared before the version is read, see server_queue_event
+  watcher_subscription & sub = *it->second;
+  sub.queued_events &= ~(1u << slot);
+
+  uint64_t merged = sub.merged_versions[slot].load();
+  if (merged <= event->version)
+    return message;
+
+  // The event is shared with other clients
+  mwrs_sv_msg_event * copy = (mwrs_sv_msg_event *)message_alloc(message->length);
+  std::memcpy(copy, message, message->length);
+  copy->version = merged;
+
+  message_free(message);
+  return (mwrs_sv_message *)copy;
+}
+// client_on_message_sending
+
+
+EventDebouncer::EventDebouncer(mwrs_server_data * server) : server(server) {}
+
+EventDebouncer::~EventDebouncer() { stop(); }
+
+void EventDebouncer::stop()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop_flag = true;
+    pending.clear();
+  }
+  wake.notify_all();
+
+  if (thread.joinable())
+    thread.join();
+}
+
+void EventDebouncer::set_debounce(const char * id, int window_ms, int max_latency_ms)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (window_ms < 0)
+    resource_settings.erase(id);
+  else
+    resource_settings[id] = settings{window_ms, max_latency_ms};
+}
+
+bool EventDebouncer::push(const char * id, mwrs_event_type type, const range_list * ranges)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  settings s{server->options.debounce_ms, server->options.debounce_max_latency_ms};
+
+  auto settings_it = resource_settings.find(id);
+  if (settings_it != resource_settings.end())
+    s = settings_it->second;
+
+  if (s.window_ms <= 0 || stop_flag)
+    return false;
+
+  if (s.max_latency_ms <= 0)
+    s.max_latency_ms = s.window_ms * 10;
+
+  clock::time_point now = clock::now();
+
+  auto it = pending.find(id);
+  if (it != pending.end() && it->second.type != type)
+  {
+    // Keep ordering between event types, flush the held event first
+    pending_event held = std::move(it->second);
+    pending.erase(it);
+    lock.unlock();
+    server_on_event(server, id, held.type, held.whole ? nullptr : &held.ranges);
+    lock.lock();
+    it = pending.find(id);
+  }
+
+  if (it == pending.end())
+  {
+    pending_event & p = pending[id];
+    p.type            = type;
+    p.first           = now;
+    p.deadline        = now + std::chrono::milliseconds(s.window_ms);
+
+    if (ranges && !ranges->empty())
+    {
+      p.whole  = false;
+      p.ranges = *ranges;
+    }
+  }
+  else
+  {
+    pending_event & p = it->second;
+    p.deadline =
+        std::min(now + std::chrono::milliseconds(s.window_ms),
+                 p.first + std::chrono::milliseconds(s.max_latency_ms));
+
+    if (!ranges || ranges->empty())
+    {
+      p.whole = true;
+      p.ranges.clear();
+    }
+    else if (!p.whole)
+    {
+      p.ranges.insert(p.ranges.end(), ranges->begin(), ranges->end());
+      merge_ranges(p.ranges);
+    }
+  }
+
+  if (!thread.joinable())
+  {
+    std::thread t([this]() { run(); });
+    thread.swap(t);
+  }
+
+  wake.notify_one();
+  return true;
+}
+
+void EventDebouncer::run()
+{
+  std::vector<std::pair<std::string, pending_event>> due;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stop_flag)
+  {
+    clock::time_point now  = clock::now();
+    clock::time_point next = clock::time_point::max();
+
+    for (auto it = pending.begin(); it != pending.end();)
+    {
+      if (it->second.deadline <= now)
+      {
+        due.emplace_back(it->first, std::move(it->second));
+        it = pending.erase(it);
+      }
+      else
+      {
+        next = std::min(next, it->second.deadline);
+        ++it;
+      }
+    }
+
+    if (!due.empty())
+    {
+      lock.unlock();
+      for (auto & event : due)
+        server_on_event(server, event.first.c_str(), event.second.type,
+                        event.second.whole ? nullptr : &event.second.ranges);
+      due.clear();
+      lock.lock();
+      continue;
+    }
+
+    if (next == clock::time_point::max())
+      wake.wait(lock);
+    else
+      wake.wait_until(lock, next);
+  }
+}
+// EventDebouncer
+
+mwrs_ret server_push_event(mwrs_server_data * server, const char * id, mwrs_event_type type,
+                           const range_list * ranges = nullptr)
+{
+  if (server->debouncer->push(id, type, ranges))
+    return MWRS_SUCCESS;
+
+  return server_on_event(server, id, type, ranges);
+}
+// server_push_event
+
+mwrs_ret client_open(mwrs_client_data * client, const char * id, mwrs_open_flags flags,
+                     mwrs_sv_msg_common_response * response, std::string * inline_out = nullptr)
+{
+  // Inline content is read-only
+  if ((flags & (MWRS_OPEN_WRITE | MWRS_OPEN_APPEND)) || !(flags & MWRS_OPEN_READ) ||
+      client->server->options.inline_max_size < 0)
+    inline_out = nullptr;
+
+  if (!inline_out)
+    flags = (mwrs_open_flags)(flags & ~MWRS_OPEN_INLINE);
+
+  // Handled by the caller
+  flags = (mwrs_open_flags)(flags & ~(MWRS_OPEN_WAIT | MWRS_OPEN_PUSH));
+
+  // Writes may create the resource
+  bool read_only = !(flags & (MWRS_OPEN_WRITE | MWRS_OPEN_APPEND));
+
+  mwrs_sv::MissCache * misses = client->server->misses.get();
+  if (read_only && misses->is_missing(id))
+    return MWRS_E_NOTFOUND;
+
+  uint64_t epoch = misses->epoch();
+
+  mwrs_sv_res_open res_open{};
+  mwrs_ret ret = client->server->callbacks.open(&client->client, id, flags, &res_open);
+
+  if (ret == MWRS_E_NOTFOUND && read_only)
+    misses->record(id, epoch);
+  else if (ret == MWRS_SUCCESS && !read_only)
+    misses->on_ready(id);
+
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  response->open_flags = flags;
+  // TODO platform dependant, fixme
+  // Fill file descriptor after open_flags (can be used by res open) TODO use argument?
+  return fill_win_handle_from_res_open(client, id, &res_open, response, inline_out);
+}
+// client_open
+
+mwrs_ret client_stat(mwrs_client_data * client, const char * id, mwrs_status * stat_out)
+{
+  mwrs_sv::MissCache * misses = client->server->misses.get();
+  if (misses->is_missing(id))
+    return MWRS_E_NOTFOUND;
+
+  uint64_t epoch = misses->epoch();
+
+  // Taken first, events pushed while the callback runs are replayed after this version
+  uint64_t version = client->server->journal->version(id);
+
+  mwrs_ret ret = client->server->callbacks.stat(&client->client, id, stat_out);
+
+  if (ret == MWRS_E_NOTFOUND)
+    misses->record(id, epoch);
+  else if (ret == MWRS_SUCCESS)
+    stat_out->version = (long long)version;
+
+  return ret;
+}
+// client_stat
+
+// Returns a copy of `response` extended with `data`, `response` is freed
+mwrs_sv_msg_common_response * response_attach_inline(mwrs_sv_msg_common_response * response,
+                                                     const std::string & data)
+{
+  // Content found in the arena is not attached
+  if (response->arena_generation != 0)
+    return response;
+
+  // Message type contains 1 extra byte
+  std::size_t length = sizeof(mwrs_sv_msg_common_response) + data.size();
+
+  mwrs_sv_msg_common_response * extended = (mwrs_sv_msg_common_response *)message_alloc(length);
+  std::memcpy(extended, response, sizeof(mwrs_sv_msg_common_response));
+  extended->length      = (unsigned int)length;
+  extended->inline_size = (unsigned int)data.size();
+  std::memcpy(&extended->inline_data, data.data(), data.size());
+
+  message_free(response);
+  return extended;
+}
+// response_attach_inline
+
+// Queue a response, in the form the client negotiated
+void client_queue_response(mwrs_client_data * client, mwrs_sv_message * response)
+{
+  if (response->type == MWRS_MSG_SV_COMMON_RESPONSE && client->protocol == mwrs_protocol::v1)
+  {
+    mwrs_sv_msg_common_response_v1 * v1 = (mwrs_sv_msg_common_response_v1 *)message_alloc(
+        sizeof(mwrs_sv_msg_common_response_v1));
+    mwrs_protocol::v1_encode((const mwrs_sv_msg_common_response *)response, v1);
+
+    message_free(response);
+    response = (mwrs_sv_message *)v1;
+  }
+  else if (response->type == MWRS_MSG_SV_COMMON_RESPONSE &&
+           (client->caps & mwrs_protocol::capCompactResponses))
+  {
+    mwrs_sv_msg_common_response * common_response = (mwrs_sv_msg_common_response *)response;
+
+    mwrs_sv_msg_compact_response * compact =
+        (mwrs_sv_msg_compact_response *)message_alloc(mwrs_protocol::compact_size(common_response));
+    mwrs_protocol::compact_encode(common_response, compact);
+
+    message_free(response);
+    response = (mwrs_sv_message *)compact;
+  }
+
+  plat_client_queue_message(client, response);
+}
+// client_queue_response
+
+// Resource might become available with a READY event
+bool open_must_wait(mwrs_ret status)
+{
+  return status == MWRS_E_NOTFOUND || status == MWRS_E_NOTREADY;
+}
+
+// Open and build the response, returns null if the open must wait and `last_try` is not set
+mwrs_sv_message * open_response(mwrs_client_data * client, const char * id, mwrs_open_flags flags,
+                                bool last_try)
+{
+  std::string inline_data;
+
+  mwrs_sv_msg_common_response * common_response =
+      (mwrs_sv_msg_common_response *)message_alloc(sizeof(mwrs_sv_msg_common_response));
+  common_response->type   = MWRS_MSG_SV_COMMON_RESPONSE;
+  common_response->length = sizeof(mwrs_sv_msg_common_response);
+  common_response->status = client_open(client, id, flags, common_response, &inline_data);
+
+  if (!last_try && open_must_wait(common_response->status))
+  {
+    message_free(common_response);
+    return nullptr;
+  }
+
+  if (common_response->status == MWRS_SUCCESS && (common_response->open_flags & MWRS_OPEN_INLINE))
+    return (mwrs_sv_message *)response_attach_inline(common_response, inline_data);
+
+  return (mwrs_sv_message *)common_response;
+}
+// open_response
+
+// Event for a single client, with the resource opened again
+mwrs_sv_message * event_open_alloc(mwrs_client_data * client, mwrs_watcher_id watcher_id,
+                                   const char * id, mwrs_event_type type, uint64_t version,
+                                   mwrs_open_flags flags)
+{
+  mwrs_sv_message * response = open_response(client, id, flags, true);
+
+  std::size_t id_size = std::strlen(id) + 1;
+  std::size_t length  = offsetof(mwrs_sv_msg_event_open, response) + response->length + id_size;
+
+  mwrs_sv_msg_event_open * event = (mwrs_sv_msg_event_open *)message_alloc(length);
+  event->type                    = MWRS_MSG_SV_EVENT_OPEN;
+  event->length                  = (unsigned int)length;
+  event->watcher_id              = watcher_id;
+  event->event                   = type;
+  event->version                 = version;
+  event->resource_id_size        = (unsigned int)id_size;
+
+  std::memcpy(&event->response, response, response->length);
+  std::memcpy((char *)&event->response + response->length, id, id_size);
+
+  message_free(response);
+  return (mwrs_sv_message *)event;
+}
+// event_open_alloc
+
+
+
+OpenWaiter::~OpenWaiter() { stop(); }
+
+void OpenWaiter::stop()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop_flag = true;
+    waiting.clear();
+    waiting_count = 0;
+    ready.clear();
+    pushed.clear();
+  }
+  wake.notify_all();
+
+  if (thread.joinable())
+    thread.join();
+}
+
+uint64_t OpenWaiter::epoch()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return ready_epoch;
+}
+
+void OpenWaiter::park(mwrs_client_data * client, const char * id, mwrs_open_flags flags,
+                      int wait_ms, uint64_t epoch)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (stop_flag)
+    return;
+
+  clock::time_point deadline = wait_ms < 0 ? clock::time_point::max()
+                                           : clock::now() + std::chrono::milliseconds(wait_ms);
+  parked p{client, id, flags, deadline, 0, MWRS_EVENT_READY, 0};
+
+  if (epoch != ready_epoch)
+  {
+    ready.push_back(std::move(p));
+  }
+  else
+  {
+    waiting[p.id].push_back(std::move(p));
+    ++waiting_count;
+  }
+
+  start_locked();
+  wake.notify_one();
+}
+
+void OpenWaiter::push_event(mwrs_client_data * client, mwrs_watcher_id watcher_id,
+                            const char * id, mwrs_event_type type, uint64_t version,
+                            mwrs_open_flags flags, bool coalesce)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (stop_flag)
+    return;
+
+  if (coalesce)
+  {
+    // Only the last event of the watcher, merging past another type would reorder them
+    auto last = std::find_if(pushed.rbegin(), pushed.rend(), [&](const parked & p) {
+      return p.client == client && p.watcher_id == watcher_id;
+    });
+    if (last != pushed.rend() && last->type == type)
+    {
+      last->version = version;
+      return;
+    }
+  }
+
+  pushed.push_back(
+      parked{client, id, flags, clock::time_point::max(), watcher_id, type, version});
+
+  start_locked();
+  wake.notify_one();
+}
+
+void OpenWaiter::start_locked()
+{
+  if (!thread.joinable())
+  {
+    std::thread t([this]() { run(); });
+    thread.swap(t);
+  }
+}
+
+void OpenWaiter::on_ready(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  ++ready_epoch;
+
+  auto it = waiting.find(id);
+  if (it == waiting.end())
+    return;
+
+  waiting_count -= it->second.size();
+  ready.splice(ready.end(), it->second);
+  waiting.erase(it);
+
+  wake.notify_one();
+}
+
+void OpenWaiter::drop_client(mwrs_client_data * client)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  auto from_client = [client](const parked & p) { return p.client == client; };
+
+  for (auto it = waiting.begin(); it != waiting.end();)
+  {
+    std::size_t before = it->second.size();
+    it->second.remove_if(from_client);
+    waiting_count -= before - it->second.size();
+
+    it = it->second.empty() ? waiting.erase(it) : std::next(it);
+  }
+
+  ready.remove_if(from_client);
+  pushed.remove_if(from_client);
+
+  if (current == client)
+    current_dropped = true;
+
+  idle.wait(lock, [this, client]() { return current != client; });
+}
+
+mwrs_size OpenWaiter::size()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return waiting_count + ready.size();
+}
+
+void OpenWaiter::run()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stop_flag)
+  {
+    clock::time_point now  = clock::now();
+    clock::time_point next = clock::time_point::max();
+
+    // Expired opens are tried a last time, the response tells why it failed
+    for (auto it = waiting.begin(); it != waiting.end();)
+    {
+      std::list<parked> & queue = it->second;
+      for (auto p = queue.begin(); p != queue.end();)
+      {
+        if (p->deadline <= now)
+        {
+          auto expired = p++;
+          ready.splice(ready.end(), queue, expired);
+          --waiting_count;
+        }
+        else
+        {
+          next = std::min(next, p->deadline);
+          ++p;
+        }
+      }
+
+      it = queue.empty() ? waiting.erase(it) : std::next(it);
+    }
+
+    if (!pushed.empty())
+    {
+      parked p = std::move(pushed.front());
+      pushed.pop_front();
+
+      current = p.client;
+      lock.unlock();
+
+      mwrs_sv_message * event;
+      if (p.type == MWRS_EVENT_READY || p.type == MWRS_EVENT_UPDATE)
+        event = event_open_alloc(p.client, p.watcher_id, p.id.c_str(), p.type, p.version,
+                                 p.flags);
+      else
+        event = event_alloc(p.watcher_id, p.id.c_str(), p.type, p.version);
+      plat_client_queue_message(p.client, event);
+
+      lock.lock();
+      current         = nullptr;
+      current_dropped = false;
+      idle.notify_all();
+      continue;
+    }
+
+    if (!ready.empty())
+    {
+      parked p = std::move(ready.front());
+      ready.pop_front();
+
+      // Callbacks are invoked without the lock, they can push events
+      current = p.client;
+      lock.unlock();
+
+      mwrs_sv_message * response =
+          open_response(p.client, p.id.c_str(), p.flags, p.deadline <= clock::now());
+      if (response)
+        client_queue_response(p.client, response);
+
+      lock.lock();
+      bool dropped    = current_dropped;
+      current         = nullptr;
+      current_dropped = false;
+      idle.notify_all();
+
+      // Still not available
+      if (!response && !stop_flag && !dropped)
+      {
+        waiting[p.id].push_back(std::move(p));
+        ++waiting_count;
+      }
+      continue;
+    }
+
+    if (next == clock::time_point::max())
+      wake.wait(lock);
+    else
+      wake.wait_until(lock, next);
+  }
+}
+// OpenWaiter
+
+
+// Watch `id`, then queue the response and the events missed since version `since`
+// Events are journaled under the lock of the shard, held until the replay is queued,
+// so none of them is lost or sent twice
+void server_watch_since(mwrs_server_data * server, mwrs_client_data * client, const char * id,
+                        uint64_t since)
+{
+  mwrs_sv_msg_common_response * common_response =
+      (mwrs_sv_msg_common_response *)message_alloc(sizeof(mwrs_sv_msg_common_response));
+  common_response->type   = MWRS_MSG_SV_COMMON_RESPONSE;
+  common_response->length = sizeof(mwrs_sv_msg_common_response);
+
+  std::unique_lock<std::mutex> lock;
+  common_response->status = server_add_watcher(server, client, id, &common_response->watcher_id,
+                                               watch_exact, (mwrs_open_flags)0, &lock);
+
+  // The response is freed once sent
+  mwrs_ret status            = common_response->status;
+  mwrs_watcher_id watcher_id = common_response->watcher_id;
+  client_queue_response(client, (mwrs_sv_message *)common_response);
+
+  if (status != MWRS_SUCCESS)
+    return;
+
+  bool complete = server->journal->replay(id, since, [&](uint64_t seq, mwrs_event_type type) {
+    plat_client_queue_message(client, event_alloc(watcher_id, id, type, seq));
+  });
+
+  if (!complete)
+    plat_client_queue_message(
+        client, event_alloc(watcher_id, id, MWRS_EVENT_RESYNC, server->journal->version(id)));
+}
+// server_watch_since
+
+// v1 clients send their requests in the v1 layout, they never send the flags added by v2
+// They cannot receive events, so their watches are answered without a watcher as v1 servers did
+void client_on_receive_v1_message(mwrs_client_data * client, const mwrs_cl_message * message)
+{
+  mwrs_sv_msg_common_response * common_response =
+      (mwrs_sv_msg_common_response *)message_alloc(sizeof(mwrs_sv_msg_common_response));
+  common_response->type   = MWRS_MSG_SV_COMMON_RESPONSE;
+  common_response->length = sizeof(mwrs_sv_msg_common_response);
+
+  switch (message->type)
+  {
+  case MWRS_MSG_CL_OPEN:
+  case MWRS_MSG_CL_WATCH:
+  case MWRS_MSG_CL_OPEN_WATCH:
+  case MWRS_MSG_CL_STAT:
+  case MWRS_MSG_CL_STAT_WATCH:
+  {
+    const mwrs_cl_msg_resource_request_v1 * resource_request =
+        (const mwrs_cl_msg_resource_request_v1 *)message;
+    const char * id = &resource_request->resource_id;
+
+    // The id must be null-terminated
+    if (message->length < sizeof(mwrs_cl_msg_resource_request_v1) ||
+        ((const char *)message)[message->length - 1] != '\0')
+    {
+      common_response->status = MWRS_E_ARGS;
+      break;
+    }
+
+    mwrs_open_flags flags =
+        (mwrs_open_flags)(resource_request->flags & ~mwrs_protocol::v2OpenFlags);
+
+    if (message->type == MWRS_MSG_CL_OPEN || message->type == MWRS_MSG_CL_OPEN_WATCH)
+      common_response->status = client_open(client, id, flags, common_response);
+    else if (message->type == MWRS_MSG_CL_STAT || message->type == MWRS_MSG_CL_STAT_WATCH)
+      common_response->status = client_stat(client, id, &common_response->stat);
+    break;
+  }
+  case MWRS_MSG_CL_WATCHER_OPEN:
+  case MWRS_MSG_CL_CLOSE_WATCHER:
+    // v1 clients never get a watcher
+    common_response->status = MWRS_E_ARGS;
+    break;
+
+  default:
+    // Added by v2
+    common_response->status = MWRS_E_NOTSUPPORTED;
+  }
+
+  client_queue_response(client, (mwrs_sv_message *)common_response);
+}
+// client_on_receive_v1_message
+
+void client_on_receive_message(mwrs_client_data * client, const mwrs_cl_message * message)
+{
+  if (client->protocol == mwrs_protocol::v1)
+  {
+    client_on_receive_v1_message(client, message);
+    return;
+  }
+
+  mwrs_sv_message * response = nullptr;
+
+  // Sent after the response
+  mwrs_sv_message * ready_event = nullptr;
+
+  switch (message->type)
+  {
+  case MWRS_MSG_CL_WATCH_SINCE:
+  {
+    mwrs_cl_msg_resource_request * resource_request = (mwrs_cl_msg_resource_request *)message;
+    server_watch_since(client->server, client, &resource_request->resource_id,
+                       resource_request->since);
+    return;
+  }
+  case MWRS_MSG_CL_OPEN:
+  case MWRS_MSG_CL_WATCH:
+  case MWRS_MSG_CL_OPEN_WATCH:
+  case MWRS_MSG_CL_STAT:
+  case MWRS_MSG_CL_STAT_WATCH:
+  case MWRS_MSG_CL_WATCH_PREFIX:
+  case MWRS_MSG_CL_WATCH_GLOB:
+  {
+    mwrs_cl_msg_resource_request * resource_request = (mwrs_cl_msg_resource_request *)message;
+    const char * id = &resource_request->resource_id;
+
+    std::string inline_data;
+
+    mwrs_sv_msg_common_response * common_response =
+        (mwrs_sv_msg_common_response *)message_alloc(sizeof(mwrs_sv_msg_common_response));
+    common_response->type = MWRS_MSG_SV_COMMON_RESPONSE;
+    common_response->length = sizeof(mwrs_sv_msg_common_response);
+    response                = (mwrs_sv_message *)common_response;
+    // Watch first
+    switch (message->type)
+    {
+    case MWRS_MSG_CL_WATCH:
+    case MWRS_MSG_CL_STAT_WATCH:
+      common_response->status =
+          server_add_watcher(client->server, client, id, &common_response->watcher_id);
+      break;
+    case MWRS_MSG_CL_OPEN_WATCH:
+    {
+      mwrs_open_flags push_flags = (mwrs_open_flags)0;
+      if (resource_request->flags & MWRS_OPEN_PUSH)
+        push_flags = (mwrs_open_flags)(resource_request->flags & ~MWRS_OPEN_WAIT);
+
+      common_response->status = server_add_watcher(
+          client->server, client, id, &common_response->watcher_id, watch_exact, push_flags);
+      break;
+    }
+    case MWRS_MSG_CL_WATCH_PREFIX:
+      common_response->status = server_add_watcher(client->server, client, id,
+                                                    &common_response->watcher_id, watch_prefix);
+      break;
+    case MWRS_MSG_CL_WATCH_GLOB:
+      common_response->status = server_add_watcher(client->server, client, id,
+                                                    &common_response->watcher_id, watch_glob);
+      break;
+    default: break;
+    }
+    // Open
+    switch (message->type)
+    {
+    case MWRS_MSG_CL_OPEN:
+    {
+      uint64_t epoch = client->server->waiter->epoch();
+      common_response->status =
+          client_open(client, id, resource_request->flags, common_response, &inline_data);
+
+      if ((resource_request->flags & MWRS_OPEN_WAIT) && resource_request->wait_ms != 0 &&
+          open_must_wait(common_response->status))
+      {
+        // Answered by the waiter
+        message_free(common_response);
+        client->server->waiter->park(client, id, resource_request->flags,
+                                     resource_request->wait_ms, epoch);
+        return;
+      }
+      break;
+    }
+    case MWRS_MSG_CL_OPEN_WATCH:
+      // A rejected watch is reported as is
+      if (common_response->status == MWRS_SUCCESS)
+        common_response->status =
+            client_open(client, id, resource_request->flags, common_response, &inline_data);
+      break;
+    default: break;
+    }
+    // Stat
+    switch (message->type)
+    {
+    case MWRS_MSG_CL_STAT:
+      common_response->status = client_stat(client, id, &common_response->stat);
+      break;
+    case MWRS_MSG_CL_STAT_WATCH:
+      if (common_response->status == MWRS_SUCCESS)
+        common_response->status = client_stat(client, id, &common_response->stat);
+      break;
+    default: break;
+    }
+    // Initial READY event for new watchers, unless the resource has been opened
+    if (common_response->watcher_id != 0 && (message->type == MWRS_MSG_CL_WATCH ||
+                                             (message->type == MWRS_MSG_CL_OPEN_WATCH &&
+                                              common_response->status != MWRS_SUCCESS)))
+    {
+      mwrs_status res_stat{};
+      if (client_stat(client, id, &res_stat) == MWRS_SUCCESS &&
+          res_stat.state == MWRS_STATE_READY)
+        ready_event = event_alloc(common_response->watcher_id, id, MWRS_EVENT_READY,
+                                  client->server->journal->version(id));
+    }
+
+    if (common_response->status == MWRS_SUCCESS &&
+        (common_response->open_flags & MWRS_OPEN_INLINE))
+      response = (mwrs_sv_message *)response_attach_inline(common_response, inline_data);
+    break;
+  }
+  case MWRS_MSG_CL_WATCHER_OPEN:
+  case MWRS_MSG_CL_CLOSE_WATCHER:
+  {
+    mwrs_cl_msg_watcher_request * watcher_request = (mwrs_cl_msg_watcher_request *)message;
+
+    mwrs_sv_msg_common_response * common_response =
+        (mwrs_sv_msg_common_response *)message_alloc(sizeof(mwrs_sv_msg_common_response));
+    common_response->type   = MWRS_MSG_SV_COMMON_RESPONSE;
+    common_response->length = sizeof(mwrs_sv_msg_common_response);
+    response                = (mwrs_sv_message *)common_response;
+
+    if (message->type == MWRS_MSG_CL_WATCHER_OPEN)
+    {
+      std::string id;
+      std::string inline_data;
+      if (server_get_watched_id(client->server, client, watcher_request->watcher_id, &id))
+        common_response->status = client_open(client, id.c_str(), watcher_request->flags,
+                                              common_response, &inline_data);
+      else
+        common_response->status = MWRS_E_ARGS;
+
+      if (common_response->status == MWRS_SUCCESS &&
+          (common_response->open_flags & MWRS_OPEN_INLINE))
+        response = (mwrs_sv_message *)response_attach_inline(common_response, inline_data);
+    }
+    else
+    {
+      common_response->status =
+          server_remove_watcher(client->server, client, watcher_request->watcher_id);
+    }
+    break;
+  }
+
+  default:
+    // TODO error
+    assert(0 && "Invalid message type");
+  }
+
+  if (response)
+    client_queue_response(client, response);
+  else
+    assert(0 && "No response to client message");
+
+  if (ready_event)
+    plat_client_queue_message(client, ready_event);
+}
+// client_on_receive_message
+
+
+//
+
+
+// Platform-specific implementation
+
+#ifdef _WIN32
+
+mwrs_win_handle_data to_mwrs_handle(HANDLE win_handle)
+{
+  static_assert(sizeof(mwrs_win_handle_data) == 4, "mwrs_win_handle_data must be 4 bytes");
+  return reinterpret_cast<mwrs_win_handle_data>(win_handle);
+}
+
+// Arena generation of the content sent in `message`, 0 if there is none
+uint32_t message_arena_generation(const mwrs_sv_message * message)
+{
+  switch (message->type)
+  {
+  case MWRS_MSG_SV_COMMON_RESPONSE:
+    return ((const mwrs_sv_msg_common_response *)message)->arena_generation;
+  case MWRS_MSG_SV_EVENT_OPEN:
+    return ((const mwrs_sv_msg_event_open *)message)->response.arena_generation;
+  case MWRS_MSG_SV_COMPACT_RESPONSE:
+  {
+    mwrs_response_content content;
+    if (mwrs_protocol::compact_content((const mwrs_sv_msg_compact_response *)message, &content))
+      return content.arena_generation;
+    return 0;
+  }
+  default: return 0;
+  }
+}
+
+mwrs_client_plat::~mwrs_client_plat()
+{
+  if (!arena)
+    return;
+
+  for (uint32_t generation : arena_read)
+    arena->release(generation);
+  for (uint32_t generation : arena_unread)
+    arena->release(generation);
+}
+
+// The client sent a request, it read every response queued before
+void client_release_read_arena(mwrs_client_data * client)
+{
+  mwrs_client_plat & plat = client->plat;
+  if (!plat.arena)
+    return;
+
+  std::unique_lock<std::mutex> lock(plat.arena_mutex);
+
+  for (uint32_t generation : plat.arena_read)
+    plat.arena->release(generation);
+  plat.arena_read.clear();
+}
+
+WinClientThread::ClientHandle::ClientHandle(WinClientThread * parent, HANDLE pipe)
+    : parent(parent), pipe(pipe)
 {
 }
 
@@ -400,17 +2036,12 @@ WinClientThread::ClientHandle::~ClientHandle()
   CloseHandle(pipe);
 
   // Clear messages
+  drain_inbox();
   while (!write_queue.empty())
   {
     message_free(write_queue.front());
     write_queue.pop_front();
   }
-
-  if (read_message)
-  {
-    message_free(read_message);
-    read_message = nullptr;
-  }
 }
 
 
@@ -424,14 +2055,67 @@ void WinClientThread::ClientHandle::close()
 }
 
 
-void WinClientThread::ClientHandle::queue_message(mwrs_sv_message * message)
+void WinClientThread::ClientHandle::queue_message(mwrs_sv_message * message)
+{
+  bool first = pending.fetch_add(1) == 0;
+
+  if (overflowing || !inbox.try_push(message))
+  {
+    std::unique_lock<std::mutex> lock(overflow_mutex);
+    overflowing = true;
+    overflow.push_back(message);
+  }
+
+  if (first)
+    SetEvent(parent->wake_event);
+}
+
+
+void WinClientThread::ClientHandle::drain_inbox()
 {
+  for (;;)
   {
-    std::unique_lock<std::mutex> lock(mutex);
-    write_queue.push_back(message);
+    int drained = 0;
+
+    mwrs_sv_message * message;
+    while (inbox.try_pop(&message))
+    {
+      write_queue.push_back(message);
+      ++drained;
+    }
+
+    if (overflowing)
+    {
+      std::unique_lock<std::mutex> lock(overflow_mutex);
+
+      // Pushed to the ring before it overflowed
+      while (inbox.try_pop(&message))
+      {
+        write_queue.push_back(message);
+        ++drained;
+      }
+
+      for (mwrs_sv_message * m : overflow)
+        write_queue.push_back(m);
+      drained += (int)overflow.size();
+
+      overflow.clear();
+      overflowing = false;
+    }
+
+    // Messages counted after the pops did not wake the thread, it would sleep with them
+    if (pending.fetch_sub(drained) - drained <= 0)
+      return;
+
+    // Counted but not published yet, the pops stopped before them
+    if (drained == 0)
+    {
+      SetEvent(parent->wake_event);
+      return;
+    }
   }
-  SetEvent(parent->wake_event);
 }
+// Client drain_inbox
 
 
 void WinClientThread::ClientHandle::tick()
@@ -450,21 +2134,10 @@ void WinClientThread::ClientHandle::tick()
 
       DWORD read_len;
 
-      if (!read_message)
-      {
-        // Read message head
-        ZeroMemory(&read_message_head, sizeof(read_message_head));
-        if (ReadFile(pipe, &read_message_head, sizeof(read_message_head), &read_len,
-                     &read_overlapped) == 0)
-          err = GetLastError();
-      }
-      else
-      {
-        // Read message body
-        if (ReadFile(pipe, (void*)((char*)read_message + read_offset), read_message_head.length - read_offset,
-                     &read_len, &read_overlapped) == 0)
-          err = GetLastError();
-      }
+      std::size_t size;
+      char * buffer = reader.prepare(&size);
+      if (ReadFile(pipe, buffer, (DWORD)size, &read_len, &read_overlapped) == 0)
+        err = GetLastError();
 
       if (err == ERROR_IO_PENDING)
       {
@@ -474,6 +2147,8 @@ void WinClientThread::ClientHandle::tick()
       {
         on_read(read_len);
         ResetEvent(read_event);
+        if (disconnected)
+          break;
         continue;
       }
       else if (err == ERROR_BROKEN_PIPE)
@@ -488,17 +2163,26 @@ void WinClientThread::ClientHandle::tick()
       }
     }
 
-    if (!writing && !write_queue.empty())
+    bool send = false;
+    if (!writing)
+    {
+      // Other threads may be queuing messages
+      drain_inbox();
+      send = !write_queue.empty();
+    }
+
+    if (send)
     {
+      const void * data;
+      DWORD length = gather_writes(&data);
+
       ZeroMemory(&write_overlapped, sizeof(write_overlapped));
       write_overlapped.hEvent = write_event;
 
-      mwrs_sv_message * send_message = write_queue.front();
-
       DWORD err = ERROR_SUCCESS;
 
       DWORD write_len;
-      if (WriteFile(pipe, send_message, send_message->length, &write_len, &write_overlapped) == 0)
+      if (WriteFile(pipe, data, length, &write_len, &write_overlapped) == 0)
         err = GetLastError();
 
       if (err == ERROR_IO_PENDING)
@@ -507,12 +2191,7 @@ void WinClientThread::ClientHandle::tick()
       }
       else if (err == ERROR_SUCCESS)
       {
-        {
-          // Pop sent message
-          std::unique_lock<std::mutex> lock(mutex);
-          write_queue.pop_front();
-        }
-        message_free(send_message);
+        pop_written();
         ResetEvent(write_event);
         continue;
       }
@@ -534,6 +2213,57 @@ void WinClientThread::ClientHandle::tick()
 // Client tick
 
 
+DWORD WinClientThread::ClientHandle::gather_writes(const void ** data_out)
+{
+  // Messages are written back to back, the client splits them with their length
+  std::size_t length = 0;
+  write_count        = 0;
+  while (write_count < write_queue.size() &&
+         (write_count == 0 || length + write_queue.at(write_count)->length <= writeBudget))
+  {
+    mwrs_sv_message * message = write_queue.at(write_count);
+    if (client)
+    {
+      message = client_on_message_sending(client, message);
+      write_queue.replace(write_count, message);
+    }
+
+    length += message->length;
+    ++write_count;
+  }
+
+  if (write_count == 1)
+  {
+    *data_out = write_queue.front();
+    return (DWORD)length;
+  }
+
+  write_buffer.resize(length);
+
+  char * out = write_buffer.data();
+  for (std::size_t i = 0; i < write_count; ++i)
+  {
+    mwrs_sv_message * message = write_queue.at(i);
+    std::memcpy(out, message, message->length);
+    out += message->length;
+  }
+
+  *data_out = write_buffer.data();
+  return (DWORD)length;
+}
+// Client gather_writes
+
+
+void WinClientThread::ClientHandle::pop_written()
+{
+  for (; write_count > 0; --write_count)
+  {
+    message_free(write_queue.front());
+    write_queue.pop_front();
+  }
+}
+
+
 void WinClientThread::ClientHandle::read_completed()
 {
   DWORD read_len, err = ERROR_SUCCESS;
@@ -578,13 +2308,7 @@ void WinClientThread::ClientHandle::write_completed()
     assert(0 && "Async write error");
   }
 
-  mwrs_sv_message * message = write_queue.front();
-  {
-    // Pop sent message
-    std::unique_lock<std::mutex> lock(mutex);
-    write_queue.pop_front();
-  }
-  message_free(message);
+  pop_written();
 
   writing = false;
   ResetEvent(write_event);
@@ -594,51 +2318,48 @@ void WinClientThread::ClientHandle::write_completed()
 
 void WinClientThread::ClientHandle::on_read(mwrs_size readlen)
 {
-  if (!read_message)
-  {
-    // Message head
-    if (readlen != sizeof(mwrs_cl_message))
-    {
-      // TODO receive error
-      assert(0 && "Receive error");
-    }
+  reader.commit(readlen);
 
-    read_message = (mwrs_cl_message *)message_alloc(read_message_head.length);
-    std::memcpy(read_message, &read_message_head, sizeof(read_message));
-    read_offset = sizeof(read_message);
-    return;
-  }
+  while (mwrs_cl_message * message = reader.next())
+    on_message(message);
 
-  // Message body
-  read_offset += readlen;
-  if (read_offset < read_message_head.length)
-  {
-    // Read is not complete
-    return;
-  }
+  // Nothing more can be decoded, the client must not keep the thread reading
+  if (reader.corrupt())
+    disconnected = true;
+}
+// Client on_read
 
-  // Message is complete
-  assert(read_offset == read_message_head.length);
 
-  switch (read_message->type)
+void WinClientThread::ClientHandle::on_message(mwrs_cl_message * message)
+{
+  switch (message->type)
   {
   case MWRS_MSG_CL_WIN_HANDSHAKE:
     if (!client)
     {
-      mwrs_cl_win_handshake * win_handshake = (mwrs_cl_win_handshake *)read_message;
-      mwrs_sv_win_handshake_ack * handshake_ack =
-          (mwrs_sv_win_handshake_ack *)message_alloc(sizeof(mwrs_sv_win_handshake_ack));
-      handshake_ack->type = MWRS_MSG_SV_WIN_HANDSHAKE_ACK;
-      handshake_ack->length = sizeof(mwrs_sv_win_handshake_ack);
+      // v1 has `mwrs_version` where v2 has `protocol`
+      mwrs_cl_win_handshake * win_handshake       = (mwrs_cl_win_handshake *)message;
+      mwrs_cl_win_handshake_v2 * win_handshake_v2 = (mwrs_cl_win_handshake_v2 *)message;
+      uint32_t protocol                           = win_handshake_v2->protocol;
+
+      // Clients that do not know v2 get a v1 answer
+      std::size_t ack_length = protocol == mwrs_protocol::v2 ? sizeof(mwrs_sv_win_handshake_ack_v2)
+                                                             : sizeof(mwrs_sv_win_handshake_ack);
+
+      mwrs_sv_win_handshake_ack_v2 * handshake_ack =
+          (mwrs_sv_win_handshake_ack_v2 *)message_alloc(ack_length);
+      handshake_ack->type   = MWRS_MSG_SV_WIN_HANDSHAKE_ACK;
+      handshake_ack->length = (uint32_t)ack_length;
 
-      if (win_handshake->mwrs_version != MWRS_VERSION)
+      if (protocol != mwrs_protocol::v1 && protocol != mwrs_protocol::v2)
       {
         handshake_ack->status = MWRS_E_NOTSUPPORTED;
       }
       else
       {
-        DWORD process_id = win_handshake->process_id;
-        process          = OpenProcess(PROCESS_DUP_HANDLE, FALSE, process_id);
+        DWORD process_id = protocol == mwrs_protocol::v2 ? win_handshake_v2->process_id
+                                                         : win_handshake->process_id;
+        process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, process_id);
 
         // Documentation says NULL
         if (process == INVALID_HANDLE_VALUE || process == NULL)
@@ -650,6 +2371,11 @@ void WinClientThread::ClientHandle::on_read(mwrs_size readlen)
         std::array<const char *, 128> argv_ptr{}; // TODO hardcoded
         int argc    = win_handshake->argc;
         char * argv = &win_handshake->argv;
+        if (protocol == mwrs_protocol::v2)
+        {
+          argc = (int)win_handshake_v2->argc;
+          argv = &win_handshake_v2->argv;
+        }
 
         if (argc > argv_ptr.size())
         {
@@ -668,6 +2394,16 @@ void WinClientThread::ClientHandle::on_read(mwrs_size readlen)
         if (ret == MWRS_SUCCESS)
         {
           client->plat.handle = this;
+
+          // v1 clients cannot ask for inline contents, they never get arena segments
+          if (protocol == mwrs_protocol::v2)
+          {
+            client->protocol        = mwrs_protocol::v2;
+            client->caps            = win_handshake_v2->caps & mwrs_protocol::supportedCaps;
+            client->plat.arena      = parent->server->plat.arena.get();
+            handshake_ack->protocol = mwrs_protocol::v2;
+            handshake_ack->caps     = client->caps;
+          }
         }
         else
         {
@@ -690,7 +2426,8 @@ void WinClientThread::ClientHandle::on_read(mwrs_size readlen)
   default:
     if (client)
     {
-      client_on_receive_message(client, read_message);
+      client_release_read_arena(client);
+      client_on_receive_message(client, message);
     }
     else
     {
@@ -698,11 +2435,8 @@ void WinClientThread::ClientHandle::on_read(mwrs_size readlen)
       assert(0 && "Must perform handshake first");
     }
   } // switch message type
-
-  message_free(read_message);
-  read_message = nullptr;
 }
-// Client on_read
+// Client on_message
 
 
 WinClientThread::WinClientThread(mwrs_server_data * server) : server(server)
@@ -966,10 +2700,111 @@ void WinAcceptThread::run()
 // WinAcceptThread run
 
 
-mwrs_ret fill_win_handle_from_res_open(const mwrs_client_data * client,
+// Returns false if the file is larger than `max_size` or its size is unknown
+bool read_inline(HANDLE handle, mwrs_size max_size, std::string * data_out)
+{
+  LARGE_INTEGER size{};
+  if (!GetFileSizeEx(handle, &size) || size.QuadPart > max_size)
+    return false;
+
+  LARGE_INTEGER zero{};
+  if (!SetFilePointerEx(handle, zero, NULL, FILE_BEGIN))
+    return false;
+
+  data_out->resize((std::size_t)size.QuadPart);
+
+  std::size_t offset = 0;
+  while (offset < data_out->size())
+  {
+    DWORD read = 0;
+    if (!ReadFile(handle, &(*data_out)[offset], (DWORD)(data_out->size() - offset), &read, NULL))
+      return false;
+    if (read == 0)
+      break; // Truncated meanwhile
+    offset += read;
+  }
+
+  data_out->resize(offset);
+  return true;
+}
+// read_inline
+
+uint64_t to_uint64(DWORD high, DWORD low) { return (uint64_t)high << 32 | low; }
+
+// Identity and version of the source, false if they cannot be known
+bool source_stamp_of(const mwrs_sv_res_open * res_open,
+                     mwrs_sv::ContentArena::source_stamp * stamp_out)
+{
+  switch (res_open->type)
+  {
+  case MWRS_SV_PATH:
+  case MWRS_SV_PACKED_PATH:
+  {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(res_open->path, GetFileExInfoStandard, &data))
+      return false;
+
+    stamp_out->source = res_open->type == MWRS_SV_PATH ? "f:" : "p:";
+    stamp_out->source += res_open->path;
+    stamp_out->size = to_uint64(data.nFileSizeHigh, data.nFileSizeLow);
+    stamp_out->mtime =
+        to_uint64(data.ftLastWriteTime.dwHighDateTime, data.ftLastWriteTime.dwLowDateTime);
+    return true;
+  }
+  case MWRS_SV_FD:
+  case MWRS_SV_WIN_HANDLE:
+  {
+    HANDLE handle = res_open->type == MWRS_SV_FD
+                        ? reinterpret_cast<HANDLE>(_get_osfhandle(res_open->fd))
+                        : res_open->win_handle;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(handle, &info))
+      return false;
+
+    char source[64];
+    std::snprintf(source, sizeof(source), "h:%lx:%lx:%lx", info.dwVolumeSerialNumber,
+                  info.nFileIndexHigh, info.nFileIndexLow);
+    stamp_out->source = source;
+    stamp_out->size   = to_uint64(info.nFileSizeHigh, info.nFileSizeLow);
+    stamp_out->mtime =
+        to_uint64(info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime);
+    return true;
+  }
+  default: return false;
+  }
+}
+// source_stamp_of
+
+mwrs_ret fill_win_handle_from_res_open(const mwrs_client_data * client, const char * id,
                                        const mwrs_sv_res_open * res_open,
-                                       mwrs_sv_msg_common_response * response_out)
+                                       mwrs_sv_msg_common_response * response_out,
+                                       std::string * inline_out)
 {
+  mwrs_sv::ContentArena * arena = client->server->plat.arena.get();
+
+  bool inline_wanted = inline_out && (response_out->open_flags & MWRS_OPEN_INLINE);
+
+  // Taken before reading, a change meanwhile is seen by the next open
+  mwrs_sv::ContentArena::source_stamp stamp;
+  if (!inline_wanted || !source_stamp_of(res_open, &stamp))
+    arena = nullptr;
+
+  // Hot resource, the file is not even read
+  mwrs_sv::ContentArena::location location;
+  if (arena && arena->find(id, stamp, &location))
+  {
+    if (res_open->type == MWRS_SV_FD)
+      _close(res_open->fd);
+    else if (res_open->type == MWRS_SV_WIN_HANDLE)
+      CloseHandle(res_open->win_handle);
+
+    response_out->arena_generation = location.generation;
+    response_out->arena_offset     = location.offset;
+    response_out->inline_size      = location.size;
+    return MWRS_SUCCESS;
+  }
+
   HANDLE handle = INVALID_HANDLE_VALUE;
 
   switch (res_open->type)
@@ -985,6 +2820,16 @@ mwrs_ret fill_win_handle_from_res_open(const mwrs_client_data * client,
     break;
   case MWRS_SV_FD: handle = reinterpret_cast<HANDLE>(_get_osfhandle(res_open->fd)); break;
   case MWRS_SV_WIN_HANDLE: handle = res_open->win_handle; break;
+  case MWRS_SV_PACKED_PATH:
+  {
+    if (response_out->open_flags & (MWRS_OPEN_WRITE | MWRS_OPEN_APPEND))
+      return MWRS_E_PERM;
+
+    mwrs_ret ret = client->server->plat.pack_cache->open(res_open->path, &handle);
+    if (ret != MWRS_SUCCESS)
+      return ret;
+    break;
+  }
 
   default: return MWRS_E_SERVERIMPL;
   }
@@ -992,16 +2837,40 @@ mwrs_ret fill_win_handle_from_res_open(const mwrs_client_data * client,
   if (handle == INVALID_HANDLE_VALUE)
     return MWRS_E_SERVERIMPL;
 
+  auto close_source = [res_open, handle]() {
+    if (res_open->type == MWRS_SV_FD)
+      _close(res_open->fd);
+    else
+      CloseHandle(handle);
+  };
+
+  if (inline_wanted)
+  {
+    if (read_inline(handle, client->server->options.inline_max_size, inline_out))
+    {
+      close_source();
+
+      if (arena && arena->record_access(id) && arena->add(id, stamp, *inline_out, &location))
+      {
+        inline_out->clear();
+        response_out->arena_generation = location.generation;
+        response_out->arena_offset     = location.offset;
+        response_out->inline_size      = location.size;
+      }
+      return MWRS_SUCCESS;
+    }
+
+    inline_out->clear();
+    response_out->open_flags = (mwrs_open_flags)(response_out->open_flags & ~MWRS_OPEN_INLINE);
+  }
+
   HANDLE duplicate = INVALID_HANDLE_VALUE;
 
   // DUPLICATE_CLOSE_SOURCE is not enough for FDs
   BOOL ok = DuplicateHandle(GetCurrentProcess(), handle, client->plat.handle->process, &duplicate,
                             0, TRUE, DUPLICATE_SAME_ACCESS);
 
-  if (res_open->type == MWRS_SV_FD)
-    _close(res_open->fd);
-  else
-    CloseHandle(handle);
+  close_source();
 
   if (!ok)
   {
@@ -1020,6 +2889,16 @@ mwrs_ret plat_server_start(mwrs_server_data * server)
 {
   try
   {
+    server->plat.pack_cache.reset(new mwrs_sv::PackCache(server->options.cache_size));
+    if (server->options.status_table_size > 0)
+      server->plat.status_table.reset(
+          new mwrs_sv::StatusTable(server->name, server->options.status_table_size));
+    if (server->options.arena_size > 0 && server->options.inline_max_size > 0)
+      server->plat.arena.reset(new mwrs_sv::ContentArena(
+          server->name, server->options.arena_size, server->options.arena_hot_threshold));
+    server->plat.monitor.reset(new mwrs_sv::ChangeMonitor(
+        server->options.monitor_root, server->options.monitor_max_watches,
+        [server](const char * id, mwrs_event_type type) { server_push_event(server, id, type); }));
     server->plat.thread.reset(new WinAcceptThread(server));
     return MWRS_SUCCESS;
   }
@@ -1034,18 +2913,107 @@ mwrs_ret plat_server_start(mwrs_server_data * server)
 void plat_server_stop(mwrs_server_data * server)
 {
   // TODO
+  // Clients left are disconnected here, their watchers still use the monitor
   server->plat.thread->interrupt();
   server->plat.thread.reset();
+
+  // No more events from the monitor thread
+  server->plat.monitor.reset();
+  server->plat.pack_cache.reset();
+  server->plat.status_table.reset();
+  server->plat.arena.reset();
 }
 // plat_server_stop
 
 
 void plat_client_queue_message(mwrs_client_data * client, mwrs_sv_message * message)
 {
-  client->plat.handle->queue_message(message);
+  mwrs_client_plat & plat = client->plat;
+  if (!plat.arena)
+  {
+    plat.handle->queue_message(message);
+    return;
+  }
+
+  uint32_t generation = message_arena_generation(message);
+  bool response       = message->type == MWRS_MSG_SV_COMMON_RESPONSE ||
+                  message->type == MWRS_MSG_SV_COMPACT_RESPONSE;
+
+  // Recorded in the order of the queue, the client reads in that order
+  std::unique_lock<std::mutex> lock(plat.arena_mutex);
+
+  if (generation != 0)
+    plat.arena_unread.push_back(generation);
+
+  if (response)
+  {
+    plat.arena_read.insert(plat.arena_read.end(), plat.arena_unread.begin(),
+                           plat.arena_unread.end());
+    plat.arena_unread.clear();
+  }
+
+  plat.handle->queue_message(message);
 }
 // plat_client_queue_message
 
+
+void plat_server_get_stats(mwrs_server_data * server, mwrs_sv_stats * stats_out)
+{
+  server->plat.pack_cache->get_stats(stats_out);
+  server->plat.monitor->get_stats(stats_out);
+  if (server->plat.arena)
+    server->plat.arena->get_stats(stats_out);
+}
+// plat_server_get_stats
+
+
+mwrs_ret plat_monitor_add(mwrs_server_data * server, const char * id, const char * path)
+{
+  if (!server->plat.monitor)
+    return MWRS_E_UNAVAIL;
+
+  return server->plat.monitor->add(id, path);
+}
+// plat_monitor_add
+
+
+void plat_monitor_remove(mwrs_server_data * server, const char * id)
+{
+  if (server->plat.monitor)
+    server->plat.monitor->remove(id);
+}
+// plat_monitor_remove
+
+
+mwrs_ret plat_publish_status(mwrs_server_data * server, const char * id,
+                             const mwrs_status * status)
+{
+  if (!server->plat.status_table)
+    return MWRS_E_UNAVAIL;
+
+  return server->plat.status_table->publish(id, status);
+}
+// plat_publish_status
+
+
+mwrs_ret plat_unpublish_status(mwrs_server_data * server, const char * id)
+{
+  if (!server->plat.status_table)
+    return MWRS_E_UNAVAIL;
+
+  server->plat.status_table->unpublish(id);
+  return MWRS_SUCCESS;
+}
+// plat_unpublish_status
+
+
+void plat_invalidate_content(mwrs_server_data * server, const char * id)
+{
+  if (server->plat.arena)
+    server->plat.arena->invalidate(id);
+}
+// plat_invalidate_content
+
 #endif // _WIN32
 
 
@@ -1059,6 +3027,12 @@ std::unique_ptr<mwrs_server_data> instance;
 // API implementation
 
 mwrs_ret mwrs_sv_init(const char * server_name, mwrs_sv_callbacks * callbacks)
+{
+  return mwrs_sv_init_ex(server_name, callbacks, nullptr);
+}
+
+mwrs_ret mwrs_sv_init_ex(const char * server_name, mwrs_sv_callbacks * callbacks,
+                         const mwrs_sv_options * options)
 {
   if (::instance)
     return MWRS_E_ALREADY;
@@ -1073,6 +3047,17 @@ mwrs_ret mwrs_sv_init(const char * server_name, mwrs_sv_callbacks * callbacks)
   std::strncpy(::instance->name, server_name, MWRS_SERVER_NAME_MAX - 1);
   ::instance->callbacks = *callbacks;
 
+  ::instance->options = options ? *options : mwrs_sv_options{};
+  if (::instance->options.cache_size <= 0)
+    ::instance->options.cache_size = defaultCacheSize;
+  if (::instance->options.inline_max_size == 0)
+    ::instance->options.inline_max_size = defaultInlineMaxSize;
+
+  ::instance->debouncer.reset(new EventDebouncer(::instance.get()));
+  ::instance->waiter.reset(new OpenWaiter);
+  ::instance->misses.reset(new mwrs_sv::MissCache(::instance->options.miss_cache_size));
+  ::instance->journal.reset(new mwrs_sv::EventJournal(::instance->options.journal_size));
+
   mwrs_ret ret = plat_server_start(::instance.get());
 
   if (ret != MWRS_SUCCESS)
@@ -1086,6 +3071,10 @@ mwrs_ret mwrs_sv_shutdown()
   if (!::instance)
     return MWRS_E_UNAVAIL;
 
+  // Held events and opens are dropped
+  ::instance->debouncer->stop();
+  ::instance->waiter->stop();
+
   plat_server_stop(::instance.get());
   ::instance.reset();
 
@@ -1100,5 +3089,121 @@ mwrs_ret mwrs_sv_push_event(const char * id, mwrs_event_type type)
   if (!id)
     return MWRS_E_ARGS;
 
-  return server_on_event(::instance.get(), id, type);
+  return server_push_event(::instance.get(), id, type);
+}
+
+mwrs_ret mwrs_sv_push_update_ranges(const char * id, const mwrs_range * ranges, size_t count)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!id || (count > 0 && !ranges))
+    return MWRS_E_ARGS;
+
+  range_list list;
+  list.reserve(count);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (ranges[i].offset < 0 || ranges[i].size < 0)
+      return MWRS_E_ARGS;
+
+    if (ranges[i].size > 0)
+      list.push_back(ranges[i]);
+  }
+
+  // Nothing changed
+  if (count > 0 && list.empty())
+    return MWRS_SUCCESS;
+
+  merge_ranges(list);
+  return server_push_event(::instance.get(), id, MWRS_EVENT_UPDATE, &list);
+}
+
+mwrs_ret mwrs_sv_set_debounce(const char * id, int window_ms, int max_latency_ms)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!id)
+    return MWRS_E_ARGS;
+
+  ::instance->debouncer->set_debounce(id, window_ms, max_latency_ms);
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret mwrs_sv_publish_status(const char * id, const mwrs_status * status)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!id || !status)
+    return MWRS_E_ARGS;
+
+  mwrs_status versioned = *status;
+  versioned.version     = (long long)::instance->journal->version(id);
+
+  if (status->state == MWRS_STATE_READY)
+  {
+    ::instance->misses->on_ready(id);
+    ::instance->waiter->on_ready(id);
+  }
+
+  return plat_publish_status(::instance.get(), id, &versioned);
+}
+
+mwrs_ret mwrs_sv_unpublish_status(const char * id)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!id)
+    return MWRS_E_ARGS;
+
+  return plat_unpublish_status(::instance.get(), id);
+}
+
+mwrs_ret mwrs_sv_set_known_ids(const char * const * ids, size_t count)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (count > 0 && !ids)
+    return MWRS_E_ARGS;
+
+  for (size_t i = 0; i < count; ++i)
+    if (!ids[i])
+      return MWRS_E_ARGS;
+
+  ::instance->misses->set_known(ids, count);
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret mwrs_sv_get_stats(mwrs_sv_stats * stats_out)
+{
+  if (!::instance)
+    return MWRS_E_UNAVAIL;
+
+  if (!stats_out)
+    return MWRS_E_ARGS;
+
+  *stats_out = mwrs_sv_stats{};
+  ::instance->misses->get_stats(stats_out);
+  stats_out->waiting_opens = ::instance->waiter->size();
+  ::instance->journal->get_stats(stats_out);
+  mwrs_sv::pool::get_stats(stats_out);
+  plat_server_get_stats(::instance.get(), stats_out);
+  return MWRS_SUCCESS;
+}
+
+mwrs_ret mwrs_sv_pack_file(const char * src_path, const char * dst_path)
+{
+  if (!src_path || !dst_path)
+    return MWRS_E_ARGS;
+
+#ifdef _WIN32
+  return mwrs_sv::pack_file(src_path, dst_path);
+#else
+  return MWRS_E_NOTSUPPORTED;
+#endif
 }
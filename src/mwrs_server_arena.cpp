@@ -0,0 +1,311 @@
+/**
+ * @file    mwrs_server_arena.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_arena.hpp"
+
+
+#include <cstring>
+#include <stdexcept>
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+namespace
+{
+
+// Access counts are reset after this many inline opens
+const unsigned accessWindow = 1 << 16;
+
+const int defaultHotThreshold = 8;
+
+uint64_t align8(uint64_t v) { return (v + 7) & ~(uint64_t)7; }
+
+} // namespace
+
+
+ContentArena::segment::~segment()
+{
+  if (view)
+    UnmapViewOfFile(view);
+  if (mapping)
+    CloseHandle(mapping);
+}
+
+
+ContentArena::ContentArena(const char * server_name, mwrs_size segment_size, int hot_threshold)
+    : server_name(server_name), segment_size(align8((uint64_t)segment_size)),
+      hot_threshold(hot_threshold > 0 ? hot_threshold : defaultHotThreshold)
+{
+  current = create_segment(next_generation++);
+  if (!current)
+    throw std::runtime_error("Cannot create arena segment");
+
+  std::thread t([this]() { run(); });
+  thread.swap(t);
+}
+
+ContentArena::~ContentArena()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stop_flag = true;
+  }
+  wake.notify_all();
+
+  if (thread.joinable())
+    thread.join();
+}
+
+
+bool ContentArena::find(const char * id, const source_stamp & stamp, location * location_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  auto it = entries.find(id);
+  if (it == entries.end())
+    return false;
+
+  // Replaced by `add` once read again
+  const source_stamp & s = it->second.stamp;
+  if (s.source != stamp.source || s.size != stamp.size || s.mtime != stamp.mtime)
+    return false;
+
+  *location_out = acquire_locked(it->second);
+  return true;
+}
+
+
+bool ContentArena::record_access(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (++access_total > accessWindow)
+  {
+    accesses.clear();
+    access_total = 0;
+  }
+
+  return ++accesses[id] >= hot_threshold;
+}
+
+
+bool ContentArena::add(const char * id, const source_stamp & stamp, const std::string & data,
+                       location * location_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  auto it = entries.find(id);
+  if (it != entries.end())
+  {
+    const source_stamp & s = it->second.stamp;
+    if (s.source == stamp.source && s.size == stamp.size && s.mtime == stamp.mtime)
+    {
+      *location_out = acquire_locked(it->second);
+      return true;
+    }
+
+    erase_locked(it);
+  }
+
+  if (current->used + data.size() > segment_size)
+  {
+    // Make room for the next time
+    if (current->dead > 0 && !compact_requested)
+    {
+      compact_requested = true;
+      wake.notify_one();
+    }
+    return false;
+  }
+
+  entry e{append(current.get(), data.data(), (uint32_t)data.size()), (uint32_t)data.size(), stamp};
+  accesses.erase(id);
+
+  *location_out = acquire_locked(e);
+  entries.emplace(id, std::move(e));
+  return true;
+}
+
+
+void ContentArena::release(uint32_t generation)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (current->generation == generation)
+  {
+    --current->refs;
+    return;
+  }
+
+  for (auto it = retired.begin(); it != retired.end(); ++it)
+  {
+    if ((*it)->generation == generation)
+    {
+      if (--(*it)->refs == 0)
+        retired.erase(it);
+      return;
+    }
+  }
+}
+// ContentArena::release
+
+
+void ContentArena::invalidate(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  accesses.erase(id);
+
+  auto it = entries.find(id);
+  if (it != entries.end())
+    erase_locked(it);
+}
+
+
+void ContentArena::get_stats(mwrs_sv_stats * stats_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  stats_out->arena_entries   = entries.size();
+  stats_out->arena_used_size = current->used - current->dead;
+}
+
+
+std::unique_ptr<ContentArena::segment> ContentArena::create_segment(uint32_t generation)
+{
+  char name[mwrs_arena::name_max];
+  mwrs_arena::segment_name(name, server_name.c_str(), generation);
+
+  uint64_t size = sizeof(mwrs_arena_header) + segment_size;
+
+  std::unique_ptr<segment> seg(new segment);
+  seg->generation = generation;
+  seg->mapping    = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                    (DWORD)(size >> 32), (DWORD)size, name);
+  if (!seg->mapping)
+    return nullptr;
+
+  seg->view = (char *)MapViewOfFile(seg->mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)size);
+  if (!seg->view)
+    return nullptr;
+
+  mwrs_arena_header * header = (mwrs_arena_header *)seg->view;
+  header->magic              = mwrs_arena::magic;
+  header->generation         = generation;
+  header->size               = size;
+  return seg;
+}
+
+
+uint64_t ContentArena::append(segment * seg, const char * data, uint32_t size)
+{
+  uint64_t offset = sizeof(mwrs_arena_header) + seg->used;
+  std::memcpy(seg->view + offset, data, size);
+  seg->used += align8(size);
+  return offset;
+}
+
+
+ContentArena::location ContentArena::acquire_locked(const entry & e)
+{
+  ++current->refs;
+  return location{current->generation, e.offset, e.size};
+}
+
+
+void ContentArena::erase_locked(std::unordered_map<std::string, entry>::iterator it)
+{
+  current->dead += align8(it->second.size);
+  entries.erase(it);
+
+  if (current->dead > segment_size / 2 && !compact_requested)
+  {
+    compact_requested = true;
+    wake.notify_one();
+  }
+}
+
+
+// Clients may still have to map it, it is kept until its locations are released
+void ContentArena::retire_locked(std::unique_ptr<segment> seg)
+{
+  if (seg->refs > 0)
+    retired.push_back(std::move(seg));
+}
+
+
+void ContentArena::compact(std::unique_lock<std::mutex> & lock)
+{
+  segment * old = current.get();
+
+  // Contents of the old segment never change, they can be copied without the lock
+  std::vector<std::pair<std::string, entry>> live(entries.begin(), entries.end());
+  uint32_t generation = next_generation++;
+
+  lock.unlock();
+
+  std::unique_ptr<segment> seg = create_segment(generation);
+
+  // Offset in the new segment, by offset in the old one
+  std::unordered_map<uint64_t, uint64_t> moved;
+  if (seg)
+  {
+    for (auto & e : live)
+      moved.emplace(e.second.offset,
+                    append(seg.get(), old->view + e.second.offset, e.second.size));
+  }
+
+  lock.lock();
+
+  if (!seg)
+    return;
+
+  // Entries may have been added or invalidated meanwhile, copy the new ones now
+  std::unordered_map<std::string, entry> compacted;
+  for (auto & e : entries)
+  {
+    auto it = moved.find(e.second.offset);
+    if (it != moved.end())
+    {
+      compacted.emplace(e.first, entry{it->second, e.second.size, e.second.stamp});
+    }
+    else if (seg->used + e.second.size <= segment_size)
+    {
+      uint64_t offset = append(seg.get(), old->view + e.second.offset, e.second.size);
+      compacted.emplace(e.first, entry{offset, e.second.size, e.second.stamp});
+    }
+  }
+
+  entries.swap(compacted);
+
+  retire_locked(std::move(current));
+  current = std::move(seg);
+}
+
+
+void ContentArena::run()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stop_flag)
+  {
+    if (compact_requested)
+    {
+      compact_requested = false;
+      compact(lock);
+      continue;
+    }
+
+    wake.wait(lock);
+  }
+}
+// ContentArena::run
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
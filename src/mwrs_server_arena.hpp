@@ -0,0 +1,165 @@
+/**
+ * @file    mwrs_server_arena.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_ARENA__HEADER_GUARD
+#define MWRS_SERVER_ARENA__HEADER_GUARD
+
+#include "mwrs_arena.hpp"
+#include <mwrs_server.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#  define VC_EXTRALEAN
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+/**
+ * Shared read-only arena of hot small resources, see mwrs_arena.hpp.
+ *
+ * Resources opened inline at least `hot_threshold` times are appended to the current segment,
+ * clients map it once and read them without a request for the content.
+ * Invalidated contents are left in place until the segment is compacted,
+ * in the background, into a new generation.
+ *
+ * Contents are only shared between opens of the same version of the same source.
+ * Every location given holds a reference on its generation until `release`,
+ * a retired generation is freed once no reference is left,
+ * clients keep their own view alive as long as they need it.
+ */
+class ContentArena
+{
+ public:
+  struct location
+  {
+    uint32_t generation;
+    uint64_t offset;
+    uint32_t size;
+  };
+
+  /**
+   * Identity and version of the source of a content.
+   */
+  struct source_stamp
+  {
+    std::string source;
+    uint64_t size;
+    uint64_t mtime;
+  };
+
+  ContentArena(const char * server_name, mwrs_size segment_size, int hot_threshold);
+  ~ContentArena();
+
+  ContentArena(const ContentArena &) = delete;
+  ContentArena & operator=(const ContentArena &) = delete;
+
+  /**
+   * Returns false if `id` is not in the arena, or if it was added from another source or version.
+   */
+  bool find(const char * id, const source_stamp & stamp, location * location_out);
+
+  /**
+   * Count an inline open of `id`, returns true once it is hot enough to be added.
+   */
+  bool record_access(const char * id);
+
+  /**
+   * Returns false if the content does not fit in the current segment.
+   */
+  bool add(const char * id, const source_stamp & stamp, const std::string & data,
+           location * location_out);
+
+  /**
+   * Give back the reference on `generation` held by a location from `find` or `add`.
+   */
+  void release(uint32_t generation);
+
+  void invalidate(const char * id);
+
+  void get_stats(mwrs_sv_stats * stats_out);
+
+
+ private:
+  struct segment
+  {
+    uint32_t generation = 0;
+    HANDLE mapping      = NULL;
+    char * view         = nullptr;
+
+    uint64_t used = 0;
+    uint64_t dead = 0;
+
+    // Locations given and not released yet
+    int refs = 0;
+
+    ~segment();
+  };
+
+  struct entry
+  {
+    uint64_t offset;
+    uint32_t size;
+    source_stamp stamp;
+  };
+
+  std::unique_ptr<segment> create_segment(uint32_t generation);
+
+  // Copy `size` bytes, returns the offset in `seg`
+  uint64_t append(segment * seg, const char * data, uint32_t size);
+
+  // Returns the location of `e` in the current segment, with a reference on it
+  location acquire_locked(const entry & e);
+
+  void erase_locked(std::unordered_map<std::string, entry>::iterator it);
+
+  void retire_locked(std::unique_ptr<segment> seg);
+
+  void compact(std::unique_lock<std::mutex> & lock);
+
+  void run();
+
+
+  const std::string server_name;
+  const uint64_t segment_size;
+  const int hot_threshold;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stop_flag         = false;
+  bool compact_requested = false;
+  std::thread thread;
+
+  std::unique_ptr<segment> current;
+  uint32_t next_generation = 1;
+  std::vector<std::unique_ptr<segment>> retired;
+
+  std::unordered_map<std::string, entry> entries;
+
+  // Inline opens, forgotten regularly so only recent accesses count
+  std::unordered_map<std::string, int> accesses;
+  unsigned access_total = 0;
+};
+// ContentArena
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_ARENA__HEADER_GUARD
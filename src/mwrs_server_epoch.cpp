@@ -0,0 +1,50 @@
+/**
+ * @file    mwrs_server_epoch.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_epoch.hpp"
+
+
+#include <functional>
+#include <thread>
+
+
+namespace mwrs_sv
+{
+
+unsigned EpochDomain::enter()
+{
+  unsigned slot = (unsigned)(std::hash<std::thread::id>()(std::this_thread::get_id()) % slotCount);
+
+  for (;;)
+  {
+    unsigned e       = epoch.load();
+    unsigned counter = (e & 1) * slotCount + slot;
+    counters[counter].readers.fetch_add(1);
+
+    // Counted in the epoch the writer will wait for
+    if (epoch.load() == e)
+      return counter;
+
+    counters[counter].readers.fetch_sub(1);
+  }
+}
+// EpochDomain::enter
+
+
+void EpochDomain::synchronize()
+{
+  std::unique_lock<std::mutex> lock(sync_mutex);
+
+  // New readers are counted with the other parity, and cannot see the unlinked data
+  unsigned previous = epoch.fetch_add(1) & 1;
+
+  for (unsigned i = 0; i < slotCount; ++i)
+    while (counters[previous * slotCount + i].readers.load() != 0)
+      std::this_thread::yield();
+}
+// EpochDomain::synchronize
+
+} // namespace mwrs_sv
@@ -0,0 +1,81 @@
+/**
+ * @file    mwrs_server_epoch.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_EPOCH__HEADER_GUARD
+#define MWRS_SERVER_EPOCH__HEADER_GUARD
+
+#include <atomic>
+#include <mutex>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Epoch-based reclamation for data read without locks.
+ *
+ * Readers enter a section, writers unlink what they want to free then call `synchronize`,
+ * which waits for every section that started before it.
+ * Readers only touch a counter picked from their thread id, so they rarely share a cache line.
+ */
+class EpochDomain
+{
+ public:
+  EpochDomain() = default;
+
+  EpochDomain(const EpochDomain &) = delete;
+  EpochDomain & operator=(const EpochDomain &) = delete;
+
+  class guard
+  {
+   public:
+    explicit guard(EpochDomain & domain) : domain(domain), counter(domain.enter()) {}
+    ~guard() { domain.leave(counter); }
+
+    guard(const guard &) = delete;
+    guard & operator=(const guard &) = delete;
+
+
+   private:
+    EpochDomain & domain;
+    unsigned counter;
+  };
+
+  /**
+   * Wait until every reader that could see unlinked data left its section.
+   * Must not be called from a reader section.
+   */
+  void synchronize();
+
+
+ private:
+  static const unsigned slotCount = 16;
+
+  // One per cache line
+  struct counter
+  {
+    std::atomic<int> readers{0};
+    char padding[64 - sizeof(std::atomic<int>)];
+  };
+
+  unsigned enter();
+
+  void leave(unsigned counter) { counters[counter].readers.fetch_sub(1); }
+
+
+  std::atomic<unsigned> epoch{0};
+
+  // Readers of even epochs, then of odd epochs
+  counter counters[2 * slotCount];
+
+  std::mutex sync_mutex;
+};
+// EpochDomain
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_EPOCH__HEADER_GUARD
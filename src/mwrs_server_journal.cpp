@@ -0,0 +1,97 @@
+/**
+ * @file    mwrs_server_journal.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_journal.hpp"
+
+
+#include <chrono>
+
+
+namespace mwrs_sv
+{
+
+namespace
+{
+
+const int defaultMaxEntries = 4096;
+
+} // namespace
+
+
+EventJournal::EventJournal(int max_entries)
+    : max_entries(max_entries > 0 ? (std::size_t)max_entries
+                                  : max_entries < 0 ? 0 : (std::size_t)defaultMaxEntries)
+{
+  // Microseconds, a restarted server starts after every version given by the previous one
+  first_seq = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count();
+  last_seq   = first_seq;
+  pruned_seq = first_seq;
+}
+
+
+uint64_t EventJournal::record(const char * id, mwrs_event_type type)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  uint64_t seq = ++last_seq;
+
+  if (max_entries == 0)
+  {
+    pruned_seq = seq;
+    return seq;
+  }
+
+  // Events of a pruned resource may be older than its entry
+  auto inserted = resources.emplace(id, resource{});
+  auto it       = inserted.first;
+  if (inserted.second)
+    it->second.dropped_seq = pruned_seq;
+  it->second.last_seq = seq;
+
+  it->second.events.emplace_back(seq, type);
+  order.push_back(&it->first);
+
+  if (order.size() > max_entries)
+  {
+    // Nodes are stable, the key outlives its events
+    auto oldest        = resources.find(*order.front());
+    resource & res     = oldest->second;
+    res.dropped_seq    = res.events.front().first;
+    res.events.pop_front();
+    order.pop_front();
+
+    // Every event of the resource was dropped, only the watermark remembers it
+    if (res.events.empty())
+    {
+      pruned_seq = res.last_seq;
+      resources.erase(oldest);
+    }
+  }
+
+  return seq;
+}
+// EventJournal::record
+
+
+uint64_t EventJournal::version(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  auto it = resources.find(id);
+  return it != resources.end() ? it->second.last_seq : pruned_seq;
+}
+
+
+void EventJournal::get_stats(mwrs_sv_stats * stats_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  stats_out->journal_entries = order.size();
+}
+
+} // namespace mwrs_sv
@@ -0,0 +1,119 @@
+/**
+ * @file    mwrs_server_journal.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_JOURNAL__HEADER_GUARD
+#define MWRS_SERVER_JOURNAL__HEADER_GUARD
+
+#include <mwrs_server.h>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Bounded journal of the events pushed for every resource.
+ *
+ * Every event gets a sequence number, the version of a resource is the number of its last event.
+ * Numbers start from the time the server started, so versions given by a previous server
+ * are always older than the journal.
+ * Clients replay the events they missed since a version, or learn that they must resync
+ * when the journal dropped some of them.
+ */
+class EventJournal
+{
+ public:
+  explicit EventJournal(int max_entries);
+
+  EventJournal(const EventJournal &) = delete;
+  EventJournal & operator=(const EventJournal &) = delete;
+
+  /**
+   * Returns the sequence number of the event.
+   */
+  uint64_t record(const char * id, mwrs_event_type type);
+
+  /**
+   * Version of `id`, every later event can be replayed if the journal did not drop it.
+   */
+  uint64_t version(const char * id);
+
+  /**
+   * Call `f(seq, type)` for every event of `id` after version `since`, in order.
+   * Returns false without calling `f` if some of them were dropped.
+   */
+  template <typename F>
+  bool replay(const char * id, uint64_t since, F f)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (since < first_seq || since > last_seq)
+      return false;
+
+    // Its events, if any, were all dropped
+    auto it = resources.find(id);
+    if (it == resources.end())
+      return since >= pruned_seq;
+
+    if (it->second.last_seq <= since)
+      return true;
+
+    const resource & res = it->second;
+    if (since < res.dropped_seq)
+      return false;
+
+    auto event = std::upper_bound(
+        res.events.begin(), res.events.end(), since,
+        [](uint64_t seq, const std::pair<uint64_t, mwrs_event_type> & e) { return seq < e.first; });
+
+    for (; event != res.events.end(); ++event)
+      f(event->first, event->second);
+    return true;
+  }
+
+  void get_stats(mwrs_sv_stats * stats_out);
+
+
+ private:
+  struct resource
+  {
+    uint64_t last_seq    = 0;
+    uint64_t dropped_seq = 0;
+
+    std::deque<std::pair<uint64_t, mwrs_event_type>> events;
+  };
+
+  const std::size_t max_entries;
+
+  std::mutex mutex;
+
+  // Sequence number of the server start, and of the last event
+  uint64_t first_seq;
+  uint64_t last_seq;
+
+  // Last event of the resources removed once all their events were dropped
+  uint64_t pruned_seq;
+
+  // Ids of the journaled events, oldest first
+  std::deque<const std::string *> order;
+
+  // Only resources with events in the journal
+  std::unordered_map<std::string, resource> resources;
+};
+// EventJournal
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_JOURNAL__HEADER_GUARD
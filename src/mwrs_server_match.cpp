@@ -0,0 +1,113 @@
+/**
+ * @file    mwrs_server_match.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_match.hpp"
+
+
+namespace mwrs_sv
+{
+
+GlobPattern::GlobPattern(const std::string & pattern)
+{
+  std::size_t wildcard = pattern.find_first_of("*?");
+  prefix               = pattern.substr(0, wildcard);
+
+  if (wildcard == std::string::npos)
+    return;
+
+  for (std::size_t i = wildcard; i < pattern.size(); ++i)
+  {
+    char c = pattern[i];
+    if (c == '?')
+    {
+      states.push_back(state{match_one, 0});
+    }
+    else if (c == '*')
+    {
+      state_kind kind = match_segment;
+      if (i + 1 < pattern.size() && pattern[i + 1] == '*')
+      {
+        kind = match_any;
+        ++i;
+      }
+
+      // Consecutive stars are a single one
+      if (!states.empty() && states.back().kind == match_any)
+        continue;
+      if (!states.empty() && states.back().kind == match_segment)
+        states.pop_back();
+
+      states.push_back(state{kind, 0});
+    }
+    else
+    {
+      states.push_back(state{match_char, c});
+    }
+  }
+}
+
+
+bool GlobPattern::match(const char * id) const
+{
+  id += prefix.size();
+
+  const std::size_t count = states.size();
+
+  // Active states, `count` is the accepting state
+  std::vector<char> active(count + 1, 0);
+  std::vector<char> next(count + 1, 0);
+
+  // Stars can match nothing, so they also activate the following state
+  auto close = [this, count](std::vector<char> & set) {
+    for (std::size_t i = 0; i < count; ++i)
+      if (set[i] && states[i].kind >= match_segment)
+        set[i + 1] = 1;
+  };
+
+  active[0] = 1;
+  close(active);
+
+  for (; *id; ++id)
+  {
+    char c = *id;
+    std::fill(next.begin(), next.end(), 0);
+
+    bool any = false;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+      if (!active[i])
+        continue;
+
+      switch (states[i].kind)
+      {
+      case match_char:
+        if (c == states[i].c)
+          next[i + 1] = any = 1;
+        break;
+      case match_one:
+        if (c != '/')
+          next[i + 1] = any = 1;
+        break;
+      case match_segment:
+        if (c != '/')
+          next[i] = any = 1;
+        break;
+      case match_any: next[i] = any = 1; break;
+      }
+    }
+
+    if (!any)
+      return false;
+
+    close(next);
+    active.swap(next);
+  }
+
+  return active[count] != 0;
+}
+// GlobPattern::match
+
+} // namespace mwrs_sv
@@ -0,0 +1,207 @@
+/**
+ * @file    mwrs_server_match.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_MATCH__HEADER_GUARD
+#define MWRS_SERVER_MATCH__HEADER_GUARD
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Compiled glob pattern.
+ *
+ * `?` matches one character and `*` any run of characters, both stop at '/'.
+ * `**` matches any run of characters, including '/'.
+ * The pattern is compiled to a small automaton, matching is linear in the length of the id.
+ */
+class GlobPattern
+{
+ public:
+  explicit GlobPattern(const std::string & pattern);
+
+  /**
+   * Literal characters before the first wildcard.
+   */
+  const std::string & literal_prefix() const { return prefix; }
+
+  /**
+   * Match `id`, which must start with `literal_prefix()`.
+   */
+  bool match(const char * id) const;
+
+
+ private:
+  enum state_kind
+  {
+    match_char,
+    match_one,
+    match_segment,
+    match_any,
+  };
+
+  struct state
+  {
+    state_kind kind;
+    char c;
+  };
+
+  std::string prefix;
+  std::vector<state> states;
+};
+// GlobPattern
+
+
+/**
+ * Compressed trie of `T` values indexed by key.
+ *
+ * Nodes are labeled with whole runs of characters,
+ * so a lookup only visits the nodes along the id and the values attached to them.
+ */
+template <typename T>
+class PrefixTrie
+{
+ public:
+  void insert(const std::string & key, T value) { insert(&root, key.c_str(), value); }
+
+  void erase(const std::string & key, T value) { erase(&root, key.c_str(), value); }
+
+  bool empty() const { return root.values.empty() && root.children.empty(); }
+
+  /**
+   * Call `f` with every value whose key is a prefix of `id`.
+   */
+  template <typename F>
+  void visit_prefixes(const char * id, F f) const
+  {
+    const node * n = &root;
+    for (;;)
+    {
+      for (const T & value : n->values)
+        f(value);
+
+      if (*id == 0)
+        return;
+
+      const node * child = n->find_child(*id);
+      if (!child || std::strncmp(id, child->label.c_str(), child->label.size()) != 0)
+        return;
+
+      id += child->label.size();
+      n = child;
+    }
+  }
+
+
+ private:
+  struct node
+  {
+    std::string label;
+    std::vector<T> values;
+    std::vector<std::unique_ptr<node>> children;
+
+    node * find_child(char c) const
+    {
+      for (const auto & child : children)
+        if (child->label[0] == c)
+          return child.get();
+      return nullptr;
+    }
+  };
+
+  static void insert(node * n, const char * key, T value)
+  {
+    for (;;)
+    {
+      if (*key == 0)
+      {
+        n->values.push_back(value);
+        return;
+      }
+
+      node * child = n->find_child(*key);
+      if (!child)
+      {
+        child        = new node;
+        child->label = key;
+        n->children.emplace_back(child);
+        child->values.push_back(value);
+        return;
+      }
+
+      std::size_t common = 0;
+      while (common < child->label.size() && key[common] == child->label[common])
+        ++common;
+
+      if (common < child->label.size())
+      {
+        // Split the child at the end of the common part
+        std::unique_ptr<node> tail(new node);
+        tail->label = child->label.substr(common);
+        tail->values.swap(child->values);
+        tail->children.swap(child->children);
+
+        child->label.resize(common);
+        child->children.push_back(std::move(tail));
+      }
+
+      key += common;
+      n = child;
+    }
+  }
+
+  // Returns true if `n` can be removed from its parent
+  static bool erase(node * n, const char * key, T value)
+  {
+    if (*key == 0)
+    {
+      auto it = std::find(n->values.begin(), n->values.end(), value);
+      if (it != n->values.end())
+        n->values.erase(it);
+    }
+    else
+    {
+      auto it = std::find_if(
+          n->children.begin(), n->children.end(),
+          [key](const std::unique_ptr<node> & c) { return c->label[0] == key[0]; });
+
+      if (it == n->children.end() ||
+          std::strncmp(key, (*it)->label.c_str(), (*it)->label.size()) != 0)
+        return false;
+
+      node * child = it->get();
+      if (erase(child, key + child->label.size(), value))
+      {
+        n->children.erase(it);
+      }
+      else if (child->values.empty() && child->children.size() == 1)
+      {
+        // Merge with its only child
+        std::unique_ptr<node> only = std::move(child->children[0]);
+        child->label += only->label;
+        child->values.swap(only->values);
+        child->children.swap(only->children);
+      }
+    }
+
+    return n->values.empty() && n->children.empty();
+  }
+
+
+  node root;
+};
+// PrefixTrie
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_MATCH__HEADER_GUARD
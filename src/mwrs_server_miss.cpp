@@ -0,0 +1,172 @@
+/**
+ * @file    mwrs_server_miss.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_miss.hpp"
+
+
+namespace mwrs_sv
+{
+
+namespace
+{
+
+// About 1% false positives with 10 bits per id
+const int filterBitsPerId = 10;
+const int filterHashes    = 7;
+
+
+// FNV-1a, the two halves are combined into the filter probes
+uint64_t hash_id(const char * id)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; *id; ++id)
+  {
+    hash ^= (unsigned char)*id;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+} // namespace
+
+
+MissCache::MissCache(int max_entries)
+    : max_entries(max_entries > 0 ? (size_t)max_entries : 0)
+{
+}
+
+
+bool MissCache::is_missing(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  bool missing = (!filter.empty() && !filter_test_locked(hash_id(id))) ||
+                 entries.find(id) != entries.end();
+
+  if (missing)
+    ++hits;
+  return missing;
+}
+// MissCache::is_missing
+
+
+uint64_t MissCache::epoch() const
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  return ready_epoch;
+}
+
+
+void MissCache::record(const char * id, uint64_t epoch)
+{
+  if (max_entries == 0)
+    return;
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  // Might have been created while the callback ran
+  if (epoch != ready_epoch)
+    return;
+
+  auto it = entries.find(id);
+  if (it != entries.end())
+  {
+    lru.splice(lru.begin(), lru, it->second);
+    return;
+  }
+
+  if (entries.size() >= max_entries)
+  {
+    entries.erase(lru.back());
+    lru.pop_back();
+  }
+
+  lru.emplace_front(id);
+  entries.emplace(lru.front(), lru.begin());
+}
+// MissCache::record
+
+
+void MissCache::on_ready(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  ++ready_epoch;
+
+  auto it = entries.find(id);
+  if (it != entries.end())
+  {
+    lru.erase(it->second);
+    entries.erase(it);
+  }
+
+  if (!filter.empty())
+    filter_add_locked(hash_id(id));
+}
+// MissCache::on_ready
+
+
+void MissCache::set_known(const char * const * ids, size_t count)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  ++ready_epoch;
+  filter.clear();
+  filter_mask = 0;
+
+  if (count == 0)
+    return;
+
+  // Rounded up to a power of two, leaves room for ids created later
+  uint64_t bits = 64;
+  while (bits < (uint64_t)count * filterBitsPerId)
+    bits <<= 1;
+
+  filter.assign((size_t)(bits / 64), 0);
+  filter_mask = bits - 1;
+
+  for (size_t i = 0; i < count; ++i)
+    filter_add_locked(hash_id(ids[i]));
+
+  // Declared ids might have been cached as missing
+  lru.clear();
+  entries.clear();
+}
+// MissCache::set_known
+
+
+void MissCache::get_stats(mwrs_sv_stats * stats_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  stats_out->miss_cache_entries = entries.size();
+  stats_out->miss_cache_hits    = hits;
+}
+
+
+void MissCache::filter_add_locked(uint64_t hash)
+{
+  uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+  for (int i = 0; i < filterHashes; ++i)
+  {
+    uint64_t bit = (h1 + i * h2) & filter_mask;
+    filter[bit >> 6] |= 1ULL << (bit & 63);
+  }
+}
+
+bool MissCache::filter_test_locked(uint64_t hash) const
+{
+  uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+  for (int i = 0; i < filterHashes; ++i)
+  {
+    uint64_t bit = (h1 + i * h2) & filter_mask;
+    if (!(filter[bit >> 6] & (1ULL << (bit & 63))))
+      return false;
+  }
+  return true;
+}
+
+} // namespace mwrs_sv
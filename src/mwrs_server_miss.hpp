@@ -0,0 +1,96 @@
+/**
+ * @file    mwrs_server_miss.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_MISS__HEADER_GUARD
+#define MWRS_SERVER_MISS__HEADER_GUARD
+
+#include <mwrs_server.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Negative lookup cache, answers probes for ids that do not exist without the callbacks.
+ *
+ * Ids the open or stat callback reported as not found are kept in a bounded LRU, if enabled.
+ * Entries do not expire, the server relies on READY events to learn that an id was created.
+ * The application can also declare every id it knows, they are then kept in a Bloom filter
+ * and any id outside of it is known to be missing.
+ * READY events remove the id from the LRU and add it to the filter.
+ */
+class MissCache
+{
+ public:
+  explicit MissCache(int max_entries);
+
+  MissCache(const MissCache &) = delete;
+  MissCache & operator=(const MissCache &) = delete;
+
+  /**
+   * Returns true if `id` is known not to exist.
+   */
+  bool is_missing(const char * id);
+
+  /**
+   * Value to give to `record`, taken before invoking the callback.
+   */
+  uint64_t epoch() const;
+
+  /**
+   * The callback reported `id` as not found.
+   * Ignored if `id` became ready since `epoch`.
+   */
+  void record(const char * id, uint64_t epoch);
+
+  void on_ready(const char * id);
+
+  /**
+   * Replace the set of known ids, an empty set removes the filter.
+   */
+  void set_known(const char * const * ids, size_t count);
+
+  void get_stats(mwrs_sv_stats * stats_out);
+
+
+ private:
+  void filter_add_locked(uint64_t hash);
+
+  bool filter_test_locked(uint64_t hash) const;
+
+
+  const size_t max_entries;
+
+  mutable std::mutex mutex;
+
+  // Incremented by every READY event
+  uint64_t ready_epoch = 0;
+
+  // Most recent miss first
+  std::list<std::string> lru;
+  std::unordered_map<std::string, std::list<std::string>::iterator> entries;
+
+  // Empty if no id was declared
+  std::vector<uint64_t> filter;
+  uint64_t filter_mask = 0;
+
+  mwrs_size hits = 0;
+};
+// MissCache
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_MISS__HEADER_GUARD
@@ -0,0 +1,364 @@
+/**
+ * @file    mwrs_server_monitor.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_monitor.hpp"
+
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <utility>
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+namespace
+{
+
+const DWORD notifyFilter =
+    FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+const int defaultMaxWatches = 256;
+
+
+// Paths are compared in lower case, with backslashes and no trailing separator
+void normalize(std::string & path)
+{
+  for (char & c : path)
+  {
+    if (c == '/')
+      c = '\\';
+    else if (c >= 'A' && c <= 'Z')
+      c = c - 'A' + 'a';
+  }
+
+  while (path.size() > 1 && path.back() == '\\')
+    path.pop_back();
+}
+
+bool full_path(const char * path, std::string * full_out)
+{
+  char buffer[MAX_PATH];
+  DWORD len = GetFullPathNameA(path, MAX_PATH, buffer, NULL);
+  if (len == 0 || len >= MAX_PATH)
+    return false;
+
+  full_out->assign(buffer, len);
+  normalize(*full_out);
+  return true;
+}
+
+mwrs_event_type event_from_action(DWORD action)
+{
+  switch (action)
+  {
+  case FILE_ACTION_ADDED:
+  case FILE_ACTION_RENAMED_NEW_NAME: return MWRS_EVENT_READY;
+  case FILE_ACTION_REMOVED: return MWRS_EVENT_DELETE;
+  case FILE_ACTION_RENAMED_OLD_NAME: return MWRS_EVENT_MOVE;
+  default: return MWRS_EVENT_UPDATE;
+  }
+}
+
+} // namespace
+
+
+ChangeMonitor::ChangeMonitor(const char * root, int max_watches, change_callback on_change)
+    : max_watches(max_watches > 0 ? max_watches : defaultMaxWatches),
+      on_change(std::move(on_change))
+{
+  if (root && root[0] && !full_path(root, &this->root))
+    this->root.clear();
+
+  port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+  if (!port)
+    throw std::runtime_error("CreateIoCompletionPort failed");
+
+  std::thread t([this]() { run(); });
+  thread.swap(t);
+}
+
+ChangeMonitor::~ChangeMonitor()
+{
+  // Completion key 0 stops the thread
+  PostQueuedCompletionStatus(port, 0, 0, NULL);
+
+  if (thread.joinable())
+    thread.join();
+
+  CloseHandle(port);
+}
+
+
+mwrs_ret ChangeMonitor::add(const char * id, const char * path)
+{
+  std::string full;
+  if (!full_path(path, &full))
+    return MWRS_E_ARGS;
+
+  std::string directory, file;
+  bool recursive = false;
+
+  if (!root.empty() && full.size() > root.size() + 1 && full.compare(0, root.size(), root) == 0 &&
+      full[root.size()] == '\\')
+  {
+    directory = root;
+    file      = full.substr(root.size() + 1);
+    recursive = true;
+  }
+  else
+  {
+    std::size_t sep = full.rfind('\\');
+    if (sep == std::string::npos)
+      return MWRS_E_ARGS;
+
+    directory = full.substr(0, sep);
+    file      = full.substr(sep + 1);
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  if (resources.find(id) != resources.end())
+    return MWRS_SUCCESS;
+
+  watch * w;
+
+  auto it = watches.find(directory);
+  if (it != watches.end())
+  {
+    w = it->second.get();
+  }
+  else
+  {
+    if ((int)watches.size() >= max_watches)
+      return MWRS_E_UNAVAIL;
+
+    std::unique_ptr<watch> created(new watch);
+    created->directory = directory;
+    created->recursive = recursive;
+
+    created->handle = CreateFileA(directory.c_str(), FILE_LIST_DIRECTORY,
+                                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                  OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                                  NULL);
+    if (created->handle == INVALID_HANDLE_VALUE)
+      return MWRS_E_NOTFOUND;
+
+    if (!CreateIoCompletionPort(created->handle, port, (ULONG_PTR)created.get(), 0) ||
+        !start_read(created.get()))
+    {
+      CloseHandle(created->handle);
+      return MWRS_E_SYSTEM;
+    }
+
+    w = created.get();
+    watches.emplace(directory, std::move(created));
+  }
+
+  w->files[file].push_back(id);
+  resources.emplace(id, monitored{w, file});
+  return MWRS_SUCCESS;
+}
+// ChangeMonitor::add
+
+
+void ChangeMonitor::remove(const char * id)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  auto it = resources.find(id);
+  if (it == resources.end())
+    return;
+
+  watch * w = it->second.w;
+
+  auto file_it = w->files.find(it->second.file);
+  assert(file_it != w->files.end());
+
+  std::vector<std::string> & ids = file_it->second;
+  ids.erase(std::find(ids.begin(), ids.end(), it->first));
+  if (ids.empty())
+    w->files.erase(file_it);
+
+  resources.erase(it);
+
+  if (w->files.empty())
+    close_watch_locked(w);
+}
+// ChangeMonitor::remove
+
+
+void ChangeMonitor::get_stats(mwrs_sv_stats * stats_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  stats_out->monitor_watches   = watches.size();
+  stats_out->monitor_resources = resources.size();
+}
+
+
+bool ChangeMonitor::start_read(watch * w)
+{
+  ZeroMemory(&w->overlapped, sizeof(w->overlapped));
+
+  if (!ReadDirectoryChangesW(w->handle, w->buffer, sizeof(w->buffer), w->recursive, notifyFilter,
+                             NULL, &w->overlapped, NULL))
+    return false;
+
+  w->reading = true;
+  return true;
+}
+
+
+void ChangeMonitor::close_watch_locked(watch * w)
+{
+  auto it = watches.find(w->directory);
+  assert(it != watches.end() && it->second.get() == w);
+
+  std::unique_ptr<watch> owned = std::move(it->second);
+  watches.erase(it);
+
+  if (!w->reading)
+  {
+    CloseHandle(w->handle);
+    return; // Deletes w
+  }
+
+  // The buffer must outlive the read, delete on completion
+  w->closing = true;
+  CancelIoEx(w->handle, &w->overlapped);
+  closing.push_back(std::move(owned));
+}
+
+
+void ChangeMonitor::on_completion(watch * w, DWORD error, DWORD length)
+{
+  std::vector<std::pair<std::string, mwrs_event_type>> changes;
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    w->reading = false;
+
+    if (w->closing)
+    {
+      CloseHandle(w->handle);
+      closing.erase(std::find_if(closing.begin(), closing.end(),
+                                 [w](const std::unique_ptr<watch> & v) { return v.get() == w; }));
+      return;
+    }
+
+    auto report_all = [&](mwrs_event_type type) {
+      for (auto & file : w->files)
+        for (auto & id : file.second)
+          changes.emplace_back(id, type);
+    };
+
+    if (error == ERROR_SUCCESS && length > 0)
+    {
+      const char * ptr = (const char *)w->buffer;
+      for (;;)
+      {
+        const FILE_NOTIFY_INFORMATION * info = (const FILE_NOTIFY_INFORMATION *)ptr;
+
+        char name[MAX_PATH];
+        int name_len = WideCharToMultiByte(CP_ACP, 0, info->FileName,
+                                           info->FileNameLength / sizeof(WCHAR), name,
+                                           sizeof(name), NULL, NULL);
+        if (name_len > 0)
+        {
+          std::string file(name, name_len);
+          normalize(file);
+
+          auto it = w->files.find(file);
+          if (it != w->files.end())
+            for (auto & id : it->second)
+              changes.emplace_back(id, event_from_action(info->Action));
+        }
+
+        if (info->NextEntryOffset == 0)
+          break;
+        ptr += info->NextEntryOffset;
+      }
+    }
+    else if (error == ERROR_SUCCESS || error == ERROR_NOTIFY_ENUM_DIR)
+    {
+      // Buffer overflow, changes were lost
+      report_all(MWRS_EVENT_UPDATE);
+    }
+
+    if (!start_read(w))
+    {
+      // Directory is gone, the watch stays idle until its resources are unwatched
+      report_all(MWRS_EVENT_DELETE);
+    }
+  }
+
+  for (auto & change : changes)
+    on_change(change.first.c_str(), change.second);
+}
+// ChangeMonitor::on_completion
+
+
+void ChangeMonitor::run()
+{
+  for (;;)
+  {
+    DWORD length        = 0;
+    ULONG_PTR key       = 0;
+    OVERLAPPED * unused = nullptr;
+
+    DWORD error = ERROR_SUCCESS;
+    if (!GetQueuedCompletionStatus(port, &length, &key, &unused, INFINITE))
+    {
+      error = GetLastError();
+      if (!unused)
+        break;
+    }
+
+    if (key == 0)
+      break;
+
+    on_completion((watch *)key, error, length);
+  }
+
+  // Cancel every read and wait for them, buffers must outlive them
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while (!watches.empty())
+    close_watch_locked(watches.begin()->second.get());
+
+  while (!closing.empty())
+  {
+    lock.unlock();
+
+    DWORD length        = 0;
+    ULONG_PTR key       = 0;
+    OVERLAPPED * unused = nullptr;
+    if (!GetQueuedCompletionStatus(port, &length, &key, &unused, INFINITE) && !unused)
+      break;
+
+    lock.lock();
+
+    if (key == 0)
+      continue;
+
+    watch * w = (watch *)key;
+    CloseHandle(w->handle);
+    closing.erase(std::find_if(closing.begin(), closing.end(),
+                               [w](const std::unique_ptr<watch> & v) { return v.get() == w; }));
+  }
+
+  resources.clear();
+}
+// ChangeMonitor::run
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
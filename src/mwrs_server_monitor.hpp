@@ -0,0 +1,124 @@
+/**
+ * @file    mwrs_server_monitor.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_MONITOR__HEADER_GUARD
+#define MWRS_SERVER_MONITOR__HEADER_GUARD
+
+#include <mwrs_server.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#  define VC_EXTRALEAN
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+/**
+ * Detects changes to the files backing watched resources.
+ *
+ * Files are monitored with one ReadDirectoryChangesW watch per directory,
+ * all completing on a single I/O completion port, so the monitor costs nothing while idle.
+ * Files under `root` share a single recursive watch instead.
+ * At most `max_watches` directory watches are open at the same time.
+ *
+ * Changes are reported through `on_change`, from the monitor thread.
+ */
+class ChangeMonitor
+{
+ public:
+  typedef std::function<void(const char * id, mwrs_event_type type)> change_callback;
+
+  ChangeMonitor(const char * root, int max_watches, change_callback on_change);
+  ~ChangeMonitor();
+
+  ChangeMonitor(const ChangeMonitor &) = delete;
+  ChangeMonitor & operator=(const ChangeMonitor &) = delete;
+
+  /**
+   * Start monitoring the file at `path` for resource `id`.
+   * Returns E_UNAVAIL if every directory watch is in use.
+   */
+  mwrs_ret add(const char * id, const char * path);
+
+  /**
+   * Stop monitoring resource `id`, does nothing if it is not monitored.
+   */
+  void remove(const char * id);
+
+  void get_stats(mwrs_sv_stats * stats_out);
+
+
+ private:
+  struct watch
+  {
+    std::string directory;
+    bool recursive = false;
+
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OVERLAPPED overlapped{};
+    bool reading = false;
+
+    // Set once the watch has no file left, it is deleted when its read completes
+    bool closing = false;
+
+    // Resource ids, by lower case path relative to `directory`
+    std::unordered_map<std::string, std::vector<std::string>> files;
+
+    // DWORD aligned, as required by ReadDirectoryChangesW
+    DWORD buffer[16 * 1024];
+  };
+
+  struct monitored
+  {
+    watch * w;
+    std::string file;
+  };
+
+  bool start_read(watch * w);
+
+  void close_watch_locked(watch * w);
+
+  void on_completion(watch * w, DWORD error, DWORD length);
+
+  void run();
+
+
+  std::string root;
+  const int max_watches;
+  change_callback on_change;
+
+  HANDLE port = NULL;
+  std::thread thread;
+
+  std::mutex mutex;
+
+  // Open watches by lower case directory, closing watches are only in `closing`
+  std::unordered_map<std::string, std::unique_ptr<watch>> watches;
+  std::vector<std::unique_ptr<watch>> closing;
+
+  std::unordered_map<std::string, monitored> resources;
+};
+// ChangeMonitor
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_MONITOR__HEADER_GUARD
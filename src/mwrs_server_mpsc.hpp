@@ -0,0 +1,115 @@
+/**
+ * @file    mwrs_server_mpsc.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_MPSC__HEADER_GUARD
+#define MWRS_SERVER_MPSC__HEADER_GUARD
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Bounded lock-free ring, any thread can push and a single thread pops.
+ *
+ * Each cell has a sequence number telling whether it is free for the push at that position
+ * or holds the value for the pop at that position.
+ * Producers only contend on the tail index, never on a lock.
+ */
+template <typename T>
+class MpscRing
+{
+ public:
+  /**
+   * `capacity` must be a power of two.
+   */
+  explicit MpscRing(size_t capacity) : cells(new cell[capacity]), mask(capacity - 1)
+  {
+    for (size_t i = 0; i < capacity; ++i)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  MpscRing(const MpscRing &) = delete;
+  MpscRing & operator=(const MpscRing &) = delete;
+
+  /**
+   * Returns false if the ring is full.
+   */
+  bool try_push(T value)
+  {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    cell * c;
+
+    for (;;)
+    {
+      c             = &cells[pos & mask];
+      size_t seq    = c->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+      if (diff == 0)
+      {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+      {
+        return false;
+      }
+      else
+      {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    c->value = value;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+  // MpscRing::try_push
+
+  /**
+   * Only called by the consumer thread, returns false if the ring is empty.
+   */
+  bool try_pop(T * value_out)
+  {
+    cell * c = &cells[head & mask];
+    if (c->seq.load(std::memory_order_acquire) != head + 1)
+      return false;
+
+    *value_out = c->value;
+    c->seq.store(head + mask + 1, std::memory_order_release);
+    ++head;
+    return true;
+  }
+  // MpscRing::try_pop
+
+
+ private:
+  struct cell
+  {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  std::unique_ptr<cell[]> cells;
+  const size_t mask;
+
+  // Producers and the consumer do not share a cache line
+  std::atomic<size_t> tail{0};
+  char padding[64];
+  size_t head = 0;
+};
+// MpscRing
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_MPSC__HEADER_GUARD
@@ -0,0 +1,113 @@
+/**
+ * @file    mwrs_server_pool.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_pool.hpp"
+
+
+#include <atomic>
+
+
+namespace mwrs_sv
+{
+
+namespace pool
+{
+
+namespace
+{
+
+// 64 bytes to 4 KiB, messages are bounded by the pipe buffer
+const int classCount      = 7;
+const size_t smallestSize = 64;
+
+// Blocks kept by each thread, per class
+const int maxCached = 32;
+
+std::atomic<mwrs_size> heapAllocations{0};
+
+
+struct free_block
+{
+  free_block * next;
+};
+
+struct thread_cache
+{
+  free_block * blocks[classCount]{};
+  int counts[classCount]{};
+
+  ~thread_cache()
+  {
+    for (int c = 0; c < classCount; ++c)
+    {
+      while (blocks[c])
+      {
+        free_block * block = blocks[c];
+        blocks[c]          = block->next;
+        delete[] reinterpret_cast<char *>(block);
+      }
+    }
+  }
+};
+
+thread_local thread_cache cache;
+
+
+size_t class_size(int size_class) { return smallestSize << size_class; }
+
+} // namespace
+
+
+void * alloc(size_t size, int * size_class_out)
+{
+  int c = 0;
+  while (c < classCount && class_size(c) < size)
+    ++c;
+
+  if (c == classCount)
+  {
+    *size_class_out = -1;
+    ++heapAllocations;
+    return new char[size];
+  }
+
+  *size_class_out = c;
+
+  free_block * block = cache.blocks[c];
+  if (block)
+  {
+    cache.blocks[c] = block->next;
+    --cache.counts[c];
+    return block;
+  }
+
+  ++heapAllocations;
+  return new char[class_size(c)];
+}
+// alloc
+
+
+void free(void * block, int size_class)
+{
+  if (size_class < 0 || cache.counts[size_class] >= maxCached)
+  {
+    delete[] reinterpret_cast<char *>(block);
+    return;
+  }
+
+  free_block * cached      = (free_block *)block;
+  cached->next             = cache.blocks[size_class];
+  cache.blocks[size_class] = cached;
+  ++cache.counts[size_class];
+}
+// free
+
+
+void get_stats(mwrs_sv_stats * stats_out) { stats_out->message_heap_allocations = heapAllocations; }
+
+} // namespace pool
+
+} // namespace mwrs_sv
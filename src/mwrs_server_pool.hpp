@@ -0,0 +1,42 @@
+/**
+ * @file    mwrs_server_pool.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_POOL__HEADER_GUARD
+#define MWRS_SERVER_POOL__HEADER_GUARD
+
+#include <mwrs_server.h>
+
+#include <stddef.h>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Blocks of a few size classes, cached per thread.
+ *
+ * A freed block goes back to the cache of the thread freeing it,
+ * so a thread answering its own requests reuses the same blocks without touching the heap.
+ * Each cache is bounded, larger blocks and overflowing ones use the heap.
+ */
+namespace pool
+{
+
+/**
+ * Returns a block of at least `size` bytes, and its size class to give to `free`.
+ */
+void * alloc(size_t size, int * size_class_out);
+
+void free(void * block, int size_class);
+
+void get_stats(mwrs_sv_stats * stats_out);
+
+} // namespace pool
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_POOL__HEADER_GUARD
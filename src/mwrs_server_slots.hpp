@@ -0,0 +1,130 @@
+/**
+ * @file    mwrs_server_slots.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_SLOTS__HEADER_GUARD
+#define MWRS_SERVER_SLOTS__HEADER_GUARD
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace mwrs_sv
+{
+
+/**
+ * Table of `T` owned by slot, split in shards with their own lock.
+ *
+ * Inserting and removing are O(1): freed slots are reused, and their generation is incremented
+ * so a stale handle never reaches the value stored after it.
+ * Values are spread over the shards, concurrent inserts and removes rarely share a lock.
+ */
+template <typename T>
+class SlotTable
+{
+ public:
+  typedef uint64_t handle;
+
+  SlotTable() = default;
+
+  SlotTable(const SlotTable &) = delete;
+  SlotTable & operator=(const SlotTable &) = delete;
+
+  /**
+   * Take ownership of `value`, returns its handle.
+   */
+  handle insert(std::unique_ptr<T> value)
+  {
+    uint32_t shard_index = next_shard++ % shardCount;
+    shard & s            = shards[shard_index];
+
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    uint32_t index;
+    if (!s.free.empty())
+    {
+      index = s.free.back();
+      s.free.pop_back();
+    }
+    else
+    {
+      index = (uint32_t)s.slots.size();
+      s.slots.emplace_back();
+    }
+
+    slot & sl = s.slots[index];
+    sl.value  = std::move(value);
+    ++count;
+
+    return make_handle(index * shardCount + shard_index, sl.generation);
+  }
+  // SlotTable::insert
+
+  /**
+   * Give back the value of `h`, or null if it was already removed.
+   */
+  std::unique_ptr<T> remove(handle h)
+  {
+    shard & s      = shards[slot_of(h) % shardCount];
+    uint32_t index = slot_of(h) / shardCount;
+
+    std::unique_lock<std::mutex> lock(s.mutex);
+
+    if (index >= s.slots.size() || s.slots[index].generation != generation_of(h))
+      return nullptr;
+
+    slot & sl = s.slots[index];
+    ++sl.generation;
+    s.free.push_back(index);
+    --count;
+
+    return std::move(sl.value);
+  }
+  // SlotTable::remove
+
+  size_t size() const { return count; }
+
+
+ private:
+  static const uint32_t shardCount = 16;
+
+  struct slot
+  {
+    uint32_t generation = 1;
+    std::unique_ptr<T> value;
+  };
+
+  struct shard
+  {
+    std::mutex mutex;
+    std::vector<slot> slots;
+    std::vector<uint32_t> free;
+  };
+
+  static handle make_handle(uint32_t slot, uint32_t generation)
+  {
+    return (handle)generation << 32 | slot;
+  }
+
+  static uint32_t slot_of(handle h) { return (uint32_t)h; }
+
+  static uint32_t generation_of(handle h) { return (uint32_t)(h >> 32); }
+
+
+  shard shards[shardCount];
+  std::atomic<uint32_t> next_shard{0};
+  std::atomic<size_t> count{0};
+};
+// SlotTable
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_SLOTS__HEADER_GUARD
@@ -0,0 +1,231 @@
+/**
+ * @file    mwrs_server_status.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_status.hpp"
+
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+namespace
+{
+
+const mwrs_status emptyStatus{};
+
+uint32_t load_limit(const mwrs_status_table_header * table) { return table->slot_count / 4 * 3; }
+
+} // namespace
+
+
+StatusTable::StatusTable(const char * server_name, int slot_count)
+{
+  uint32_t count = 16;
+  while (count < (uint32_t)slot_count && count < (1u << 24))
+    count <<= 1;
+
+  size_t size = mwrs_status_table::table_size(count);
+
+  char name[64 + MWRS_SERVER_NAME_MAX];
+  std::snprintf(name, sizeof(name), "Local\\mwrs_%s_status", server_name);
+
+  mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                               (DWORD)((unsigned long long)size >> 32), (DWORD)size, name);
+  if (!mapping)
+    throw std::runtime_error("CreateFileMapping failed");
+
+  table = (mwrs_status_table_header *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+  if (!table)
+  {
+    CloseHandle(mapping);
+    throw std::runtime_error("MapViewOfFile failed");
+  }
+
+  // Pages are zeroed, every slot is empty
+  table->slot_count = count;
+  table->version    = mwrs_status_table::version;
+
+  // Clients check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  table->magic = mwrs_status_table::magic;
+}
+
+StatusTable::~StatusTable()
+{
+  UnmapViewOfFile(table);
+  CloseHandle(mapping);
+}
+
+
+mwrs_ret StatusTable::publish(const char * id, const mwrs_status * status)
+{
+  size_t len = std::strlen(id);
+  if (len >= MWRS_STATUS_ID_MAX)
+    return MWRS_E_ARGS;
+
+  uint64_t hash = mwrs_status_table::hash_id(id, len);
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  // Deleted slots lengthen every probe sequence, clear them before the table looks full
+  if (deleted > 0 && used + deleted >= load_limit(table))
+    rebuild_locked();
+
+  mwrs_status_slot * slot = find_locked(id, len, hash, true);
+  if (!slot)
+    return MWRS_E_UNAVAIL;
+
+  if (slot->state == MWRS_STATUS_SLOT_DELETED)
+    --deleted;
+  if (slot->state != MWRS_STATUS_SLOT_USED)
+    ++used;
+
+  write_slot(slot, MWRS_STATUS_SLOT_USED, hash, id, len, status);
+  return MWRS_SUCCESS;
+}
+
+
+void StatusTable::unpublish(const char * id)
+{
+  size_t len = std::strlen(id);
+  if (len >= MWRS_STATUS_ID_MAX)
+    return;
+
+  uint64_t hash = mwrs_status_table::hash_id(id, len);
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  mwrs_status_slot * slot = find_locked(id, len, hash, false);
+  if (!slot)
+    return;
+
+  --used;
+
+  mwrs_status_slot * slots = mwrs_status_table::slots(table);
+  uint32_t mask            = table->slot_count - 1;
+  uint32_t index           = (uint32_t)(slot - slots);
+
+  // Keep probe sequences going through this slot intact
+  if (slots[(index + 1) & mask].state != MWRS_STATUS_SLOT_EMPTY)
+  {
+    write_slot(slot, MWRS_STATUS_SLOT_DELETED, slot->hash, slot->id, std::strlen(slot->id),
+               &slot->status);
+    ++deleted;
+    return;
+  }
+
+  // Probe sequences stop at the next slot, the ones before it only led here
+  write_slot(slot, MWRS_STATUS_SLOT_EMPTY, 0, "", 0, &emptyStatus);
+  for (uint32_t i = (index - 1) & mask; slots[i].state == MWRS_STATUS_SLOT_DELETED;
+       i = (i - 1) & mask)
+  {
+    write_slot(&slots[i], MWRS_STATUS_SLOT_EMPTY, 0, "", 0, &emptyStatus);
+    --deleted;
+  }
+}
+
+
+// Clients looking up meanwhile may not find published ids, they then ask the server
+void StatusTable::rebuild_locked()
+{
+  struct published
+  {
+    uint64_t hash;
+    std::string id;
+    mwrs_status status;
+  };
+
+  mwrs_status_slot * slots = mwrs_status_table::slots(table);
+
+  std::vector<published> live;
+  live.reserve(used);
+
+  for (uint32_t i = 0; i < table->slot_count; ++i)
+  {
+    mwrs_status_slot * slot = &slots[i];
+    if (slot->state == MWRS_STATUS_SLOT_EMPTY)
+      continue;
+
+    if (slot->state == MWRS_STATUS_SLOT_USED)
+      live.push_back(published{slot->hash, slot->id, slot->status});
+    write_slot(slot, MWRS_STATUS_SLOT_EMPTY, 0, "", 0, &emptyStatus);
+  }
+
+  used    = 0;
+  deleted = 0;
+
+  for (const published & p : live)
+  {
+    mwrs_status_slot * slot = find_locked(p.id.c_str(), p.id.size(), p.hash, true);
+    write_slot(slot, MWRS_STATUS_SLOT_USED, p.hash, p.id.c_str(), p.id.size(), &p.status);
+    ++used;
+  }
+}
+// StatusTable::rebuild_locked
+
+
+mwrs_status_slot * StatusTable::find_locked(const char * id, size_t len, uint64_t hash,
+                                            bool insert)
+{
+  mwrs_status_slot * slots = mwrs_status_table::slots(table);
+  uint32_t mask            = table->slot_count - 1;
+
+  // The server is the only writer, slots can be read directly
+  mwrs_status_slot * reusable = nullptr;
+  for (uint32_t probe = 0; probe < table->slot_count; ++probe)
+  {
+    mwrs_status_slot * slot = &slots[(hash + probe) & mask];
+
+    if (slot->state == MWRS_STATUS_SLOT_USED)
+    {
+      if (slot->hash == hash && std::memcmp(slot->id, id, len + 1) == 0)
+        return slot;
+      continue;
+    }
+
+    if (!reusable)
+      reusable = slot;
+
+    if (slot->state == MWRS_STATUS_SLOT_EMPTY)
+      break;
+  }
+
+  if (!insert || used >= load_limit(table))
+    return nullptr;
+
+  return reusable;
+}
+
+
+void StatusTable::write_slot(mwrs_status_slot * slot, uint32_t state, uint64_t hash,
+                             const char * id, size_t len, const mwrs_status * status)
+{
+  uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+  slot->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // id and status may point into the slot
+  mwrs_status copy = *status;
+  std::memmove(slot->id, id, len);
+  slot->id[len] = 0;
+
+  slot->state  = state;
+  slot->hash   = hash;
+  slot->status = copy;
+
+  slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
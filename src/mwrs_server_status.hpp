@@ -0,0 +1,76 @@
+/**
+ * @file    mwrs_server_status.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_STATUS__HEADER_GUARD
+#define MWRS_SERVER_STATUS__HEADER_GUARD
+
+#include "mwrs_status_table.hpp"
+#include <mwrs_server.h>
+
+#include <mutex>
+
+#ifdef _WIN32
+#  define VC_EXTRALEAN
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+/**
+ * Writer side of the status table, see mwrs_status_table.hpp.
+ *
+ * The table lives in a named file mapping clients open read-only,
+ * so they answer `mwrs_stat` without a request.
+ * At most 3/4 of the slots are used, to keep probe sequences short.
+ * Deleted slots are cleared when no probe sequence needs them anymore,
+ * and the table is rebuilt before they fill it.
+ */
+class StatusTable
+{
+ public:
+  StatusTable(const char * server_name, int slot_count);
+  ~StatusTable();
+
+  StatusTable(const StatusTable &) = delete;
+  StatusTable & operator=(const StatusTable &) = delete;
+
+  /**
+   * Returns E_UNAVAIL if the table is full, E_ARGS if the id is too long.
+   */
+  mwrs_ret publish(const char * id, const mwrs_status * status);
+
+  void unpublish(const char * id);
+
+
+ private:
+  mwrs_status_slot * find_locked(const char * id, size_t len, uint64_t hash, bool insert);
+
+  void rebuild_locked();
+
+  void write_slot(mwrs_status_slot * slot, uint32_t state, uint64_t hash, const char * id,
+                  size_t len, const mwrs_status * status);
+
+
+  HANDLE mapping = NULL;
+  mwrs_status_table_header * table = nullptr;
+
+  std::mutex mutex;
+  uint32_t used    = 0;
+  uint32_t deleted = 0;
+};
+// StatusTable
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_STATUS__HEADER_GUARD
@@ -0,0 +1,589 @@
+/**
+ * @file    mwrs_server_store.cpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+#include "mwrs_server_store.hpp"
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#  include <compressapi.h>
+#endif
+
+
+namespace mwrs_sv
+{
+
+#ifdef _WIN32
+
+namespace
+{
+
+// Below this size, blocks are decompressed by the calling thread only
+const uint64_t parallel_min_size = 4 << 20;
+
+
+class ScopedHandle
+{
+ public:
+  explicit ScopedHandle(HANDLE handle = INVALID_HANDLE_VALUE) : handle(handle) {}
+  ~ScopedHandle() { reset(); }
+
+  ScopedHandle(const ScopedHandle &) = delete;
+  ScopedHandle & operator=(const ScopedHandle &) = delete;
+
+  bool valid() const { return handle != INVALID_HANDLE_VALUE && handle != NULL; }
+
+  HANDLE release()
+  {
+    HANDLE h = handle;
+    handle   = INVALID_HANDLE_VALUE;
+    return h;
+  }
+
+  void reset(HANDLE h = INVALID_HANDLE_VALUE)
+  {
+    if (valid())
+      CloseHandle(handle);
+    handle = h;
+  }
+
+  operator HANDLE() const { return handle; }
+
+  HANDLE handle;
+};
+
+
+class ScopedView
+{
+ public:
+  explicit ScopedView(void * view = nullptr) : view(view) {}
+  ~ScopedView()
+  {
+    if (view)
+      UnmapViewOfFile(view);
+  }
+
+  ScopedView(const ScopedView &) = delete;
+  ScopedView & operator=(const ScopedView &) = delete;
+
+  void * view;
+};
+
+
+struct unpack_job
+{
+  const mwrs_pack_header * header;
+  const uint32_t * block_sizes;
+  const uint64_t * block_offsets;
+
+  const char * src;
+  char * dst;
+
+  std::atomic<uint32_t> next_block{0};
+  std::atomic_bool failed{false};
+};
+
+
+void unpack_worker(unpack_job * job)
+{
+  DECOMPRESSOR_HANDLE decompressor = NULL;
+  if (!CreateDecompressor(job->header->algorithm, NULL, &decompressor))
+  {
+    job->failed = true;
+    return;
+  }
+
+  while (!job->failed)
+  {
+    uint32_t block = job->next_block++;
+    if (block >= job->header->block_count)
+      break;
+
+    uint64_t dst_offset = (uint64_t)block * job->header->block_size;
+    SIZE_T dst_len = (SIZE_T)std::min<uint64_t>(job->header->block_size,
+                                                 job->header->size - dst_offset);
+
+    const char * src = job->src + job->block_offsets[block];
+    SIZE_T src_len   = job->block_sizes[block] & ~pack_block_raw;
+
+    if (job->block_sizes[block] & pack_block_raw)
+    {
+      if (src_len != dst_len)
+        job->failed = true;
+      else
+        std::memcpy(job->dst + dst_offset, src, src_len);
+    }
+    else
+    {
+      SIZE_T written = 0;
+      if (!Decompress(decompressor, src, src_len, job->dst + dst_offset, dst_len, &written) ||
+          written != dst_len)
+        job->failed = true;
+    }
+  }
+
+  CloseDecompressor(decompressor);
+}
+
+
+HANDLE create_temp_file()
+{
+  char dir[MAX_PATH + 1];
+  char name[MAX_PATH + 1];
+
+  DWORD len = GetTempPathA(sizeof(dir), dir);
+  if (len == 0 || len > sizeof(dir))
+    return INVALID_HANDLE_VALUE;
+
+  if (GetTempFileNameA(dir, "mwr", 0, name) == 0)
+    return INVALID_HANDLE_VALUE;
+
+  // Temporary attribute keeps the data in the file cache when possible
+  return CreateFileA(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                     NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                     NULL);
+}
+
+
+bool write_all(HANDLE file, const void * data, uint64_t len)
+{
+  const char * ptr = (const char *)data;
+  while (len > 0)
+  {
+    DWORD chunk = (DWORD)std::min<uint64_t>(len, 1 << 30);
+    DWORD written;
+    if (!WriteFile(file, ptr, chunk, &written, NULL) || written != chunk)
+      return false;
+    ptr += chunk;
+    len -= chunk;
+  }
+  return true;
+}
+
+} // namespace
+
+
+PackCache::PackCache(mwrs_size max_size) : max_size(max_size) {}
+
+PackCache::~PackCache()
+{
+  for (auto & c : contents)
+    CloseHandle(c.second->file);
+}
+
+
+mwrs_ret PackCache::open(const char * path, HANDLE * handle_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  std::shared_ptr<entry> e;
+  for (;;)
+  {
+    auto it = entries.find(path);
+    if (it == entries.end())
+      break;
+
+    e = it->second;
+    loaded.wait(lock, [&e]() { return !e->loading; });
+
+    if (e->status != MWRS_SUCCESS)
+      return e->status;
+
+    // Evicted while we were waiting, look again
+    if (!e->data)
+    {
+      e.reset();
+      continue;
+    }
+
+    lru.splice(lru.begin(), lru, e->lru_it);
+    break;
+  }
+
+  if (!e)
+  {
+    // First open, do not hold the lock while reading the pack file
+    e.reset(new entry);
+    e->path = path;
+    entries.emplace(e->path, e);
+
+    lock.unlock();
+    content_hash hash{};
+    mwrs_size header_size = 0;
+    mwrs_ret ret          = pack_read_hash(path, &hash, &header_size);
+    lock.lock();
+
+    // Known content is shared without decompressing it again
+    // Contents in the map were hashed when loaded, a stale header is caught by its size
+    std::shared_ptr<content> data;
+    if (ret == MWRS_SUCCESS && !hash.empty())
+      data = find_content_locked(hash);
+    if (data && data->size != header_size)
+      data.reset();
+
+    if (ret == MWRS_SUCCESS && !data)
+    {
+      lock.unlock();
+      HANDLE file    = INVALID_HANDLE_VALUE;
+      mwrs_size size = 0;
+      ret            = pack_load(path, &file, &size, &hash);
+      lock.lock();
+
+      if (ret == MWRS_SUCCESS)
+      {
+        // Same content may have been loaded from another pack file meanwhile
+        data = find_content_locked(hash);
+        if (data)
+        {
+          CloseHandle(file);
+        }
+        else
+        {
+          data.reset(new content);
+          data->hash = hash;
+          data->file = file;
+          data->size = size;
+          contents.emplace(hash, data);
+          unique_size += size;
+        }
+      }
+    }
+
+    e->loading = false;
+    e->status  = ret;
+    loaded.notify_all();
+
+    if (ret != MWRS_SUCCESS)
+    {
+      // Let the next open try again
+      entries.erase(e->path);
+      return ret;
+    }
+
+    e->data = data;
+    ++data->refs;
+    logical_size += data->size;
+
+    lru.push_front(e);
+    e->lru_it = lru.begin();
+  }
+
+  *handle_out = ReOpenFile(e->data->file, GENERIC_READ,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0);
+
+  evict_locked();
+
+  if (*handle_out == INVALID_HANDLE_VALUE)
+    return MWRS_E_SERVERERR;
+
+  return MWRS_SUCCESS;
+}
+// PackCache::open
+
+
+void PackCache::get_stats(mwrs_sv_stats * stats_out)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  stats_out->cache_entries      = (mwrs_size)lru.size();
+  stats_out->cache_contents     = (mwrs_size)contents.size();
+  stats_out->cache_logical_size = logical_size;
+  stats_out->cache_unique_size  = unique_size;
+  stats_out->cache_dedup_ratio  = unique_size > 0 ? (double)logical_size / unique_size : 1.0;
+}
+// PackCache::get_stats
+
+
+std::shared_ptr<PackCache::content> PackCache::find_content_locked(const content_hash & hash)
+{
+  auto it = contents.find(hash);
+  if (it == contents.end())
+    return nullptr;
+  return it->second;
+}
+
+
+void PackCache::evict_locked()
+{
+  while (unique_size > max_size && !lru.empty())
+  {
+    std::shared_ptr<entry> e = lru.back();
+    lru.pop_back();
+    entries.erase(e->path);
+
+    logical_size -= e->data->size;
+    if (--e->data->refs == 0)
+    {
+      contents.erase(e->data->hash);
+      CloseHandle(e->data->file);
+      unique_size -= e->data->size;
+    }
+    e->data.reset();
+  }
+}
+// PackCache::evict_locked
+
+
+mwrs_ret pack_read_hash(const char * path, content_hash * hash_out, mwrs_size * size_out)
+{
+  ScopedHandle src(CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, NULL));
+  if (!src.valid())
+  {
+    DWORD err = GetLastError();
+    if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
+      return MWRS_E_NOTFOUND;
+    return MWRS_E_SYSTEM;
+  }
+
+  mwrs_pack_header header;
+  DWORD read;
+  if (!ReadFile(src, &header, sizeof(header), &read, NULL))
+    return MWRS_E_SYSTEM;
+
+  if (read != sizeof(header) || header.magic != pack_magic || header.version != pack_version)
+    return MWRS_E_SERVERERR;
+
+  hash_out->lo = header.hash_lo;
+  hash_out->hi = header.hash_hi;
+  *size_out    = (mwrs_size)header.size;
+  return MWRS_SUCCESS;
+}
+// pack_read_hash
+
+
+mwrs_ret pack_load(const char * path, HANDLE * file_out, mwrs_size * size_out,
+                   content_hash * hash_out)
+{
+  ScopedHandle src(CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, NULL));
+  if (!src.valid())
+  {
+    DWORD err = GetLastError();
+    if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
+      return MWRS_E_NOTFOUND;
+    return MWRS_E_SYSTEM;
+  }
+
+  LARGE_INTEGER src_size;
+  if (!GetFileSizeEx(src, &src_size))
+    return MWRS_E_SYSTEM;
+
+  if ((uint64_t)src_size.QuadPart < sizeof(mwrs_pack_header))
+    return MWRS_E_SERVERERR;
+
+  ScopedHandle src_mapping(CreateFileMappingA(src, NULL, PAGE_READONLY, 0, 0, NULL));
+  if (!src_mapping.valid())
+    return MWRS_E_SYSTEM;
+
+  ScopedView src_view(MapViewOfFile(src_mapping, FILE_MAP_READ, 0, 0, 0));
+  if (!src_view.view)
+    return MWRS_E_SYSTEM;
+
+  const char * src_data = (const char *)src_view.view;
+  uint64_t src_len      = (uint64_t)src_size.QuadPart;
+
+  // Validate header and block table
+  const mwrs_pack_header * header = (const mwrs_pack_header *)src_data;
+  if (header->magic != pack_magic || header->version != pack_version || header->block_size == 0)
+    return MWRS_E_SERVERERR;
+
+  if (header->block_count != (header->size + header->block_size - 1) / header->block_size)
+    return MWRS_E_SERVERERR;
+
+  uint64_t table_end = sizeof(mwrs_pack_header) + (uint64_t)header->block_count * 4;
+  if (table_end > src_len)
+    return MWRS_E_SERVERERR;
+
+  const uint32_t * block_sizes = (const uint32_t *)(src_data + sizeof(mwrs_pack_header));
+
+  std::vector<uint64_t> block_offsets(header->block_count);
+  uint64_t offset = table_end;
+  for (uint32_t i = 0; i < header->block_count; ++i)
+  {
+    block_offsets[i] = offset;
+    offset += block_sizes[i] & ~pack_block_raw;
+  }
+
+  if (offset > src_len)
+    return MWRS_E_SERVERERR;
+
+  ScopedHandle file(create_temp_file());
+  if (!file.valid())
+    return MWRS_E_SYSTEM;
+
+  content_hash stored;
+  stored.lo = header->hash_lo;
+  stored.hi = header->hash_hi;
+
+  if (header->size > 0)
+  {
+    LARGE_INTEGER file_size;
+    file_size.QuadPart = (long long)header->size;
+    if (!SetFilePointerEx(file, file_size, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+      return MWRS_E_SYSTEM;
+
+    // Decompress straight into the mapped temporary file
+    ScopedHandle dst_mapping(CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL));
+    if (!dst_mapping.valid())
+      return MWRS_E_SYSTEM;
+
+    ScopedView dst_view(MapViewOfFile(dst_mapping, FILE_MAP_WRITE, 0, 0, 0));
+    if (!dst_view.view)
+      return MWRS_E_SYSTEM;
+
+    unpack_job job;
+    job.header        = header;
+    job.block_sizes   = block_sizes;
+    job.block_offsets = block_offsets.data();
+    job.src           = src_data;
+    job.dst           = (char *)dst_view.view;
+
+    unsigned thread_count = 1;
+    if (header->size >= parallel_min_size)
+    {
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+      thread_count = std::min<unsigned>(thread_count, header->block_count);
+    }
+
+    std::vector<std::thread> threads;
+    try
+    {
+      for (unsigned i = 1; i < thread_count; ++i)
+        threads.emplace_back(unpack_worker, &job);
+    }
+    catch (const std::exception &)
+    {
+      // Run with the threads we got
+    }
+
+    unpack_worker(&job);
+
+    for (auto & t : threads)
+      t.join();
+
+    if (job.failed)
+      return MWRS_E_SERVERERR;
+
+    *hash_out = hash_content(dst_view.view, (size_t)header->size);
+  }
+  else
+  {
+    *hash_out = hash_content("", 0);
+  }
+
+  // Stale or corrupted pack file, its content would be shared with another one
+  if (!stored.empty() && stored != *hash_out)
+    return MWRS_E_SERVERERR;
+
+  *file_out = file.release();
+  *size_out = (mwrs_size)header->size;
+  return MWRS_SUCCESS;
+}
+// pack_load
+
+
+mwrs_ret pack_file(const char * src_path, const char * dst_path)
+{
+  ScopedHandle src(CreateFileA(src_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL));
+  if (!src.valid())
+  {
+    DWORD err = GetLastError();
+    if (err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND)
+      return MWRS_E_NOTFOUND;
+    return MWRS_E_SYSTEM;
+  }
+
+  LARGE_INTEGER src_size;
+  if (!GetFileSizeEx(src, &src_size))
+    return MWRS_E_SYSTEM;
+
+  mwrs_pack_header header{};
+  header.magic       = pack_magic;
+  header.version     = pack_version;
+  header.algorithm   = COMPRESS_ALGORITHM_XPRESS_HUFF;
+  header.block_size  = pack_block_size;
+  header.size        = (uint64_t)src_size.QuadPart;
+  header.block_count = (uint32_t)((header.size + header.block_size - 1) / header.block_size);
+
+  ScopedHandle dst(
+      CreateFileA(dst_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL));
+  if (!dst.valid())
+    return MWRS_E_SYSTEM;
+
+  // Block table and content hash are filled as we go, then written over the placeholders
+  std::vector<uint32_t> block_sizes(header.block_count);
+  if (!write_all(dst, &header, sizeof(header)) ||
+      !write_all(dst, block_sizes.data(), block_sizes.size() * 4))
+    return MWRS_E_SYSTEM;
+
+  COMPRESSOR_HANDLE compressor = NULL;
+  if (!CreateCompressor(header.algorithm, NULL, &compressor))
+    return MWRS_E_SYSTEM;
+
+  std::vector<char> raw(header.block_size);
+  std::vector<char> packed(header.block_size);
+
+  ContentHasher hasher;
+
+  mwrs_ret ret = MWRS_SUCCESS;
+  for (uint32_t i = 0; i < header.block_count && ret == MWRS_SUCCESS; ++i)
+  {
+    DWORD raw_len = (DWORD)std::min<uint64_t>(header.block_size,
+                                              header.size - (uint64_t)i * header.block_size);
+    DWORD read;
+    if (!ReadFile(src, raw.data(), raw_len, &read, NULL) || read != raw_len)
+    {
+      ret = MWRS_E_SYSTEM;
+      break;
+    }
+
+    hasher.update(raw.data(), raw_len);
+
+    // Fails with ERROR_INSUFFICIENT_BUFFER when the block does not compress
+    SIZE_T packed_len = 0;
+    if (Compress(compressor, raw.data(), raw_len, packed.data(), raw_len - 1, &packed_len))
+    {
+      block_sizes[i] = (uint32_t)packed_len;
+      if (!write_all(dst, packed.data(), packed_len))
+        ret = MWRS_E_SYSTEM;
+    }
+    else
+    {
+      block_sizes[i] = raw_len | pack_block_raw;
+      if (!write_all(dst, raw.data(), raw_len))
+        ret = MWRS_E_SYSTEM;
+    }
+  }
+
+  CloseCompressor(compressor);
+
+  if (ret != MWRS_SUCCESS)
+    return ret;
+
+  content_hash hash = hasher.finish();
+  header.hash_lo    = hash.lo;
+  header.hash_hi    = hash.hi;
+
+  LARGE_INTEGER begin;
+  begin.QuadPart = 0;
+  if (!SetFilePointerEx(dst, begin, NULL, FILE_BEGIN) || !write_all(dst, &header, sizeof(header)) ||
+      !write_all(dst, block_sizes.data(), block_sizes.size() * 4))
+    return MWRS_E_SYSTEM;
+
+  return MWRS_SUCCESS;
+}
+// pack_file
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
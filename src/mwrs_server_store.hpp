@@ -0,0 +1,166 @@
+/**
+ * @file    mwrs_server_store.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_SERVER_STORE__HEADER_GUARD
+#define MWRS_SERVER_STORE__HEADER_GUARD
+
+#include "mwrs_hash.hpp"
+#include <mwrs_server.h>
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#ifdef _WIN32
+#  define VC_EXTRALEAN
+#  define WIN32_LEAN_AND_MEAN
+#  include <windows.h>
+#endif
+
+
+// Pack file layout, integers are little-endian
+//
+//   mwrs_pack_header
+//   uint32_t block_sizes[block_count]
+//   compressed blocks, in order
+//
+// Every block but the last holds `block_size` uncompressed bytes.
+// Blocks are compressed independently so they can be decompressed in parallel.
+
+#pragma pack(push, 1)
+extern "C" {
+
+struct mwrs_pack_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t algorithm; // COMPRESS_ALGORITHM_*
+  uint32_t block_size;
+  uint64_t size; // uncompressed
+  uint32_t block_count;
+  uint32_t reserved;
+
+  // Hash of the uncompressed content, zero if unknown
+  uint64_t hash_lo;
+  uint64_t hash_hi;
+};
+
+} // extern "C"
+#pragma pack(pop)
+
+
+namespace mwrs_sv
+{
+
+const uint32_t pack_magic      = 0x5a52574d; // "MWRZ"
+const uint32_t pack_version    = 2;
+const uint32_t pack_block_size = 1 << 20;
+
+// Set in block_sizes when the block did not compress and is stored as-is
+const uint32_t pack_block_raw = 0x80000000;
+
+
+#ifdef _WIN32
+
+/**
+ * Cache of decompressed pack files.
+ *
+ * Contents are stored once per content hash, in a delete-on-close temporary file
+ * shared by every pack file with the same content.
+ * Every open gets its own handle (with its own file pointer) from ReOpenFile.
+ * Least recently used pack files are evicted when unique content grows over `max_size`,
+ * handles already given to clients stay valid until they are closed.
+ */
+class PackCache
+{
+ public:
+  explicit PackCache(mwrs_size max_size);
+  ~PackCache();
+
+  PackCache(const PackCache &) = delete;
+  PackCache & operator=(const PackCache &) = delete;
+
+  /**
+   * Open the decompressed content of the pack file at `path`.
+   * The returned handle is read-only and owned by the caller.
+   */
+  mwrs_ret open(const char * path, HANDLE * handle_out);
+
+  void get_stats(mwrs_sv_stats * stats_out);
+
+
+ private:
+  struct content
+  {
+    content_hash hash;
+    HANDLE file    = INVALID_HANDLE_VALUE;
+    mwrs_size size = 0;
+    int refs       = 0;
+  };
+
+  struct entry
+  {
+    std::string path;
+    std::shared_ptr<content> data;
+
+    bool loading    = true;
+    mwrs_ret status = MWRS_SUCCESS;
+
+    std::list<std::shared_ptr<entry>>::iterator lru_it;
+  };
+
+  std::shared_ptr<content> find_content_locked(const content_hash & hash);
+
+  void evict_locked();
+
+
+  const mwrs_size max_size;
+
+  // Sum of all entries, and of unique contents only
+  mwrs_size logical_size = 0;
+  mwrs_size unique_size  = 0;
+
+  std::mutex mutex;
+  std::condition_variable loaded;
+
+  // Most recently used first, only holds loaded entries
+  std::list<std::shared_ptr<entry>> lru;
+  std::unordered_map<std::string, std::shared_ptr<entry>> entries;
+
+  std::unordered_map<content_hash, std::shared_ptr<content>, content_hash_hasher> contents;
+};
+// PackCache
+
+
+/**
+ * Read the content hash and size stored in the pack file at `path`.
+ * `hash_out` is zero if the pack file does not carry one.
+ */
+mwrs_ret pack_read_hash(const char * path, content_hash * hash_out, mwrs_size * size_out);
+
+/**
+ * Decompress the pack file at `path` into a new delete-on-close temporary file.
+ * The content is always hashed, it is rejected if the pack file carries another hash.
+ */
+mwrs_ret pack_load(const char * path, HANDLE * file_out, mwrs_size * size_out,
+                   content_hash * hash_out);
+
+/**
+ * Compress `src_path` into a pack file at `dst_path`.
+ */
+mwrs_ret pack_file(const char * src_path, const char * dst_path);
+
+#endif // _WIN32
+
+} // namespace mwrs_sv
+
+#endif // MWRS_SERVER_STORE__HEADER_GUARD
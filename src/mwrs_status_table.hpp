@@ -0,0 +1,166 @@
+/**
+ * @file    mwrs_status_table.hpp
+ * @author  Bastien Brunnenstein
+ * @license BSD 3-Clause
+ */
+
+
+#ifndef MWRS_STATUS_TABLE__HEADER_GUARD
+#define MWRS_STATUS_TABLE__HEADER_GUARD
+
+#include <mwrs.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+
+// Status table published by the server in shared memory, see mwrs_sv_publish_status
+//
+//   mwrs_status_table_header
+//   mwrs_status_slot slots[slot_count]
+//
+// Open addressing with linear probing, `slot_count` is a power of two.
+// The server is the only writer. Each slot is guarded by a seqlock:
+// `seq` is odd while the slot is being written, readers retry if it was odd or changed.
+
+extern "C" {
+
+struct mwrs_status_table_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t reserved;
+};
+
+enum mwrs_status_slot_state
+{
+  MWRS_STATUS_SLOT_EMPTY = 0,
+  MWRS_STATUS_SLOT_USED,
+  MWRS_STATUS_SLOT_DELETED,
+};
+
+// Longest id that can be published, including the terminating null character
+enum
+{
+  MWRS_STATUS_ID_MAX = 208
+};
+
+struct mwrs_status_slot
+{
+  std::atomic<uint32_t> seq;
+
+  // Fields below are only valid if `seq` did not change while reading them
+  uint32_t state;
+  uint64_t hash;
+  mwrs_status status;
+  char id[MWRS_STATUS_ID_MAX];
+};
+
+} // extern "C"
+
+
+namespace mwrs_status_table
+{
+
+const uint32_t magic   = 0x5453574d; // "MWST"
+const uint32_t version = 2;
+
+static_assert(sizeof(mwrs_status_table_header) % 8 == 0, "Slots must stay aligned");
+static_assert(sizeof(std::atomic<uint32_t>) == 4, "Seqlock must be 32 bits");
+
+
+inline size_t table_size(uint32_t slot_count)
+{
+  return sizeof(mwrs_status_table_header) + (size_t)slot_count * sizeof(mwrs_status_slot);
+}
+
+inline mwrs_status_slot * slots(mwrs_status_table_header * table)
+{
+  return (mwrs_status_slot *)(table + 1);
+}
+
+inline const mwrs_status_slot * slots(const mwrs_status_table_header * table)
+{
+  return (const mwrs_status_slot *)(table + 1);
+}
+
+
+// FNV-1a, ids are short
+inline uint64_t hash_id(const char * id, size_t len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; ++i)
+  {
+    hash ^= (unsigned char)id[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+
+/**
+ * Copy a consistent snapshot of `slot`, retrying while the server writes it.
+ */
+inline void read_slot(const mwrs_status_slot * slot, mwrs_status_slot * copy_out)
+{
+  const size_t offset = offsetof(mwrs_status_slot, state);
+
+  for (;;)
+  {
+    uint32_t seq = slot->seq.load(std::memory_order_acquire);
+    if (seq & 1)
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    std::memcpy((char *)copy_out + offset, (const char *)slot + offset,
+                sizeof(mwrs_status_slot) - offset);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) == seq)
+      return;
+  }
+}
+
+
+/**
+ * Look up the status published for `id`.
+ * Returns false if it is not published, the caller must then ask the server.
+ */
+inline bool lookup(const mwrs_status_table_header * table, const char * id,
+                   mwrs_status * status_out)
+{
+  size_t len = std::strlen(id);
+  if (len >= MWRS_STATUS_ID_MAX)
+    return false;
+
+  uint64_t hash = hash_id(id, len);
+  uint32_t mask = table->slot_count - 1;
+
+  mwrs_status_slot copy;
+  for (uint32_t probe = 0; probe < table->slot_count; ++probe)
+  {
+    read_slot(&slots(table)[(hash + probe) & mask], &copy);
+
+    if (copy.state == MWRS_STATUS_SLOT_EMPTY)
+      return false;
+
+    if (copy.state == MWRS_STATUS_SLOT_USED && copy.hash == hash &&
+        std::memcmp(copy.id, id, len + 1) == 0)
+    {
+      *status_out = copy.status;
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace mwrs_status_table
+
+#endif // MWRS_STATUS_TABLE__HEADER_GUARD